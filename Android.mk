@@ -39,13 +39,29 @@ endif
 LOCAL_SRC_FILES:=                                      \
                   main.cpp                             \
                   CommandListener.cpp                  \
+                  DnsCache.cpp                         \
+                  DnsInflightTable.cpp                 \
+                  DnsPacket.cpp                        \
                   DnsProxyListener.cpp                 \
+                  DnsPtrCache.cpp                      \
+                  DnsServerStats.cpp                   \
+                  DnsSharedCache.cpp                   \
+                  DnsStats.cpp                         \
+                  DnsStubResolver.cpp                  \
+                  DnsWorkerPool.cpp                    \
                   NetdCommand.cpp                      \
                   NetlinkManager.cpp                   \
                   NetlinkHandler.cpp                   \
                   logwrapper.c                         \
                   TetherController.cpp                 \
                   NatController.cpp                    \
+                  IptablesBatch.cpp                    \
+                  IptablesBackend.cpp                  \
+                  IptablesExecBackend.cpp              \
+                  IptablesRestoreBackend.cpp           \
+                  IptablesTransaction.cpp              \
+                  IptablesState.cpp                    \
+                  Conntrack.cpp                        \
                   PppController.cpp                    \
                   PanController.cpp                    \
                   ThrottleController.cpp               \
@@ -69,10 +85,22 @@ ifdef WIFI_DRIVER_HAS_LGE_SOFTAP
 LOCAL_CFLAGS += -DLGE_SOFTAP
 endif
 
+# How NAT rules reach the kernel: "restore" (the default) applies each
+# batch with one iptables-restore, "exec" runs iptables once per rule and
+# "iptc" edits the tables with libiptc without starting any process.
+ifeq ($(NETD_IPTABLES_BACKEND),exec)
+LOCAL_CFLAGS += -DIPTABLES_BACKEND_EXEC
+else ifeq ($(NETD_IPTABLES_BACKEND),iptc)
+LOCAL_CFLAGS += -DIPTABLES_BACKEND_IPTC
+LOCAL_SRC_FILES += IptablesIptcBackend.cpp
+LOCAL_C_INCLUDES += external/iptables/include
+LOCAL_STATIC_LIBRARIES += libiptc
+endif
+
 #ifdef OMAP_ENHANCEMENT
 ifdef BOARD_SOFTAP_DEVICE
 LOCAL_CFLAGS += -D__BYTE_ORDER_LITTLE_ENDIAN
-LOCAL_STATIC_LIBRARIES := libhostapdcli
+LOCAL_STATIC_LIBRARIES += libhostapdcli
 LOCAL_C_INCLUDES += $(WILINK_INCLUDES)
 LOCAL_SRC_FILES += SoftapControllerTI.cpp
 else ifeq ($(WIFI_DRIVER_MODULE_NAME),ar6000)
@@ -130,4 +158,22 @@ LOCAL_SHARED_LIBRARIES := libcutils
 
 include $(BUILD_EXECUTABLE)
 
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:=          \
+                  dnsbench.c \
+
+LOCAL_MODULE:= dnsbench
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_C_INCLUDES := $(KERNEL_HEADERS)
+
+LOCAL_CFLAGS :=
+
+LOCAL_SHARED_LIBRARIES := libcutils
+
+include $(BUILD_EXECUTABLE)
+
+include $(call all-makefiles-under,$(LOCAL_PATH))
+
 endif # ifeq ($(BUILD_NETD,true)
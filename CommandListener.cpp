@@ -32,6 +32,7 @@
 #include "CommandListener.h"
 #include "ResponseCode.h"
 #include "ThrottleController.h"
+#include "DnsStats.h"
 
 
 extern "C" int ifc_init(void);
@@ -485,6 +486,13 @@ int CommandListener::NatCmd::runCommand(SocketClient *cli,
         rc = sNatCtrl->enableNat(argv[2], argv[3]);
     } else if (!strcmp(argv[1], "disable")) {
         rc = sNatCtrl->disableNat(argv[2], argv[3]);
+    } else if (!strcmp(argv[1], "switch")) {
+        if (argc != 5) {
+            cli->sendMsg(ResponseCode::CommandSyntaxError,
+                         "Usage: nat switch <int> <oldExt> <newExt>", false);
+            return 0;
+        }
+        rc = sNatCtrl->switchNat(argv[2], argv[3], argv[4]);
     } else {
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown nat cmd", false);
         return 0;
@@ -696,6 +704,16 @@ int CommandListener::ResolverCmd::runCommand(SocketClient *cli, int argc, char *
                     "Wrong number of arguments to resolver setdefaultif", false);
             return 0;
         }
+    } else if (!strcmp(argv[1], "getdefaultif")) { // "resolver getdefaultif"
+        if (argc != 2) {
+            cli->sendMsg(ResponseCode::CommandSyntaxError,
+                    "Wrong number of arguments to resolver getdefaultif", false);
+            return 0;
+        }
+        char iface[IFNAMSIZ];
+        sResolverCtrl->getDefaultInterface(iface, sizeof(iface));
+        cli->sendMsg(ResponseCode::ResolverDefaultIfResult, iface, false);
+        return 0;
     } else if (!strcmp(argv[1], "setifdns")) { // "resolver setifdns <iface> <dns1> <dns2> ..."
         if (argc >= 4) {
             rc = sResolverCtrl->setInterfaceDnsServers(argv[2], &argv[3], argc - 3);
@@ -714,6 +732,14 @@ int CommandListener::ResolverCmd::runCommand(SocketClient *cli, int argc, char *
 
             rc = sResolverCtrl->setInterfaceAddress(argv[2], &addr);
         }
+    } else if (!strcmp(argv[1], "clearifdns")) { // "resolver clearifdns <iface>"
+        if (argc == 3) {
+            rc = sResolverCtrl->clearInterfaceDnsServers(argv[2]);
+        } else {
+            cli->sendMsg(ResponseCode::CommandSyntaxError,
+                    "Wrong number of arguments to resolver clearifdns", false);
+            return 0;
+        }
     } else if (!strcmp(argv[1], "flushdefaultif")) { // "resolver flushdefaultif"
         if (argc == 2) {
             rc = sResolverCtrl->flushDefaultDnsCache();
@@ -730,6 +756,29 @@ int CommandListener::ResolverCmd::runCommand(SocketClient *cli, int argc, char *
                     "Wrong number of arguments to resolver setdefaultif", false);
             return 0;
         }
+    } else if (!strcmp(argv[1], "flushname")) { // "resolver flushname <name>"
+        if (argc == 3) {
+            rc = sResolverCtrl->flushDnsCacheName(argv[2]);
+        } else {
+            cli->sendMsg(ResponseCode::CommandSyntaxError,
+                    "Wrong number of arguments to resolver flushname", false);
+            return 0;
+        }
+    } else if (!strcmp(argv[1], "stats")) { // "resolver stats"
+        if (argc != 2) {
+            cli->sendMsg(ResponseCode::CommandSyntaxError,
+                    "Wrong number of arguments to resolver stats", false);
+            return 0;
+        }
+        DnsStats *stats = DnsStats::Instance();
+        char line[256];
+        for (int i = 0; i <= DnsStats::MAX_INTERFACES; i++) {
+            if (!stats->format(i, line, sizeof(line))) {
+                cli->sendMsg(ResponseCode::ResolverStatsResult, line, false);
+            }
+        }
+        cli->sendMsg(ResponseCode::CommandOkay, "Resolver stats completed", false);
+        return 0;
     } else {
         cli->sendMsg(ResponseCode::CommandSyntaxError,"Resolver unknown command", false);
         return 0;
@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+
+#define LOG_TAG "Conntrack"
+#define DBG 0
+
+#include <cutils/log.h>
+
+#include "Conntrack.h"
+
+// Largest CTA_TUPLE_ORIG we pass back to the kernel; IPv4 tuples are
+// well under this.
+static const int MAX_TUPLE_LEN = 128;
+
+static const struct nlattr *nlaNext(const struct nlattr *a, int *len) {
+    int adv = NLA_ALIGN(a->nla_len);
+    *len -= adv;
+    return (const struct nlattr *) ((const char *) a + adv);
+}
+
+static const void *nlaData(const struct nlattr *a) {
+    return (const char *) a + NLA_HDRLEN;
+}
+
+static int nlaLen(const struct nlattr *a) {
+    return a->nla_len - NLA_HDRLEN;
+}
+
+static const struct nlattr *findAttr(const void *attrs, int len, int type) {
+    const struct nlattr *a = (const struct nlattr *) attrs;
+
+    while (len >= NLA_HDRLEN && a->nla_len >= NLA_HDRLEN && a->nla_len <= len) {
+        if ((a->nla_type & NLA_TYPE_MASK) == type) {
+            return a;
+        }
+        a = nlaNext(a, &len);
+    }
+    return NULL;
+}
+
+// Gets CTA_IP_V4_SRC or CTA_IP_V4_DST out of a CTA_TUPLE_* attribute.
+static bool getTupleAddr(const struct nlattr *tuple, int which, in_addr_t *addr) {
+    const struct nlattr *ip = findAttr(nlaData(tuple), nlaLen(tuple), CTA_TUPLE_IP);
+    if (!ip) {
+        return false;
+    }
+    const struct nlattr *a = findAttr(nlaData(ip), nlaLen(ip), which);
+    if (!a || nlaLen(a) < (int) sizeof(*addr)) {
+        return false;
+    }
+    memcpy(addr, nlaData(a), sizeof(*addr));
+    return true;
+}
+
+int Conntrack::openSocket() {
+    struct sockaddr_nl nladdr;
+
+    int sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER);
+    if (sock < 0) {
+        return -1;
+    }
+    memset(&nladdr, 0, sizeof(nladdr));
+    nladdr.nl_family = AF_NETLINK;
+    if (bind(sock, (struct sockaddr *) &nladdr, sizeof(nladdr))) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+bool Conntrack::matches(const struct nlattr *attrs, int len, in_addr_t natAddr,
+                        in_addr_t srcNet, in_addr_t srcMask) {
+    const struct nlattr *orig = findAttr(attrs, len, CTA_TUPLE_ORIG);
+    const struct nlattr *reply = findAttr(attrs, len, CTA_TUPLE_REPLY);
+    in_addr_t origSrc;
+    in_addr_t replyDst;
+
+    if (!orig || !reply || !getTupleAddr(orig, CTA_IP_V4_SRC, &origSrc) ||
+        !getTupleAddr(reply, CTA_IP_V4_DST, &replyDst)) {
+        return false;
+    }
+    // Replies come back to natAddr, but the connection didn't start
+    // there: it was forwarded and masqueraded.
+    return replyDst == natAddr && origSrc != natAddr &&
+        (origSrc & srcMask) == (srcNet & srcMask);
+}
+
+int Conntrack::deleteFlow(int sock, const struct nlattr *origTuple) {
+    char buf[NLMSG_SPACE(sizeof(struct nfgenmsg)) + MAX_TUPLE_LEN];
+    struct nlmsghdr *nlh = (struct nlmsghdr *) buf;
+
+    if (origTuple->nla_len > MAX_TUPLE_LEN) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    memset(buf, 0, sizeof(buf));
+    nlh->nlmsg_len = NLMSG_LENGTH(sizeof(struct nfgenmsg)) + NLA_ALIGN(origTuple->nla_len);
+    nlh->nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_DELETE;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    struct nfgenmsg *nfg = (struct nfgenmsg *) NLMSG_DATA(nlh);
+    nfg->nfgen_family = AF_INET;
+    nfg->version = NFNETLINK_V0;
+    memcpy((char *) NLMSG_DATA(nlh) + NLMSG_ALIGN(sizeof(*nfg)), origTuple, origTuple->nla_len);
+
+    if (send(sock, buf, nlh->nlmsg_len, 0) < 0) {
+        return -1;
+    }
+    int len = recv(sock, buf, sizeof(buf), 0);
+    if (len < 0) {
+        return -1;
+    }
+    if (NLMSG_OK(nlh, (unsigned) len) && nlh->nlmsg_type == NLMSG_ERROR) {
+        struct nlmsgerr *err = (struct nlmsgerr *) NLMSG_DATA(nlh);
+        // Gone already is as good as deleted.
+        if (err->error && err->error != -ENOENT) {
+            errno = -err->error;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int Conntrack::deleteNatFlows(in_addr_t natAddr, in_addr_t srcNet, in_addr_t srcMask) {
+    struct {
+        struct nlmsghdr nlh;
+        struct nfgenmsg nfg;
+    } req;
+    char buf[8192];
+    int deleted = 0;
+
+    if (!srcMask) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Deletes go out on a second socket while the dump is in progress, as
+    // the dump socket only carries dump replies.
+    int dumpSock = openSocket();
+    if (dumpSock < 0) {
+        return -1;
+    }
+    int delSock = openSocket();
+    if (delSock < 0) {
+        close(dumpSock);
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = sizeof(req);
+    req.nlh.nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_GET;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nfg.nfgen_family = AF_INET;
+    req.nfg.version = NFNETLINK_V0;
+    if (send(dumpSock, &req, sizeof(req), 0) < 0) {
+        goto fail;
+    }
+
+    for (;;) {
+        int len = recv(dumpSock, buf, sizeof(buf), 0);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            goto fail;
+        }
+
+        struct nlmsghdr *nlh;
+        for (nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, (unsigned) len);
+             nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type == NLMSG_DONE) {
+                close(dumpSock);
+                close(delSock);
+                if (DBG) {
+                    LOGD("Deleted %d connections", deleted);
+                }
+                return deleted;
+            }
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                struct nlmsgerr *err = (struct nlmsgerr *) NLMSG_DATA(nlh);
+                errno = -err->error;
+                goto fail;
+            }
+
+            int hdrLen = NLMSG_LENGTH(NLMSG_ALIGN(sizeof(struct nfgenmsg)));
+            const void *attrs = (const char *) nlh + hdrLen;
+            int attrLen = nlh->nlmsg_len - hdrLen;
+            if (attrLen <= 0 || !matches((const struct nlattr *) attrs, attrLen, natAddr,
+                                         srcNet, srcMask)) {
+                continue;
+            }
+            if (deleteFlow(delSock, findAttr(attrs, attrLen, CTA_TUPLE_ORIG))) {
+                LOGW("Unable to delete connection (%s)", strerror(errno));
+                continue;
+            }
+            deleted++;
+        }
+    }
+
+fail:
+    int savedErrno = errno;
+    close(dumpSock);
+    close(delSock);
+    errno = savedErrno;
+    return -1;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CONNTRACK_H
+#define _CONNTRACK_H
+
+#include <netinet/in.h>
+
+struct nlattr;
+
+/* Talks to the kernel's connection tracking table over ctnetlink. */
+class Conntrack {
+public:
+    /*
+     * Deletes the IPv4 connections NATed to natAddr whose source is in
+     * srcNet/srcMask. srcMask must not be 0: a flush never spans every
+     * downstream. Returns how many were deleted, or -1 with errno set.
+     */
+    static int deleteNatFlows(in_addr_t natAddr, in_addr_t srcNet, in_addr_t srcMask);
+
+private:
+    static int openSocket();
+    static bool matches(const struct nlattr *attrs, int len, in_addr_t natAddr,
+                        in_addr_t srcNet, in_addr_t srcMask);
+    static int deleteFlow(int sock, const struct nlattr *origTuple);
+};
+
+#endif
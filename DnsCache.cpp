@@ -0,0 +1,937 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_TAG "DnsCache"
+#define DBG 0
+
+#include <cutils/atomic.h>
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include "DnsCache.h"
+
+// Answers kept per interface ("net.dnsproxy.cache_size").
+static const int DEFAULT_CACHE_SIZE = 1024;
+
+static const char SNAPSHOT_DIR[] = "/data/misc/dnsproxyd";
+static const char SNAPSHOT_FILE[] = "/data/misc/dnsproxyd/cache";
+static const char SNAPSHOT_TMP_FILE[] = "/data/misc/dnsproxyd/cache.tmp";
+static const int DEFAULT_SNAPSHOT_INTERVAL = 600;
+
+// How long past its TTL an answer may still be served while a refresh
+// is in flight ("net.dnsproxy.stale_secs").
+static const int DEFAULT_STALE_WINDOW = 30;
+// Entries hit this often are prefetched during the last PREFETCH_DIVISOR
+// part of their TTL, but never earlier than MIN_PREFETCH_MS before expiry.
+static const uint32_t HOT_HITS = 4;
+static const int PREFETCH_DIVISOR = 8;
+static const uint64_t MIN_PREFETCH_MS = 1000;
+// Minimum time between two refreshes asked for the same entry, so a
+// failing upstream is not hammered by every hit in the stale window.
+static const uint64_t REFRESH_BACKOFF_MS = 1000;
+
+/*
+ * Snapshot file layout, in host byte order since it never leaves the
+ * device: a SnapshotHeader, then count records, each a SnapshotRecord
+ * followed by the name, service, interface name, legacy answer and
+ * compact answer bytes. Strings are not NUL terminated; a NULL name or
+ * service has length NULL_STRING.
+ */
+static const uint32_t SNAPSHOT_MAGIC = 0x444e5353;  // "DNSS"
+static const uint32_t SNAPSHOT_VERSION = 1;
+static const uint16_t NULL_STRING = 0xffff;
+
+struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+};
+
+struct SnapshotRecord {
+    uint32_t expires;     // wall clock, seconds since the epoch
+    int32_t  flags;
+    int32_t  family;
+    int32_t  socktype;
+    int32_t  protocol;
+    uint16_t nameLen;
+    uint16_t serviceLen;
+    uint16_t ifaceLen;
+    uint16_t reserved;
+    uint32_t answerLen;
+    uint32_t compactLen;
+};
+
+struct DnsCacheEntry {
+    DnsCacheEntry *hashNext;
+    DnsCacheEntry *lruPrev;
+    DnsCacheEntry *lruNext;
+    uint32_t       hash;
+    uint64_t       expiresMs;
+    uint64_t       prefetchMs;   // hot entries are refreshed from here on
+    uint64_t       refreshedMs;  // when a refresh was last asked for
+    uint32_t       hits;
+    bool           stale;    // loaded from a snapshot, not refreshed yet
+    DnsAnswer     *answer;
+    uint32_t       sources[DnsCache::MAX_SOURCES];  // server generations, 0 if unused
+
+    char          *name;     // NULL for a NULL host
+    char          *service;  // NULL for a NULL service
+    int            flags;
+    int            family;
+    int            socktype;
+    int            protocol;
+    char           iface[IFNAMSIZ];
+};
+
+DnsAnswer *DnsAnswer::create(int len, int compactLen) {
+    DnsAnswer *a = (DnsAnswer *) malloc(sizeof(DnsAnswer) + len + compactLen);
+    if (!a) {
+        return NULL;
+    }
+    a->mRefs = 1;
+    a->mLen = len;
+    a->mCompactLen = compactLen;
+    return a;
+}
+
+void DnsAnswer::acquire() {
+    android_atomic_inc(&mRefs);
+}
+
+void DnsAnswer::release() {
+    if (android_atomic_dec(&mRefs) == 1) {
+        free(this);
+    }
+}
+
+DnsCache *DnsCache::sInstance = NULL;
+
+DnsCache *DnsCache::Instance() {
+    if (!sInstance)
+        sInstance = new DnsCache();
+    return sInstance;
+}
+
+DnsCache::DnsCache() {
+    char value[PROPERTY_VALUE_MAX];
+    int size = DEFAULT_CACHE_SIZE;
+
+    if (property_get("net.dnsproxy.cache_size", value, NULL) > 0) {
+        size = atoi(value);
+        if (size < 0) {
+            size = 0;
+        }
+    }
+    mMaxPerShard = (size + NUM_SHARDS - 1) / NUM_SHARDS;
+
+    mSnapshotInterval = DEFAULT_SNAPSHOT_INTERVAL;
+    if (property_get("net.dnsproxy.snapshot_secs", value, NULL) > 0) {
+        mSnapshotInterval = atoi(value);
+        if (mSnapshotInterval < 0 || mMaxPerShard == 0) {
+            mSnapshotInterval = 0;
+        }
+    }
+    mChanges = 0;
+
+    int staleWindow = DEFAULT_STALE_WINDOW;
+    if (property_get("net.dnsproxy.stale_secs", value, NULL) > 0) {
+        staleWindow = atoi(value);
+        if (staleWindow < 0) {
+            staleWindow = 0;
+        }
+    }
+    mStaleWindowMs = (uint64_t) staleWindow * 1000;
+
+    for (int i = 0; i < NUM_PARTITIONS * NUM_SHARDS; i++) {
+        Shard *shard = &mShards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        memset(shard->buckets, 0, sizeof(shard->buckets));
+        shard->lruHead = NULL;
+        shard->lruTail = NULL;
+        shard->count = 0;
+    }
+
+    pthread_mutex_init(&mPartitionLock, NULL);
+    mNumNamedPartitions = 0;
+    memset(mPartitionIfaces, 0, sizeof(mPartitionIfaces));
+    mPartitionsFullWarned = false;
+
+    pthread_mutex_init(&mIfaceLock, NULL);
+    mIfaceSeq = 0;
+    mDefaultIface[0] = '\0';
+}
+
+int DnsCache::partitionFor(const char *iface, bool create) {
+    // Lookups made before the default interface is known share a
+    // partition rather than claim one for good.
+    if (!iface || !*iface) {
+        return NUM_PARTITIONS - 1;
+    }
+
+    int n = android_atomic_acquire_load(&mNumNamedPartitions);
+    for (int i = 0; i < n; i++) {
+        // Bounded: a released partition may be renamed under us.
+        if (!strncmp(mPartitionIfaces[i], iface, IFNAMSIZ)) {
+            return i;
+        }
+    }
+    if (!create) {
+        return NUM_PARTITIONS - 1;
+    }
+
+    pthread_mutex_lock(&mPartitionLock);
+    n = mNumNamedPartitions;
+    int i;
+    int free = -1;
+    for (i = 0; i < n; i++) {
+        if (!strncmp(mPartitionIfaces[i], iface, IFNAMSIZ)) {
+            break;
+        }
+        if (free < 0 && !mPartitionIfaces[i][0]) {
+            free = i;
+        }
+    }
+    if (i == n) {
+        if (free >= 0) {
+            i = free;
+            strncpy(mPartitionIfaces[i], iface, IFNAMSIZ - 1);
+        } else if (n < NUM_PARTITIONS - 1) {
+            strncpy(mPartitionIfaces[n], iface, IFNAMSIZ - 1);
+            android_atomic_release_store(n + 1, &mNumNamedPartitions);
+        } else {
+            i = NUM_PARTITIONS - 1;
+            if (!mPartitionsFullWarned) {
+                LOGW("Out of DNS cache partitions; %s shares the last one", iface);
+                mPartitionsFullWarned = true;
+            }
+        }
+        if (DBG && i < NUM_PARTITIONS - 1) {
+            LOGD("Cache partition %d for '%s'", i, iface);
+        }
+    }
+    pthread_mutex_unlock(&mPartitionLock);
+    return i;
+}
+
+DnsCache::Shard *DnsCache::shardFor(int partition, uint32_t hash) {
+    return &mShards[partition * NUM_SHARDS + hash % NUM_SHARDS];
+}
+
+uint64_t DnsCache::nowMs() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t hashBytes(uint32_t h, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *) data;
+
+    // FNV-1a
+    while (len--) {
+        h ^= *p++;
+        h *= 16777619;
+    }
+    return h;
+}
+
+static uint32_t hashString(uint32_t h, const char *s) {
+    // Distinguish NULL from "" so that "^" and an empty name differ.
+    if (!s) {
+        return hashBytes(h, "\xff", 1);
+    }
+    return hashBytes(h, s, strlen(s) + 1);
+}
+
+static bool stringsEqual(const char *a, const char *b) {
+    if (!a || !b) {
+        return a == b;
+    }
+    return !strcmp(a, b);
+}
+
+uint32_t DnsCache::hashKey(const DnsCacheKey *key) {
+    uint32_t h = 2166136261u;
+    int ints[4] = { key->flags, key->family, key->socktype, key->protocol };
+
+    h = hashString(h, key->name);
+    h = hashString(h, key->service);
+    h = hashBytes(h, ints, sizeof(ints));
+    h = hashString(h, key->iface ? key->iface : "");
+    return h;
+}
+
+bool DnsCache::keysEqual(const DnsCacheKey *a, const DnsCacheKey *b) {
+    return a->flags == b->flags &&
+        a->family == b->family &&
+        a->socktype == b->socktype &&
+        a->protocol == b->protocol &&
+        stringsEqual(a->name, b->name) &&
+        stringsEqual(a->service, b->service) &&
+        !strcmp(a->iface ? a->iface : "", b->iface ? b->iface : "");
+}
+
+void DnsCache::copyKey(DnsCacheKey *dst, const DnsCacheKey *key) {
+    *dst = *key;
+    dst->name = key->name ? strdup(key->name) : NULL;
+    dst->service = key->service ? strdup(key->service) : NULL;
+    dst->iface = strdup(key->iface ? key->iface : "");
+}
+
+void DnsCache::freeKey(DnsCacheKey *key) {
+    free((char *) key->name);
+    free((char *) key->service);
+    free((char *) key->iface);
+}
+
+uint64_t DnsCache::prefetchTime(uint64_t expiresMs, uint64_t ttlMs) {
+    uint64_t lead = ttlMs / PREFETCH_DIVISOR;
+    if (lead < MIN_PREFETCH_MS) {
+        lead = MIN_PREFETCH_MS;
+    }
+    return (lead >= expiresMs) ? 0 : expiresMs - lead;
+}
+
+bool DnsCache::keyMatches(const DnsCacheEntry *e, uint32_t hash,
+                          const DnsCacheKey *key) {
+    return e->hash == hash &&
+        e->flags == key->flags &&
+        e->family == key->family &&
+        e->socktype == key->socktype &&
+        e->protocol == key->protocol &&
+        stringsEqual(e->name, key->name) &&
+        stringsEqual(e->service, key->service) &&
+        !strcmp(e->iface, key->iface ? key->iface : "");
+}
+
+void DnsCache::unlinkLocked(Shard *shard, DnsCacheEntry *e) {
+    if (e->lruPrev) {
+        e->lruPrev->lruNext = e->lruNext;
+    } else {
+        shard->lruHead = e->lruNext;
+    }
+    if (e->lruNext) {
+        e->lruNext->lruPrev = e->lruPrev;
+    } else {
+        shard->lruTail = e->lruPrev;
+    }
+    e->lruPrev = e->lruNext = NULL;
+}
+
+void DnsCache::pushFrontLocked(Shard *shard, DnsCacheEntry *e) {
+    e->lruPrev = NULL;
+    e->lruNext = shard->lruHead;
+    if (shard->lruHead) {
+        shard->lruHead->lruPrev = e;
+    } else {
+        shard->lruTail = e;
+    }
+    shard->lruHead = e;
+}
+
+void DnsCache::removeLocked(Shard *shard, DnsCacheEntry *e) {
+    DnsCacheEntry **pp = &shard->buckets[(e->hash / NUM_SHARDS) % NUM_BUCKETS];
+
+    while (*pp && *pp != e) {
+        pp = &(*pp)->hashNext;
+    }
+    if (*pp) {
+        *pp = e->hashNext;
+    }
+    unlinkLocked(shard, e);
+    shard->count--;
+
+    e->answer->release();
+    free(e->name);
+    free(e->service);
+    free(e);
+}
+
+DnsAnswer *DnsCache::lookup(const DnsCacheKey *key, bool *refresh, bool *stale) {
+    DnsAnswer *answer = NULL;
+    bool wantRefresh = false;
+    bool isStale = false;
+
+    if (refresh) {
+        *refresh = false;
+    }
+    if (stale) {
+        *stale = false;
+    }
+    int partition = partitionFor(key->iface, false);
+
+    uint32_t hash = hashKey(key);
+    Shard *shard = shardFor(partition, hash);
+    uint64_t now = nowMs();
+
+    pthread_mutex_lock(&shard->lock);
+    DnsCacheEntry *e = shard->buckets[(hash / NUM_SHARDS) % NUM_BUCKETS];
+    while (e && !keyMatches(e, hash, key)) {
+        e = e->hashNext;
+    }
+    if (e) {
+        bool expired = (e->expiresMs <= now);
+        if (expired && (!refresh || e->expiresMs + mStaleWindowMs <= now)) {
+            removeLocked(shard, e);
+        } else {
+            unlinkLocked(shard, e);
+            pushFrontLocked(shard, e);
+            answer = e->answer;
+            answer->acquire();
+            e->hits++;
+
+            isStale = e->stale || expired;
+            wantRefresh = isStale ||
+                (e->hits >= HOT_HITS && e->prefetchMs <= now);
+            if (wantRefresh) {
+                if (e->refreshedMs && e->refreshedMs + REFRESH_BACKOFF_MS > now) {
+                    wantRefresh = false;
+                } else {
+                    e->refreshedMs = now;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (refresh) {
+        *refresh = wantRefresh;
+    }
+    if (stale) {
+        *stale = isStale;
+    }
+    if (DBG) {
+        LOGD("lookup %s -> %s%s", key->name ? key->name : "[nullhost]",
+             answer ? "hit" : "miss", wantRefresh ? ", refreshing" : "");
+    }
+    return answer;
+}
+
+void DnsCache::insert(const DnsCacheKey *key, DnsAnswer *answer, int ttl,
+                      const uint32_t *sources, int numSources) {
+    if (ttl <= 0 || mMaxPerShard == 0) {
+        return;
+    }
+
+    DnsCacheEntry *n = (DnsCacheEntry *) calloc(1, sizeof(DnsCacheEntry));
+    if (!n) {
+        return;
+    }
+    n->hash = hashKey(key);
+    n->expiresMs = nowMs() + (uint64_t) ttl * 1000;
+    n->prefetchMs = prefetchTime(n->expiresMs, (uint64_t) ttl * 1000);
+    n->name = key->name ? strdup(key->name) : NULL;
+    n->service = key->service ? strdup(key->service) : NULL;
+    n->flags = key->flags;
+    n->family = key->family;
+    n->socktype = key->socktype;
+    n->protocol = key->protocol;
+    strncpy(n->iface, key->iface ? key->iface : "", sizeof(n->iface) - 1);
+    for (int i = 0, j = 0; i < numSources && j < MAX_SOURCES; i++) {
+        if (sources[i]) {
+            n->sources[j++] = sources[i];
+        }
+    }
+    n->answer = answer;
+    answer->acquire();
+    insertEntry(n, true);
+}
+
+void DnsCache::insertEntry(DnsCacheEntry *n, bool createPartition) {
+    DnsCacheKey key;
+    key.name = n->name;
+    key.service = n->service;
+    key.flags = n->flags;
+    key.family = n->family;
+    key.socktype = n->socktype;
+    key.protocol = n->protocol;
+    key.iface = n->iface;
+
+    Shard *shard = shardFor(partitionFor(n->iface, createPartition), n->hash);
+    DnsCacheEntry **bucket = &shard->buckets[(n->hash / NUM_SHARDS) % NUM_BUCKETS];
+
+    pthread_mutex_lock(&shard->lock);
+    for (DnsCacheEntry *e = *bucket; e; e = e->hashNext) {
+        if (keyMatches(e, n->hash, &key)) {
+            removeLocked(shard, e);
+            break;
+        }
+    }
+    while (shard->count >= mMaxPerShard && shard->lruTail) {
+        removeLocked(shard, shard->lruTail);
+    }
+    n->hashNext = *bucket;
+    *bucket = n;
+    pushFrontLocked(shard, n);
+    shard->count++;
+    pthread_mutex_unlock(&shard->lock);
+    android_atomic_inc(&mChanges);
+}
+
+void DnsCache::flush() {
+    for (int i = 0; i < NUM_PARTITIONS * NUM_SHARDS; i++) {
+        Shard *shard = &mShards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        while (shard->lruHead) {
+            removeLocked(shard, shard->lruHead);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    android_atomic_inc(&mChanges);
+}
+
+void DnsCache::flushInterface(const char *iface) {
+    flushPartition(partitionFor(iface, false), iface);
+}
+
+// Drops the entries of partition that belong to iface, or all of them if
+// iface is NULL.
+void DnsCache::flushPartition(int partition, const char *iface) {
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        Shard *shard = &mShards[partition * NUM_SHARDS + i];
+
+        pthread_mutex_lock(&shard->lock);
+        DnsCacheEntry *e = shard->lruHead;
+        while (e) {
+            DnsCacheEntry *next = e->lruNext;
+            if (!iface || !strcmp(e->iface, iface)) {
+                removeLocked(shard, e);
+            }
+            e = next;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    android_atomic_inc(&mChanges);
+}
+
+void DnsCache::releaseInterface(const char *iface) {
+    flushInterface(iface);
+
+    pthread_mutex_lock(&mPartitionLock);
+    int partition = -1;
+    for (int i = 0; i < mNumNamedPartitions; i++) {
+        if (iface && *iface && !strncmp(mPartitionIfaces[i], iface, IFNAMSIZ)) {
+            memset(mPartitionIfaces[i], 0, IFNAMSIZ);
+            mPartitionsFullWarned = false;
+            partition = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mPartitionLock);
+
+    // An insert that picked the partition before it was released may
+    // have landed since; leave nothing behind for its next owner.
+    if (partition >= 0) {
+        flushPartition(partition, NULL);
+    }
+}
+
+// Whether e may have come from one of the given server generations.
+static bool fromGenerations(const DnsCacheEntry *e, const uint32_t *gens, int numGens) {
+    bool known = false;
+
+    for (int i = 0; i < DnsCache::MAX_SOURCES; i++) {
+        if (!e->sources[i]) {
+            continue;
+        }
+        known = true;
+        for (int j = 0; j < numGens; j++) {
+            if (e->sources[i] == gens[j]) {
+                return true;
+            }
+        }
+    }
+    return !known;
+}
+
+void DnsCache::invalidate(const char *iface, const uint32_t *gens, int numGens) {
+    int dropped = 0;
+    int partition = partitionFor(iface, false);
+
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        Shard *shard = &mShards[partition * NUM_SHARDS + i];
+
+        pthread_mutex_lock(&shard->lock);
+        DnsCacheEntry *e = shard->lruHead;
+        while (e) {
+            DnsCacheEntry *next = e->lruNext;
+            if (!strcmp(e->iface, iface) && fromGenerations(e, gens, numGens)) {
+                removeLocked(shard, e);
+                dropped++;
+            }
+            e = next;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    if (dropped) {
+        android_atomic_inc(&mChanges);
+    }
+    if (DBG) {
+        LOGD("Invalidated %d answers for %s", dropped, iface);
+    }
+}
+
+void DnsCache::flushName(const char *name) {
+    int dropped = 0;
+
+    for (int i = 0; i < NUM_PARTITIONS * NUM_SHARDS; i++) {
+        Shard *shard = &mShards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        DnsCacheEntry *e = shard->lruHead;
+        while (e) {
+            DnsCacheEntry *next = e->lruNext;
+            if (e->name && !strcasecmp(e->name, name)) {
+                removeLocked(shard, e);
+                dropped++;
+            }
+            e = next;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    if (dropped) {
+        android_atomic_inc(&mChanges);
+    }
+}
+
+void DnsCache::setDefaultInterface(const char *iface) {
+    pthread_mutex_lock(&mIfaceLock);
+    int32_t seq = mIfaceSeq;
+    android_atomic_release_store(seq + 1, &mIfaceSeq);
+    android_memory_barrier();
+    strncpy(mDefaultIface, iface, sizeof(mDefaultIface) - 1);
+    mDefaultIface[sizeof(mDefaultIface) - 1] = '\0';
+    android_atomic_release_store(seq + 2, &mIfaceSeq);
+    pthread_mutex_unlock(&mIfaceLock);
+}
+
+void DnsCache::getDefaultInterface(char *buf, size_t len) {
+    for (;;) {
+        int32_t seq = android_atomic_acquire_load(&mIfaceSeq);
+        if (seq & 1) {
+            continue;
+        }
+        strncpy(buf, mDefaultIface, len - 1);
+        buf[len - 1] = '\0';
+        android_memory_barrier();
+        if (android_atomic_acquire_load(&mIfaceSeq) == seq) {
+            return;
+        }
+    }
+}
+
+// Appends len bytes to a growing snapshot buffer. Returns false if out
+// of memory.
+static bool appendBytes(uint8_t **buf, size_t *len, size_t *cap,
+                        const void *data, size_t dataLen) {
+    if (*len + dataLen > *cap) {
+        size_t newCap = *cap ? *cap * 2 : 16 * 1024;
+        while (newCap < *len + dataLen) {
+            newCap *= 2;
+        }
+        uint8_t *newBuf = (uint8_t *) realloc(*buf, newCap);
+        if (!newBuf) {
+            return false;
+        }
+        *buf = newBuf;
+        *cap = newCap;
+    }
+    memcpy(*buf + *len, data, dataLen);
+    *len += dataLen;
+    return true;
+}
+
+static uint16_t snapshotStringLen(const char *s) {
+    return s ? strlen(s) : NULL_STRING;
+}
+
+int DnsCache::saveSnapshot() {
+    uint8_t *buf = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    SnapshotHeader header;
+    bool ok;
+
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.count = 0;
+    ok = appendBytes(&buf, &len, &cap, &header, sizeof(header));
+
+    uint64_t now = nowMs();
+    uint32_t wallNow = time(NULL);
+    for (int i = 0; ok && i < NUM_PARTITIONS * NUM_SHARDS; i++) {
+        Shard *shard = &mShards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        for (DnsCacheEntry *e = shard->lruHead; ok && e; e = e->lruNext) {
+            if (e->expiresMs <= now + 1000) {
+                continue;
+            }
+            SnapshotRecord r;
+            memset(&r, 0, sizeof(r));
+            r.expires = wallNow + (e->expiresMs - now) / 1000;
+            r.flags = e->flags;
+            r.family = e->family;
+            r.socktype = e->socktype;
+            r.protocol = e->protocol;
+            r.nameLen = snapshotStringLen(e->name);
+            r.serviceLen = snapshotStringLen(e->service);
+            r.ifaceLen = strlen(e->iface);
+            r.answerLen = e->answer->getLength();
+            r.compactLen = e->answer->getCompactLength();
+
+            ok = appendBytes(&buf, &len, &cap, &r, sizeof(r)) &&
+                appendBytes(&buf, &len, &cap, e->name, e->name ? r.nameLen : 0) &&
+                appendBytes(&buf, &len, &cap, e->service, e->service ? r.serviceLen : 0) &&
+                appendBytes(&buf, &len, &cap, e->iface, r.ifaceLen) &&
+                appendBytes(&buf, &len, &cap, e->answer->getData(),
+                            r.answerLen + r.compactLen);
+            header.count++;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    if (!ok) {
+        LOGE("Unable to allocate DNS cache snapshot");
+        free(buf);
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(buf, &header, sizeof(header));
+
+    // Write a new file and rename it over the old one, so a crash while
+    // saving never leaves a torn snapshot behind.
+    mkdir(SNAPSHOT_DIR, 0700);
+    int fd = open(SNAPSHOT_TMP_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        LOGE("Unable to create %s (%s)", SNAPSHOT_TMP_FILE, strerror(errno));
+        free(buf);
+        return -1;
+    }
+    size_t off = 0;
+    while (off < len) {
+        ssize_t rc = write(fd, buf + off, len - off);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        off += rc;
+    }
+    free(buf);
+    if (off != len || fsync(fd)) {
+        LOGE("Unable to write %s (%s)", SNAPSHOT_TMP_FILE, strerror(errno));
+        close(fd);
+        unlink(SNAPSHOT_TMP_FILE);
+        return -1;
+    }
+    close(fd);
+    if (rename(SNAPSHOT_TMP_FILE, SNAPSHOT_FILE)) {
+        LOGE("Unable to rename %s (%s)", SNAPSHOT_TMP_FILE, strerror(errno));
+        unlink(SNAPSHOT_TMP_FILE);
+        return -1;
+    }
+    if (DBG) {
+        LOGD("Saved %u DNS cache entries", header.count);
+    }
+    return 0;
+}
+
+// Reads a snapshot string of length len at *pp into a new buffer.
+static bool readSnapshotString(const uint8_t **pp, const uint8_t *end, uint16_t len,
+                               char **out) {
+    if (len == NULL_STRING) {
+        *out = NULL;
+        return true;
+    }
+    if (end - *pp < len) {
+        return false;
+    }
+    *out = (char *) malloc(len + 1);
+    if (!*out) {
+        return false;
+    }
+    memcpy(*out, *pp, len);
+    (*out)[len] = '\0';
+    *pp += len;
+    return true;
+}
+
+int DnsCache::loadSnapshot() {
+    if (mSnapshotInterval == 0) {
+        return 0;
+    }
+
+    int fd = open(SNAPSHOT_FILE, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            LOGW("Unable to open %s (%s)", SNAPSHOT_FILE, strerror(errno));
+        }
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < (off_t) sizeof(SnapshotHeader)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOGW("Unable to map %s (%s)", SNAPSHOT_FILE, strerror(errno));
+        return -1;
+    }
+
+    const uint8_t *p = (const uint8_t *) map;
+    const uint8_t *end = p + st.st_size;
+    SnapshotHeader header;
+    memcpy(&header, p, sizeof(header));
+    p += sizeof(header);
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION) {
+        LOGW("Ignoring DNS cache snapshot with unknown format");
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    uint64_t now = nowMs();
+    uint32_t wallNow = time(NULL);
+    int loaded = 0;
+    for (uint32_t i = 0; i < header.count; i++) {
+        SnapshotRecord r;
+        if ((size_t) (end - p) < sizeof(r)) {
+            break;
+        }
+        memcpy(&r, p, sizeof(r));
+        p += sizeof(r);
+
+        char *name = NULL;
+        char *service = NULL;
+        char *iface = NULL;
+        if (r.ifaceLen >= IFNAMSIZ ||
+            !readSnapshotString(&p, end, r.nameLen, &name) ||
+            !readSnapshotString(&p, end, r.serviceLen, &service) ||
+            !readSnapshotString(&p, end, r.ifaceLen, &iface) ||
+            (uint64_t) (end - p) < (uint64_t) r.answerLen + r.compactLen) {
+            free(name);
+            free(service);
+            free(iface);
+            LOGW("Truncated DNS cache snapshot");
+            break;
+        }
+        const uint8_t *data = p;
+        p += r.answerLen + r.compactLen;
+
+        if (r.expires <= wallNow) {
+            free(name);
+            free(service);
+            free(iface);
+            continue;
+        }
+
+        DnsCacheEntry *n = (DnsCacheEntry *) calloc(1, sizeof(DnsCacheEntry));
+        DnsAnswer *answer = DnsAnswer::create(r.answerLen, r.compactLen);
+        if (!n || !answer) {
+            free(n);
+            if (answer) {
+                answer->release();
+            }
+            free(name);
+            free(service);
+            free(iface);
+            break;
+        }
+        memcpy(answer->getData(), data, r.answerLen + r.compactLen);
+
+        n->name = name;
+        n->service = service;
+        n->flags = r.flags;
+        n->family = r.family;
+        n->socktype = r.socktype;
+        n->protocol = r.protocol;
+        strcpy(n->iface, iface);
+        free(iface);
+        // The wall clock may be way off this early in boot (no NTP yet),
+        // so never trust a snapshot for longer than any TTL we cache.
+        uint64_t remaining = r.expires - wallNow;
+        if (remaining > (uint64_t) MAX_TTL) {
+            remaining = MAX_TTL;
+        }
+        n->expiresMs = now + remaining * 1000;
+        n->prefetchMs = prefetchTime(n->expiresMs, n->expiresMs - now);
+        n->stale = true;
+        n->answer = answer;
+
+        DnsCacheKey key;
+        key.name = n->name;
+        key.service = n->service;
+        key.flags = n->flags;
+        key.family = n->family;
+        key.socktype = n->socktype;
+        key.protocol = n->protocol;
+        key.iface = n->iface;
+        n->hash = hashKey(&key);
+        // The interfaces of the last boot may never come back; their
+        // answers wait in the shared partition instead of claiming one.
+        insertEntry(n, false);
+        loaded++;
+    }
+    munmap(map, st.st_size);
+
+    LOGI("Loaded %d DNS cache entries from snapshot", loaded);
+    return 0;
+}
+
+void *DnsCache::checkpointThread(void *obj) {
+    DnsCache *me = reinterpret_cast<DnsCache *>(obj);
+    int32_t saved = me->mChanges;
+
+    while (1) {
+        sleep(me->mSnapshotInterval);
+        int32_t changes = me->mChanges;
+        if (changes != saved && !me->saveSnapshot()) {
+            saved = changes;
+        }
+    }
+    return NULL;
+}
+
+int DnsCache::startCheckpointing() {
+    if (mSnapshotInterval == 0) {
+        return 0;
+    }
+
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int rc = pthread_create(&thread, &attr, DnsCache::checkpointThread, this);
+    pthread_attr_destroy(&attr);
+    if (rc) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+}
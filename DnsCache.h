@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DNS_CACHE_H
+#define _DNS_CACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <linux/if.h>
+
+/*
+ * An immutable, reference counted response as it goes out on the
+ * dnsproxyd socket. Cache hits send it without copying or allocating.
+ * It holds the answer in the legacy encoding and, optionally, in the
+ * compact one, right after each other.
+ */
+class DnsAnswer {
+    volatile int32_t mRefs;
+    int              mLen;
+    int              mCompactLen;
+
+    DnsAnswer() {}
+
+public:
+    static DnsAnswer *create(int len, int compactLen = 0);
+
+    void acquire();
+    void release();
+
+    int getLength() const { return mLen; }
+    uint8_t *getData() { return reinterpret_cast<uint8_t *>(this + 1); }
+
+    int getCompactLength() const { return mCompactLen; }
+    uint8_t *getCompactData() { return getData() + mLen; }
+};
+
+/*
+ * What a getaddrinfo answer depends on. Strings are borrowed; the cache
+ * copies whatever it keeps. A NULL name or service is a valid key.
+ */
+struct DnsCacheKey {
+    const char *name;
+    const char *service;
+    int         flags;
+    int         family;
+    int         socktype;
+    int         protocol;
+    const char *iface;
+};
+
+struct DnsCacheEntry;
+
+class DnsCache {
+public:
+    // Upstream servers an answer can have been built from, e.g. one for
+    // the AAAA and one for the A query.
+    static const int MAX_SOURCES = 2;
+    // Upper bound on any TTL, so a bad record can't pin an answer for days.
+    static const int MAX_TTL = 3600;
+
+private:
+    static const int NUM_SHARDS = 16;
+    static const int NUM_BUCKETS = 64;
+    // Each interface gets its own shards, so a busy network can't evict
+    // another's answers and their lookups never share a lock. Interfaces
+    // beyond the first NUM_PARTITIONS - 1 share the last partition.
+    static const int NUM_PARTITIONS = 4;
+
+    struct Shard {
+        pthread_mutex_t lock;
+        DnsCacheEntry  *buckets[NUM_BUCKETS];
+        DnsCacheEntry  *lruHead;  // most recently used
+        DnsCacheEntry  *lruTail;
+        int             count;
+    };
+
+    static DnsCache *sInstance;
+
+    Shard            mShards[NUM_PARTITIONS * NUM_SHARDS];
+    int              mMaxPerShard;
+    // Partition names are read without a lock; the lock serializes
+    // naming and releasing them. A released partition has an empty name
+    // until another interface takes it.
+    pthread_mutex_t  mPartitionLock;
+    volatile int32_t mNumNamedPartitions;
+    char             mPartitionIfaces[NUM_PARTITIONS - 1][IFNAMSIZ];
+    bool             mPartitionsFullWarned;
+    // The default interface is read on every request, so it is guarded
+    // by a sequence lock; the mutex only serializes writers.
+    pthread_mutex_t  mIfaceLock;
+    volatile int32_t mIfaceSeq;
+    char             mDefaultIface[IFNAMSIZ];
+    volatile int32_t mChanges;           // bumped by every insert and flush
+    uint64_t         mStaleWindowMs;
+    int              mSnapshotInterval;  // seconds, 0 to disable snapshots
+
+public:
+    virtual ~DnsCache() {}
+
+    static DnsCache *Instance();
+
+    /*
+     * Returns the answer for key with a reference held for the caller,
+     * or NULL if there is none.
+     *
+     * Callers that can refresh answers pass refresh. They also get
+     * answers up to "net.dnsproxy.stale_secs" past their expiry, and
+     * *refresh is set when the caller should resolve key again in the
+     * background: for expired answers, answers from a snapshot, and
+     * popular answers close to expiry. *stale, if given, is set for the
+     * expired answers and those from a snapshot. Without refresh, only
+     * unexpired answers are returned.
+     */
+    DnsAnswer *lookup(const DnsCacheKey *key, bool *refresh = NULL, bool *stale = NULL);
+
+    /*
+     * Caches answer for ttl seconds. The cache takes its own reference.
+     * sources holds the generations of the numSources servers (see
+     * DnsStubResolver) the answer came from; 0 entries are ignored.
+     * Answers without any are of unknown origin, e.g. from libc.
+     */
+    void insert(const DnsCacheKey *key, DnsAnswer *answer, int ttl,
+                const uint32_t *sources = NULL, int numSources = 0);
+
+    void flush();
+    void flushInterface(const char *iface);
+
+    /*
+     * Flushes iface and gives its partition back for another interface,
+     * e.g. when the interface has gone away.
+     */
+    void releaseInterface(const char *iface);
+
+    /*
+     * Drops the answers for iface that came from one of the numGens server
+     * generations in gens, along with those of unknown origin. Answers
+     * from servers that are still configured stay cached.
+     */
+    void invalidate(const char *iface, const uint32_t *gens, int numGens);
+
+    /* Drops the answers for name, case-insensitively, on all interfaces. */
+    void flushName(const char *name);
+
+    void setDefaultInterface(const char *iface);
+    void getDefaultInterface(char *buf, size_t len);
+
+    /*
+     * Snapshots let the cache survive a netd restart or a reboot. The
+     * snapshot is loaded once at startup; the entries that have not
+     * expired yet are served but marked stale, so that the first hit on
+     * each also triggers a refresh. The checkpoint thread rewrites the
+     * snapshot every "net.dnsproxy.snapshot_secs" seconds if the cache
+     * changed; 0 disables both.
+     */
+    int loadSnapshot();
+    int saveSnapshot();
+    int startCheckpointing();
+
+    static uint64_t nowMs();
+
+    static uint32_t hashKey(const DnsCacheKey *key);
+    static bool keysEqual(const DnsCacheKey *a, const DnsCacheKey *b);
+
+    /* Deep copy of key into dst; release with freeKey(). */
+    static void copyKey(DnsCacheKey *dst, const DnsCacheKey *key);
+    static void freeKey(DnsCacheKey *key);
+
+private:
+    DnsCache();
+
+    static uint64_t prefetchTime(uint64_t expiresMs, uint64_t ttlMs);
+    static bool keyMatches(const DnsCacheEntry *e, uint32_t hash,
+                           const DnsCacheKey *key);
+
+    static void *checkpointThread(void *obj);
+    void insertEntry(DnsCacheEntry *n, bool createPartition);
+
+    /*
+     * The partition holding the answers for iface. An interface seen for
+     * the first time gets a partition of its own if one is left, if
+     * create is set; otherwise it is looked for in the shared one.
+     */
+    int partitionFor(const char *iface, bool create);
+    Shard *shardFor(int partition, uint32_t hash);
+    void flushPartition(int partition, const char *iface);
+
+    void unlinkLocked(Shard *shard, DnsCacheEntry *e);
+    void pushFrontLocked(Shard *shard, DnsCacheEntry *e);
+    void removeLocked(Shard *shard, DnsCacheEntry *e);
+};
+
+#endif
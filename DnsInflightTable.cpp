@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "DnsInflightTable"
+#define DBG 0
+
+#include <cutils/log.h>
+
+#include "DnsInflightTable.h"
+
+DnsInflightTable::DnsInflightTable() {
+    for (int i = 0; i < NUM_LOCKS; i++) {
+        pthread_mutex_init(&mLocks[i], NULL);
+    }
+    memset(mBuckets, 0, sizeof(mBuckets));
+}
+
+bool DnsInflightTable::join(const DnsCacheKey *key, DnsReplyTarget *target) {
+    uint32_t hash = DnsCache::hashKey(key);
+    Query **bucket = &mBuckets[hash % NUM_BUCKETS];
+    pthread_mutex_t *lock = &mLocks[(hash % NUM_BUCKETS) % NUM_LOCKS];
+
+    pthread_mutex_lock(lock);
+    for (Query *q = *bucket; q; q = q->next) {
+        if (q->hash == hash && DnsCache::keysEqual(&q->key, key)) {
+            if (target) {
+                q->waiters->push_back(target);
+            }
+            pthread_mutex_unlock(lock);
+            if (DBG) {
+                LOGD("Coalesced lookup for %s", key->name ? key->name : "[nullhost]");
+            }
+            return true;
+        }
+    }
+
+    Query *q = new Query;
+    q->hash = hash;
+    DnsCache::copyKey(&q->key, key);
+    q->waiters = new DnsReplyTargetCollection();
+    q->next = *bucket;
+    *bucket = q;
+    pthread_mutex_unlock(lock);
+    return false;
+}
+
+void DnsInflightTable::finish(const DnsCacheKey *key, DnsReplyTargetCollection *waiters) {
+    uint32_t hash = DnsCache::hashKey(key);
+    pthread_mutex_t *lock = &mLocks[(hash % NUM_BUCKETS) % NUM_LOCKS];
+    Query *q = NULL;
+
+    pthread_mutex_lock(lock);
+    for (Query **pp = &mBuckets[hash % NUM_BUCKETS]; *pp; pp = &(*pp)->next) {
+        if ((*pp)->hash == hash && DnsCache::keysEqual(&(*pp)->key, key)) {
+            q = *pp;
+            *pp = q->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(lock);
+
+    if (!q) {
+        LOGW("finish() for a lookup that is not in flight");
+        return;
+    }
+
+    DnsReplyTargetCollection::iterator it;
+    for (it = q->waiters->begin(); it != q->waiters->end(); ++it) {
+        waiters->push_back(*it);
+    }
+    delete q->waiters;
+    DnsCache::freeKey(&q->key);
+    delete q;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DNS_INFLIGHT_TABLE_H
+#define _DNS_INFLIGHT_TABLE_H
+
+#include <pthread.h>
+
+#include <utils/List.h>
+
+#include "DnsCache.h"
+
+/*
+ * Somebody waiting for a getaddrinfo answer, e.g. a plain getaddrinfo
+ * client or one name of a batch. deliver() is called exactly once with
+ * the serialized answer (NULL if it could not be allocated) and the
+ * target is deleted afterwards.
+ */
+class DnsReplyTarget {
+public:
+    virtual ~DnsReplyTarget() {}
+    virtual void deliver(DnsAnswer *answer) = 0;
+};
+
+typedef android::List<DnsReplyTarget *> DnsReplyTargetCollection;
+
+/*
+ * Tracks the getaddrinfo lookups currently being resolved so that an
+ * identical request arriving meanwhile waits for the same answer instead
+ * of going upstream again.
+ */
+class DnsInflightTable {
+    static const int NUM_BUCKETS = 64;
+    // Buckets share locks round robin, so lookups of different names
+    // rarely contend.
+    static const int NUM_LOCKS = 16;
+
+    struct Query {
+        Query                    *next;
+        uint32_t                  hash;
+        DnsCacheKey               key;      // deep copy
+        DnsReplyTargetCollection *waiters;  // owned
+    };
+
+    pthread_mutex_t mLocks[NUM_LOCKS];
+    Query          *mBuckets[NUM_BUCKETS];
+
+public:
+    DnsInflightTable();
+    virtual ~DnsInflightTable() {}
+
+    /*
+     * Returns true if a lookup for key is already in flight, in which
+     * case the table takes target, if any, and attaches it as a waiter.
+     * Otherwise records a new in-flight lookup owned by the caller, who
+     * must finish() it.
+     */
+    bool join(const DnsCacheKey *key, DnsReplyTarget *target);
+
+    /*
+     * Ends the in-flight lookup for key and moves its waiters into
+     * waiters. The caller delivers the answer to them and deletes them.
+     */
+    void finish(const DnsCacheKey *key, DnsReplyTargetCollection *waiters);
+};
+
+#endif
@@ -0,0 +1,340 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+
+#define LOG_TAG "DnsPacket"
+#define DBG 0
+
+#include <cutils/log.h>
+
+#include "DnsPacket.h"
+
+// Maximum number of CNAMEs followed from the question to the answer.
+static const int MAX_CNAME_HOPS = 8;
+// Maximum number of compression pointers followed in one name.
+static const int MAX_NAME_JUMPS = 64;
+
+static uint16_t get16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+// Compares two names ignoring case and a trailing dot on either.
+static bool namesEqual(const char *a, const char *b) {
+    size_t alen = strlen(a);
+    size_t blen = strlen(b);
+
+    if (alen && a[alen - 1] == '.') {
+        alen--;
+    }
+    if (blen && b[blen - 1] == '.') {
+        blen--;
+    }
+    return alen == blen && !strncasecmp(a, b, alen);
+}
+
+int DnsPacket::buildQuery(uint8_t *buf, int buflen, uint16_t id,
+                          const char *name, int qtype) {
+    int namelen = strlen(name);
+
+    if (namelen && name[namelen - 1] == '.') {
+        namelen--;
+    }
+    // Header, encoded name (one more byte than the dotted form plus the
+    // root label), type and class.
+    if (namelen == 0 || namelen > 253 || HEADER_SIZE + namelen + 2 + 4 > buflen) {
+        return -1;
+    }
+
+    memset(buf, 0, HEADER_SIZE);
+    put16(buf, id);
+    buf[2] = 0x01;       // RD
+    put16(buf + 4, 1);   // QDCOUNT
+
+    uint8_t *p = buf + HEADER_SIZE;
+    const char *label = name;
+    const char *end = name + namelen;
+    while (label < end) {
+        const char *dot = (const char *) memchr(label, '.', end - label);
+        int len = (dot ? dot : end) - label;
+        if (len == 0 || len > 63) {
+            return -1;
+        }
+        *p++ = len;
+        memcpy(p, label, len);
+        p += len;
+        label += len + 1;
+    }
+    *p++ = 0;
+    put16(p, qtype);
+    put16(p + 2, CLASS_IN);
+    p += 4;
+
+    return p - buf;
+}
+
+int DnsPacket::reverseName(const DnsAddress *addr, char *buf, int buflen) {
+    static const char hex[] = "0123456789abcdef";
+    int n;
+
+    if (addr->family == AF_INET) {
+        const uint8_t *b = (const uint8_t *) &addr->addr.v4;
+        n = snprintf(buf, buflen, "%u.%u.%u.%u.in-addr.arpa", b[3], b[2], b[1], b[0]);
+    } else if (addr->family == AF_INET6) {
+        const uint8_t *b = (const uint8_t *) &addr->addr.v6;
+        // 32 nibbles, each followed by a dot, then the suffix
+        if (buflen < 32 * 2 + (int) sizeof("ip6.arpa")) {
+            return -1;
+        }
+        n = 0;
+        for (int i = 15; i >= 0; i--) {
+            buf[n++] = hex[b[i] & 0x0f];
+            buf[n++] = '.';
+            buf[n++] = hex[b[i] >> 4];
+            buf[n++] = '.';
+        }
+        strcpy(buf + n, "ip6.arpa");
+        return 0;
+    } else {
+        return -1;
+    }
+    return (n < 0 || n >= buflen) ? -1 : 0;
+}
+
+uint16_t DnsPacket::getId(const uint8_t *buf) {
+    return get16(buf);
+}
+
+int DnsPacket::skipName(const uint8_t *msg, int len, int offset) {
+    while (offset < len) {
+        int c = msg[offset];
+        if (c == 0) {
+            return offset + 1;
+        }
+        if ((c & 0xc0) == 0xc0) {
+            return (offset + 2 <= len) ? offset + 2 : -1;
+        }
+        if (c & 0xc0) {
+            return -1;
+        }
+        offset += c + 1;
+    }
+    return -1;
+}
+
+/*
+ * Reads the possibly compressed name at offset into out in dotted form.
+ * Returns the offset just past the name as it appears at offset, or -1.
+ */
+int DnsPacket::readName(const uint8_t *msg, int len, int offset,
+                        char *out, int outlen) {
+    int next = -1;
+    int jumps = 0;
+    int n = 0;
+
+    while (1) {
+        if (offset >= len) {
+            return -1;
+        }
+        int c = msg[offset];
+        if (c == 0) {
+            offset++;
+            break;
+        }
+        if ((c & 0xc0) == 0xc0) {
+            if (offset + 2 > len || ++jumps > MAX_NAME_JUMPS) {
+                return -1;
+            }
+            if (next < 0) {
+                next = offset + 2;
+            }
+            offset = ((c & 0x3f) << 8) | msg[offset + 1];
+            continue;
+        }
+        if (c & 0xc0) {
+            return -1;
+        }
+        if (offset + 1 + c > len || n + c + 2 > outlen) {
+            return -1;
+        }
+        if (n) {
+            out[n++] = '.';
+        }
+        memcpy(out + n, msg + offset + 1, c);
+        n += c;
+        offset += c + 1;
+    }
+    out[n] = '\0';
+    return (next >= 0) ? next : offset;
+}
+
+int DnsPacket::parseResponse(const uint8_t *msg, int len, uint16_t id,
+                             const char *name, int qtype, DnsResponse *resp) {
+    char owner[DnsResponse::MAX_NAME];
+    char cur[DnsResponse::MAX_NAME];
+
+    if (len < HEADER_SIZE || get16(msg) != id) {
+        return -1;
+    }
+    // Must be a response (QR) to a standard query with one question.
+    if (!(msg[2] & 0x80) || (msg[2] & 0x78) || get16(msg + 4) != 1) {
+        return -1;
+    }
+
+    int ancount = get16(msg + 6);
+    int nscount = get16(msg + 8);
+    int offset = readName(msg, len, HEADER_SIZE, owner, sizeof(owner));
+    if (offset < 0 || offset + 4 > len ||
+        !namesEqual(owner, name) ||
+        get16(msg + offset) != qtype ||
+        get16(msg + offset + 2) != CLASS_IN) {
+        if (DBG) {
+            LOGD("Response does not match question for %s", name);
+        }
+        return -1;
+    }
+    offset += 4;
+
+    memset(resp, 0, sizeof(*resp));
+    resp->rcode = msg[3] & 0x0f;
+    resp->truncated = (msg[2] & 0x02) != 0;
+    resp->ttl = -1;
+    if (resp->truncated) {
+        return 0;
+    }
+
+    int answers = offset;
+    uint32_t minTtl = 0x7fffffff;
+    strncpy(cur, name, sizeof(cur) - 1);
+    cur[sizeof(cur) - 1] = '\0';
+
+    // Follow the CNAME chain from the question to the final owner name.
+    for (int hops = 0; hops < MAX_CNAME_HOPS; hops++) {
+        bool followed = false;
+
+        offset = answers;
+        for (int i = 0; i < ancount; i++) {
+            offset = readName(msg, len, offset, owner, sizeof(owner));
+            if (offset < 0 || offset + 10 > len) {
+                return -1;
+            }
+            int type = get16(msg + offset);
+            int klass = get16(msg + offset + 2);
+            uint32_t ttl = get32(msg + offset + 4);
+            int rdlen = get16(msg + offset + 8);
+            offset += 10;
+            if (offset + rdlen > len) {
+                return -1;
+            }
+            if (type == TYPE_CNAME && klass == CLASS_IN && namesEqual(owner, cur)) {
+                if (readName(msg, len, offset, cur, sizeof(cur)) < 0) {
+                    return -1;
+                }
+                if (ttl < minTtl) {
+                    minTtl = ttl;
+                }
+                followed = true;
+                break;
+            }
+            offset += rdlen;
+        }
+        if (!followed) {
+            break;
+        }
+    }
+    strncpy(resp->canonName, cur, sizeof(resp->canonName) - 1);
+
+    offset = answers;
+    for (int i = 0; i < ancount; i++) {
+        offset = readName(msg, len, offset, owner, sizeof(owner));
+        if (offset < 0 || offset + 10 > len) {
+            return -1;
+        }
+        int type = get16(msg + offset);
+        int klass = get16(msg + offset + 2);
+        uint32_t ttl = get32(msg + offset + 4);
+        int rdlen = get16(msg + offset + 8);
+        offset += 10;
+        if (offset + rdlen > len) {
+            return -1;
+        }
+        if (type == qtype && klass == CLASS_IN && namesEqual(owner, cur) &&
+            resp->numAddrs < DnsResponse::MAX_ADDRS) {
+            DnsAddress *a = &resp->addrs[resp->numAddrs];
+            if (type == TYPE_A && rdlen == sizeof(a->addr.v4)) {
+                a->family = AF_INET;
+                memcpy(&a->addr.v4, msg + offset, rdlen);
+                resp->numAddrs++;
+            } else if (type == TYPE_AAAA && rdlen == sizeof(a->addr.v6)) {
+                a->family = AF_INET6;
+                memcpy(&a->addr.v6, msg + offset, rdlen);
+                resp->numAddrs++;
+            } else if (type == TYPE_PTR && !resp->ptrName[0]) {
+                if (readName(msg, len, offset, resp->ptrName, sizeof(resp->ptrName)) < 0) {
+                    return -1;
+                }
+            }
+            if (ttl < minTtl) {
+                minTtl = ttl;
+            }
+        }
+        offset += rdlen;
+    }
+
+    if (resp->numAddrs > 0 || resp->ptrName[0]) {
+        resp->ttl = minTtl;
+        return 0;
+    }
+
+    // Negative answer: the SOA in the authority section carries its TTL.
+    for (int i = 0; i < nscount; i++) {
+        offset = skipName(msg, len, offset);
+        if (offset < 0 || offset + 10 > len) {
+            break;
+        }
+        int type = get16(msg + offset);
+        uint32_t ttl = get32(msg + offset + 4);
+        int rdlen = get16(msg + offset + 8);
+        offset += 10;
+        if (offset + rdlen > len) {
+            break;
+        }
+        if (type == TYPE_SOA) {
+            int p = skipName(msg, len, offset);         // MNAME
+            p = (p < 0) ? -1 : skipName(msg, len, p);   // RNAME
+            if (p >= 0 && p + 20 <= offset + rdlen) {
+                uint32_t minimum = get32(msg + p + 16);
+                uint32_t negTtl = (minimum < ttl) ? minimum : ttl;
+                resp->ttl = (negTtl > 0x7fffffff) ? 0 : negTtl;
+            }
+            break;
+        }
+        offset += rdlen;
+    }
+    return 0;
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DNS_PACKET_H
+#define _DNS_PACKET_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+struct DnsAddress {
+    int family;  // AF_INET or AF_INET6
+    union {
+        struct in_addr  v4;
+        struct in6_addr v6;
+    } addr;
+};
+
+/*
+ * The parts of a response the resolver cares about. ttl is the smallest
+ * TTL of the records used to reach the answer or, for a negative answer,
+ * the negative caching TTL from the SOA record (-1 if there was none).
+ * ptrName is the first PTR target for a PTR question, empty if none.
+ */
+struct DnsResponse {
+    static const int MAX_ADDRS = 32;
+    static const int MAX_NAME = 256;
+
+    int        rcode;
+    bool       truncated;
+    int        ttl;
+    int        numAddrs;
+    DnsAddress addrs[MAX_ADDRS];
+    char       canonName[MAX_NAME];
+    char       ptrName[MAX_NAME];
+    uint32_t   serverGen;  // generation of the server that answered
+};
+
+class DnsPacket {
+public:
+    static const int HEADER_SIZE = 12;
+    static const int MAX_UDP_SIZE = 512;
+    static const int MAX_TCP_SIZE = 65535;
+
+    static const int TYPE_A = 1;
+    static const int TYPE_CNAME = 5;
+    static const int TYPE_SOA = 6;
+    static const int TYPE_PTR = 12;
+    static const int TYPE_AAAA = 28;
+    static const int CLASS_IN = 1;
+
+    static const int RCODE_NOERROR = 0;
+    static const int RCODE_FORMERR = 1;
+    static const int RCODE_SERVFAIL = 2;
+    static const int RCODE_NXDOMAIN = 3;
+
+    /*
+     * Writes a recursive query for name/qtype into buf. Returns its
+     * length, or -1 if name is not a valid domain name or buf is too
+     * small.
+     */
+    static int buildQuery(uint8_t *buf, int buflen, uint16_t id,
+                          const char *name, int qtype);
+
+    /*
+     * Writes the in-addr.arpa or ip6.arpa name of addr into buf. Returns
+     * 0, or -1 if the family is unknown or buf is too small.
+     */
+    static int reverseName(const DnsAddress *addr, char *buf, int buflen);
+
+    /* Returns the id of the query or response in buf. */
+    static uint16_t getId(const uint8_t *buf);
+
+    /*
+     * Parses a response to the query (id, name, qtype). Returns 0 and
+     * fills resp if msg is a well-formed answer to that exact question,
+     * -1 otherwise (the caller keeps waiting for the real answer).
+     */
+    static int parseResponse(const uint8_t *msg, int len, uint16_t id,
+                             const char *name, int qtype, DnsResponse *resp);
+
+private:
+    static int readName(const uint8_t *msg, int len, int offset,
+                        char *out, int outlen);
+    static int skipName(const uint8_t *msg, int len, int offset);
+};
+
+#endif
@@ -20,34 +20,682 @@
 #include <linux/if.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #define LOG_TAG "DnsProxyListener"
 #define DBG 0
 
+#include <cutils/atomic.h>
 #include <cutils/log.h>
+#include <cutils/properties.h>
 #include <sysutils/SocketClient.h>
 
 #include "DnsProxyListener.h"
+#include "DnsPtrCache.h"
+#include "DnsSharedCache.h"
+#include "ResponseCode.h"
+#include "DnsStats.h"
+#include "DnsStubResolver.h"
+
+// Requests allowed to wait for a worker before new ones are rejected.
+static const int MAX_QUEUED_PER_WORKER = 32;
+
+// libc does not tell us the TTL of the records behind an addrinfo list,
+// so its answers are only kept for a short, conservative time. The same
+// applies to negative answers that came without an SOA record.
+static const int DEFAULT_POSITIVE_TTL = 10;
+static const int DEFAULT_NEGATIVE_TTL = 5;
+// Time allowed for a reverse lookup through the stub resolver
+// ("net.dnsproxy.ptr_timeout_ms").
+static const int DEFAULT_PTR_TIMEOUT_MS = 4000;
+
+// Serializes writers of one client: frames produced by different workers
+// for the same socket must not interleave.
+static const int NUM_WRITE_LOCKS = 16;
+static pthread_mutex_t sWriteLocks[NUM_WRITE_LOCKS];
 
 DnsProxyListener::DnsProxyListener() :
                  FrameworkListener("dnsproxyd") {
-    registerCmd(new GetAddrInfoCmd());
-    registerCmd(new GetHostByAddrCmd());
+    for (int i = 0; i < NUM_WRITE_LOCKS; i++) {
+        pthread_mutex_init(&sWriteLocks[i], NULL);
+    }
+
+    int workers = DnsWorkerPool::defaultNumThreads();
+
+    mPool = new DnsWorkerPool(workers, workers * MAX_QUEUED_PER_WORKER);
+    if (mPool->start()) {
+        LOGE("Unable to start DNS worker pool (%s)", strerror(errno));
+    }
+    mInflight = new DnsInflightTable();
+    // Map the shared cache before workers start publishing to it.
+    DnsSharedCache::Instance();
+    mCommands = new DnsCommandCollection();
+    mPartials = new PartialCommandCollection();
+
+    registerDnsCmd(new GetAddrInfoCmd(mPool, mInflight));
+    registerDnsCmd(new GetAddrInfoBatchCmd(mPool, mInflight));
+    registerDnsCmd(new GetAddrInfoTaggedCmd(mPool, mInflight));
+    registerDnsCmd(new GetAddrInfoShmCmd());
+    registerDnsCmd(new GetHostByAddrCmd(mPool));
+}
+
+// Commands are dispatched by onDataAvailable() below rather than by
+// FrameworkListener, which drops the part of a command cut off by the end
+// of a read; pipelining clients hit that routinely.
+void DnsProxyListener::registerDnsCmd(NetdCommand *cmd) {
+    mCommands->push_back(cmd);
+}
+
+DnsProxyListener::PartialCommand *DnsProxyListener::takePartial(SocketClient *c) {
+    PartialCommandCollection::iterator it;
+    for (it = mPartials->begin(); it != mPartials->end(); ++it) {
+        if ((*it)->client == c) {
+            PartialCommand *partial = *it;
+            mPartials->erase(it);
+            return partial;
+        }
+    }
+    return NULL;
+}
+
+bool DnsProxyListener::onDataAvailable(SocketClient *c) {
+    char buf[MAX_COMMAND_LEN];
+    int len = 0;
+
+    // Most clients send one whole command per connection, so a partial
+    // command is only kept, and allocated, when a read ends mid-command.
+    PartialCommand *partial = takePartial(c);
+    if (partial) {
+        memcpy(buf, partial->buf, partial->len);
+        len = partial->len;
+    }
+
+    int n = TEMP_FAILURE_RETRY(read(c->getSocket(), buf + len, sizeof(buf) - len));
+    if (n <= 0) {
+        if (n < 0) {
+            LOGE("read() failed (%s)", strerror(errno));
+        }
+        free(partial);
+        return false;
+    }
+
+    int start = 0;
+    for (int i = len; i < len + n; i++) {
+        if (buf[i] == '\0') {
+            dispatchCommand(c, buf + start);
+            start = i + 1;
+        }
+    }
+    len += n;
+
+    if (start == len) {
+        free(partial);
+        return true;
+    }
+    if (len - start == (int) sizeof(buf)) {
+        LOGW("Command too long, closing connection");
+        free(partial);
+        return false;
+    }
+    if (!partial) {
+        partial = (PartialCommand *) malloc(sizeof(PartialCommand));
+        if (!partial) {
+            LOGE("Unable to allocate partial command");
+            return false;
+        }
+        partial->client = c;
+    }
+    partial->len = len - start;
+    memcpy(partial->buf, buf + start, partial->len);
+    mPartials->push_back(partial);
+    return true;
+}
+
+// Splits data into arguments the way FrameworkListener does: on spaces,
+// except inside double quotes, with backslash escaping the next character.
+void DnsProxyListener::dispatchCommand(SocketClient *c, char *data) {
+    char *argv[MAX_ARGS];
+    int argc = 0;
+    char *in = data;
+    char *out = data;
+    bool quoted = false;
+
+    while (*in) {
+        while (*in == ' ') {
+            in++;
+        }
+        if (!*in) {
+            break;
+        }
+        if (argc == MAX_ARGS) {
+            c->sendMsg(ResponseCode::CommandSyntaxError, "Command too large", false);
+            return;
+        }
+        argv[argc++] = out;
+        for (; *in && (quoted || *in != ' '); in++) {
+            if (*in == '"') {
+                quoted = !quoted;
+            } else if (*in == '\\' && in[1]) {
+                *out++ = *++in;
+            } else {
+                *out++ = *in;
+            }
+        }
+        // The terminator may overwrite the space that ended this argument,
+        // never anything not parsed yet.
+        if (*in) {
+            in++;
+        }
+        *out++ = '\0';
+    }
+    if (quoted) {
+        c->sendMsg(ResponseCode::CommandSyntaxError, "Unclosed quotes", false);
+        return;
+    }
+    if (argc == 0) {
+        return;
+    }
+
+    DnsCommandCollection::iterator it;
+    for (it = mCommands->begin(); it != mCommands->end(); ++it) {
+        if (!strcmp(argv[0], (*it)->getCommand())) {
+            if ((*it)->runCommand(c, argc, argv)) {
+                LOGW("Handler '%s' error (%s)", (*it)->getCommand(), strerror(errno));
+            }
+            return;
+        }
+    }
+    c->sendMsg(ResponseCode::CommandSyntaxError, "Command not recognized", false);
+}
+
+// Picks the one of the NUM_WRITE_LOCKS hashed write locks that guards c.
+static pthread_mutex_t *writeLockFor(SocketClient *c) {
+    return &sWriteLocks[((uintptr_t) c >> 4) % NUM_WRITE_LOCKS];
+}
+
+// Writes all of iov to the client in as few system calls as possible,
+// normally one. Returns true on success.
+static bool sendIov(SocketClient *c, struct iovec *iov, int iovcnt) {
+    pthread_mutex_t *lock = writeLockFor(c);
+    bool success = true;
+
+    pthread_mutex_lock(lock);
+    while (iovcnt > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t rc = sendmsg(c->getSocket(), &msg, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            success = false;
+            break;
+        }
+        while (iovcnt > 0 && (size_t) rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+    pthread_mutex_unlock(lock);
+    return success;
 }
 
 // Sends 4 bytes of big-endian length, followed by the data.
 // Returns true on success.
 static bool sendLenAndData(SocketClient *c, const int len, const void* data) {
     uint32_t len_be = htonl(len);
-    return c->sendData(&len_be, 4) == 0 &&
-        (len == 0 || c->sendData(data, len) == 0);
+    struct iovec iov[2];
+    iov[0].iov_base = &len_be;
+    iov[0].iov_len = sizeof(len_be);
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len = len;
+    return sendIov(c, iov, len ? 2 : 1);
+}
+
+// Sends 4 bytes of big-endian len, with fd attached unless it is -1.
+// Returns true on success.
+static bool sendLenAndFd(SocketClient *c, uint32_t len, int fd) {
+    uint32_t len_be = htonl(len);
+    struct iovec iov;
+    struct msghdr msg;
+    char control[CMSG_SPACE(sizeof(int))];
+
+    iov.iov_base = &len_be;
+    iov.iov_len = sizeof(len_be);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    pthread_mutex_t *lock = writeLockFor(c);
+    pthread_mutex_lock(lock);
+    ssize_t rc = TEMP_FAILURE_RETRY(sendmsg(c->getSocket(), &msg, MSG_NOSIGNAL));
+    pthread_mutex_unlock(lock);
+    // Four bytes on a stream socket with room to spare go out whole.
+    return rc == sizeof(len_be);
+}
+
+// Sends a pre-serialized answer, or just an EAI_MEMORY result if there is
+// none, in the given encoding and optionally preceded by an index or tag.
+// One write, no allocation.
+static bool sendAnswer(SocketClient *c, DnsAnswer *answer, int version,
+                       const uint32_t *index) {
+    struct iovec iov[2];
+    int iovcnt = 0;
+    uint32_t index_be;
+    uint8_t error[DnsProxyListener::COMPACT_HEADER_SIZE];
+
+    if (index) {
+        index_be = htonl(*index);
+        iov[iovcnt].iov_base = &index_be;
+        iov[iovcnt].iov_len = sizeof(index_be);
+        iovcnt++;
+    }
+    if (answer && version >= DnsProxyListener::COMPACT_VERSION) {
+        iov[iovcnt].iov_base = answer->getCompactData();
+        iov[iovcnt].iov_len = answer->getCompactLength();
+    } else if (answer) {
+        iov[iovcnt].iov_base = answer->getData();
+        iov[iovcnt].iov_len = answer->getLength();
+    } else if (version >= DnsProxyListener::COMPACT_VERSION) {
+        uint32_t header[3] = {
+            htonl(DnsProxyListener::COMPACT_MAGIC | version),
+            htonl(EAI_MEMORY),
+            0
+        };
+        memcpy(error, header, sizeof(error));
+        iov[iovcnt].iov_base = error;
+        iov[iovcnt].iov_len = sizeof(error);
+    } else {
+        int rv = EAI_MEMORY;
+        memcpy(error, &rv, sizeof(rv));
+        iov[iovcnt].iov_base = error;
+        iov[iovcnt].iov_len = sizeof(rv);
+    }
+    iovcnt++;
+    return sendIov(c, iov, iovcnt);
+}
+
+static void putLenAndData(uint8_t **pp, const int len, const void* data) {
+    uint32_t len_be = htonl(len);
+    memcpy(*pp, &len_be, 4);
+    *pp += 4;
+    if (len) {
+        memcpy(*pp, data, len);
+        *pp += len;
+    }
+}
+
+static void putBytes(uint8_t **pp, const void *data, int len) {
+    memcpy(*pp, data, len);
+    *pp += len;
 }
 
-DnsProxyListener::GetAddrInfoCmd::GetAddrInfoCmd() :
-    NetdCommand("getaddrinfo") {
+static void put16(uint8_t **pp, uint16_t v) {
+    uint16_t v_be = htons(v);
+    putBytes(pp, &v_be, sizeof(v_be));
+}
+
+static void put32(uint8_t **pp, uint32_t v) {
+    uint32_t v_be = htonl(v);
+    putBytes(pp, &v_be, sizeof(v_be));
+}
+
+// Size of one address record in the compact encoding, 0 if the address
+// can't be represented and is left out.
+static int compactRecordSize(const struct addrinfo *ai) {
+    if (ai->ai_family == AF_INET && ai->ai_addrlen >= sizeof(struct sockaddr_in)) {
+        return 4 + 2 + 4;
+    }
+    if (ai->ai_family == AF_INET6 && ai->ai_addrlen >= sizeof(struct sockaddr_in6)) {
+        return 4 + 2 + 16 + 4;
+    }
+    return 0;
+}
+
+// Serializes a getaddrinfo() result twice. Once exactly as legacy clients
+// expect to read it: the return code, then each addrinfo with its sockaddr
+// and canonical name, each as a length-prefixed blob, then a zero length
+// terminator. And once in the compact encoding described in
+// DnsProxyListener.h.
+static DnsAnswer *serializeAddrInfo(int rv, struct addrinfo* result) {
+    int len = sizeof(rv);
+    int compactLen = DnsProxyListener::COMPACT_HEADER_SIZE;
+    int numRecords = 0;
+    const char *canonName = NULL;
+    struct addrinfo* ai;
+
+    if (rv == 0) {
+        for (ai = result; ai; ai = ai->ai_next) {
+            len += 4 + sizeof(struct addrinfo) + 4 + ai->ai_addrlen + 4 +
+                (ai->ai_canonname ? strlen(ai->ai_canonname) + 1 : 0);
+            int recordSize = compactRecordSize(ai);
+            if (recordSize) {
+                compactLen += recordSize;
+                numRecords++;
+            }
+            if (!canonName && ai->ai_canonname) {
+                canonName = ai->ai_canonname;
+            }
+        }
+        len += 4;
+        compactLen += 2 + 2 + (canonName ? strlen(canonName) : 0);
+    }
+
+    DnsAnswer *answer = DnsAnswer::create(len, compactLen);
+    if (!answer) {
+        return NULL;
+    }
+    uint8_t *p = answer->getData();
+    memcpy(p, &rv, sizeof(rv));
+    p += sizeof(rv);
+    if (rv == 0) {
+        for (ai = result; ai; ai = ai->ai_next) {
+            putLenAndData(&p, sizeof(struct addrinfo), ai);
+            putLenAndData(&p, ai->ai_addrlen, ai->ai_addr);
+            putLenAndData(&p, ai->ai_canonname ? strlen(ai->ai_canonname) + 1 : 0,
+                          ai->ai_canonname);
+        }
+        putLenAndData(&p, 0, NULL);
+    }
+
+    p = answer->getCompactData();
+    put32(&p, DnsProxyListener::COMPACT_MAGIC | DnsProxyListener::COMPACT_VERSION);
+    put32(&p, rv);
+    put32(&p, compactLen - DnsProxyListener::COMPACT_HEADER_SIZE);
+    if (rv == 0) {
+        int canonLen = canonName ? strlen(canonName) : 0;
+        put16(&p, numRecords);
+        put16(&p, canonLen);
+        putBytes(&p, canonName, canonLen);
+        for (ai = result; ai; ai = ai->ai_next) {
+            if (!compactRecordSize(ai)) {
+                continue;
+            }
+            uint8_t record[4] = {
+                (uint8_t) ai->ai_family,
+                (uint8_t) ai->ai_socktype,
+                (uint8_t) ai->ai_protocol,
+                0
+            };
+            putBytes(&p, record, sizeof(record));
+            if (ai->ai_family == AF_INET) {
+                const struct sockaddr_in *sin = (const struct sockaddr_in *) ai->ai_addr;
+                putBytes(&p, &sin->sin_port, 2);
+                putBytes(&p, &sin->sin_addr, 4);
+            } else {
+                const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) ai->ai_addr;
+                putBytes(&p, &sin6->sin6_port, 2);
+                putBytes(&p, &sin6->sin6_addr, 16);
+                put32(&p, sin6->sin6_scope_id);
+            }
+        }
+    }
+    return answer;
+}
+
+// How long a getaddrinfo() outcome may be cached, 0 if not at all.
+// ttl is the TTL reported by the resolver, or -1 if it is unknown.
+static int cacheTtlFor(int rv, int ttl) {
+    if (rv != 0 && rv != EAI_NONAME && rv != EAI_NODATA) {
+        // Timeouts and server failures are transient, retry them next time.
+        return 0;
+    }
+    if (ttl < 0) {
+        return (rv == 0) ? DEFAULT_POSITIVE_TTL : DEFAULT_NEGATIVE_TTL;
+    }
+    return (ttl > DnsCache::MAX_TTL) ? DnsCache::MAX_TTL : ttl;
+}
+
+// Records the latency and outcome of a lookup that went upstream.
+static void recordUpstream(const char *iface, int rv, uint64_t startMs) {
+    DnsStats *stats = DnsStats::Instance();
+
+    stats->recordLatency(iface, DnsCache::nowMs() - startMs);
+    if (rv != 0 && rv != EAI_NONAME && rv != EAI_NODATA) {
+        stats->count(iface, DnsStats::UPSTREAM_FAILURE);
+    }
+}
+
+// Clients that predate the compact encoding send no version and get the
+// legacy one. Newer ones get the best version both sides know.
+static int parseVersion(const char *arg) {
+    int version = arg ? atoi(arg) : DnsProxyListener::LEGACY_VERSION;
+
+    if (version > DnsProxyListener::COMPACT_VERSION) {
+        return DnsProxyListener::COMPACT_VERSION;
+    }
+    if (version < DnsProxyListener::LEGACY_VERSION) {
+        return DnsProxyListener::LEGACY_VERSION;
+    }
+    return version;
+}
+
+// Parses an optional interface argument into iface, with "^" or no
+// argument standing for the default interface. Returns false if the name
+// is too long.
+static bool parseInterface(const char *arg, char *iface, size_t len) {
+    if (!arg || !strcmp(arg, "^")) {
+        DnsCache::Instance()->getDefaultInterface(iface, len);
+        return true;
+    }
+    if (strlen(arg) >= len) {
+        return false;
+    }
+    strcpy(iface, arg);
+    return true;
+}
+
+static bool isDefaultInterface(const char *iface) {
+    char defaultIface[IFNAMSIZ];
+
+    DnsCache::Instance()->getDefaultInterface(defaultIface, sizeof(defaultIface));
+    return !strcmp(iface, defaultIface);
+}
+
+// Parses a getaddrinfo host or service argument, "^" standing for NULL.
+static const char *parseNullable(const char *arg) {
+    return strcmp("^", arg) == 0 ? NULL : arg;
+}
+
+DnsProxyListener::ClientReply::ClientReply(SocketClient *c, int version) :
+        mClient(c),
+        mVersion(version) {
+    mClient->incRef();
+}
+
+DnsProxyListener::ClientReply::~ClientReply() {
+    mClient->decRef();
+}
+
+void DnsProxyListener::ClientReply::deliver(DnsAnswer *answer) {
+    if (!sendAnswer(mClient, answer, mVersion, NULL)) {
+        LOGW("Error writing DNS result to client");
+    }
+}
+
+DnsProxyListener::IndexedReply::IndexedReply(SocketClient *c, uint32_t index,
+                                             int version) :
+        mClient(c),
+        mIndex(index),
+        mVersion(version) {
+    mClient->incRef();
+}
+
+DnsProxyListener::IndexedReply::~IndexedReply() {
+    mClient->decRef();
+}
+
+void DnsProxyListener::IndexedReply::deliver(DnsAnswer *answer) {
+    if (!sendAnswer(mClient, answer, mVersion, &mIndex)) {
+        LOGW("Error writing indexed DNS result to client");
+    }
+}
+
+void DnsProxyListener::startLookup(DnsWorkerPool *pool, DnsInflightTable *inflight,
+                                   const DnsCacheKey *key, uid_t uid,
+                                   DnsReplyTarget *target) {
+    DnsStats *stats = DnsStats::Instance();
+    bool refresh = false;
+    bool stale = false;
+    DnsAnswer *cached = DnsCache::Instance()->lookup(key, &refresh, &stale);
+    if (cached) {
+        stats->count(key->iface, stale ? DnsStats::STALE_HIT : DnsStats::CACHE_HIT);
+        target->deliver(cached);
+        cached->release();
+        delete target;
+        if (!refresh) {
+            return;
+        }
+        // Stale, or popular and about to expire; refresh it in the
+        // background with nobody waiting for the result.
+        target = NULL;
+    } else {
+        stats->count(key->iface, DnsStats::CACHE_MISS);
+    }
+
+    if (inflight->join(key, target)) {
+        // An identical lookup is already running; it will answer us too.
+        if (target) {
+            stats->count(key->iface, DnsStats::COALESCED);
+        }
+        return;
+    }
+
+    GetAddrInfoHandler* handler = new GetAddrInfoHandler(inflight, target, key, uid);
+    if (pool->enqueue(handler, uid)) {
+        // Too much work already queued; fail fast rather than block the
+        // listener thread. The client treats this like a resolver timeout.
+        LOGW("Unable to queue getaddrinfo (%s)", strerror(errno));
+        DnsAnswer *answer = serializeAddrInfo(EAI_AGAIN, NULL);
+        handler->respond(answer);
+        if (answer) {
+            answer->release();
+        }
+        delete handler;
+    }
+}
+
+DnsProxyListener::GetAddrInfoHandler::GetAddrInfoHandler(DnsInflightTable *inflight,
+                                                         DnsReplyTarget *target,
+                                                         const DnsCacheKey *key,
+                                                         uid_t uid)
+        : mInflight(inflight),
+          mTarget(target),
+          mUid(uid) {
+    DnsCache::copyKey(&mKey, key);
+    memset(&mHints, 0, sizeof(mHints));
+    mHaveHints = (key->flags != -1 || key->family != -1 ||
+                  key->socktype != -1 || key->protocol != -1);
+    if (mHaveHints) {
+        mHints.ai_flags = key->flags;
+        mHints.ai_family = key->family;
+        mHints.ai_socktype = key->socktype;
+        mHints.ai_protocol = key->protocol;
+    }
+}
+
+DnsProxyListener::GetAddrInfoHandler::~GetAddrInfoHandler() {
+    DnsCache::freeKey(&mKey);
+    delete mTarget;
+}
+
+void DnsProxyListener::GetAddrInfoHandler::run() {
+    const char *host = mKey.name;
+    const char *service = mKey.service;
+    const struct addrinfo *hints = mHaveHints ? &mHints : NULL;
+
+    if (DBG) {
+        LOGD("GetAddrInfoHandler, now for %s / %s",
+             host ? host : "[nullhost]",
+             service ? service : "[nullservice]");
+    }
+
+    struct addrinfo* result = NULL;
+    DnsAnswer *answer;
+    uint32_t sources[DnsStubResolver::MAX_PARALLEL_QUERIES];
+    int numSources = 0;
+    int ttl = -1;
+    int rv;
+    uint64_t start = DnsCache::nowMs();
+    DnsStubResolver *stub = DnsStubResolver::Instance();
+    if (stub->canResolve(mKey.iface, host, service, hints)) {
+        rv = stub->getAddrInfo(mKey.iface, host, service, hints, &result, &ttl, sources);
+        numSources = DnsStubResolver::MAX_PARALLEL_QUERIES;
+        answer = serializeAddrInfo(rv, result);
+        DnsStubResolver::freeAddrInfo(result);
+    } else if (!isDefaultInterface(mKey.iface) && !stub->resolvesLocally(host)) {
+        // libc only knows the servers of the default interface, so asking
+        // it would leak the query onto the wrong network.
+        rv = EAI_AGAIN;
+        answer = serializeAddrInfo(rv, NULL);
+    } else {
+        rv = getaddrinfo(host, service, hints, &result);
+        answer = serializeAddrInfo(rv, result);
+        if (result) {
+            freeaddrinfo(result);
+        }
+    }
+    recordUpstream(mKey.iface, rv, start);
+    if (answer) {
+        int cacheTtl = cacheTtlFor(rv, ttl);
+        DnsCache::Instance()->insert(&mKey, answer, cacheTtl, sources, numSources);
+        if (isDefaultInterface(mKey.iface)) {
+            DnsSharedCache::Instance()->publish(mUid, &mKey, answer, cacheTtl);
+        }
+    } else {
+        LOGE("Unable to allocate DNS answer");
+    }
+    respond(answer);
+    if (answer) {
+        answer->release();
+    }
+}
+
+void DnsProxyListener::GetAddrInfoHandler::respond(DnsAnswer *answer) {
+    DnsReplyTargetCollection waiters;
+
+    // The answer is already in the cache, so anyone arriving after this
+    // point is served from there rather than waiting on us.
+    mInflight->finish(&mKey, &waiters);
+    if (mTarget) {
+        mTarget->deliver(answer);
+    }
+
+    DnsReplyTargetCollection::iterator it;
+    for (it = waiters.begin(); it != waiters.end(); ++it) {
+        (*it)->deliver(answer);
+        delete *it;
+    }
+}
+
+DnsProxyListener::GetAddrInfoCmd::GetAddrInfoCmd(DnsWorkerPool *pool,
+                                                 DnsInflightTable *inflight) :
+    NetdCommand("getaddrinfo"),
+    mPool(pool),
+    mInflight(inflight) {
 }
 
 int DnsProxyListener::GetAddrInfoCmd::runCommand(SocketClient *cli,
@@ -57,80 +705,386 @@ int DnsProxyListener::GetAddrInfoCmd::runCommand(SocketClient *cli,
             LOGD("argv[%i]=%s", i, argv[i]);
         }
     }
-    if (argc != 7) {
+    if (argc < 7 || argc > 9) {
         LOGW("Invalid number of arguments to getaddrinfo: %i", argc);
         sendLenAndData(cli, 0, NULL);
         return -1;
     }
 
-    char* name = argv[1];
-    if (strcmp("^", name) == 0) {
-        name = NULL;
-    } else {
-        name = strdup(name);
-    }
+    int version = parseVersion(argc >= 8 ? argv[7] : NULL);
 
-    char* service = argv[2];
-    if (strcmp("^", service) == 0) {
-        service = NULL;
-    } else {
-        service = strdup(service);
+    char iface[IFNAMSIZ];
+    if (!parseInterface(argc == 9 ? argv[8] : NULL, iface, sizeof(iface))) {
+        LOGW("Invalid interface for getaddrinfo");
+        sendLenAndData(cli, 0, NULL);
+        return -1;
     }
 
-    struct addrinfo* hints = NULL;
-    int ai_flags = atoi(argv[3]);
-    int ai_family = atoi(argv[4]);
-    int ai_socktype = atoi(argv[5]);
-    int ai_protocol = atoi(argv[6]);
-    if (ai_flags != -1 || ai_family != -1 ||
-        ai_socktype != -1 || ai_protocol != -1) {
-        hints = (struct addrinfo*) calloc(1, sizeof(struct addrinfo));
-        hints->ai_flags = ai_flags;
-        hints->ai_family = ai_family;
-        hints->ai_socktype = ai_socktype;
-        hints->ai_protocol = ai_protocol;
-    }
+    DnsCacheKey key;
+    key.name = parseNullable(argv[1]);
+    key.service = parseNullable(argv[2]);
+    key.flags = atoi(argv[3]);
+    key.family = atoi(argv[4]);
+    key.socktype = atoi(argv[5]);
+    key.protocol = atoi(argv[6]);
+    key.iface = iface;
 
     if (DBG) {
         LOGD("GetAddrInfoCmd for %s / %s",
-             name ? name : "[nullhost]",
-             service ? service : "[nullservice]");
+             key.name ? key.name : "[nullhost]",
+             key.service ? key.service : "[nullservice]");
     }
 
+    startLookup(mPool, mInflight, &key, cli->getUid(), new ClientReply(cli, version));
+    return 0;
+}
+
+DnsProxyListener::GetAddrInfoBatchCmd::GetAddrInfoBatchCmd(DnsWorkerPool *pool,
+                                                           DnsInflightTable *inflight) :
+    NetdCommand("getaddrinfo_batch"),
+    mPool(pool),
+    mInflight(inflight) {
+}
+
+int DnsProxyListener::GetAddrInfoBatchCmd::runCommand(SocketClient *cli,
+                                                 int argc, char **argv) {
     if (DBG) {
-        LOGD("GetAddrInfoCmd, now for %s / %s", name, service);
+        for (int i = 0; i < argc; i++) {
+            LOGD("argv[%i]=%s", i, argv[i]);
+        }
+    }
+    if (argc < 8) {
+        LOGW("Invalid number of arguments to getaddrinfo_batch: %i", argc);
+        sendLenAndData(cli, 0, NULL);
+        return -1;
     }
 
-    struct addrinfo* result = NULL;
-    int rv = getaddrinfo(name, service, hints, &result);
-    bool success = (cli->sendData(&rv, sizeof(rv)) == 0);
-    if (rv == 0) {
-        struct addrinfo* ai = result;
-        while (ai && success) {
-            success = sendLenAndData(cli, sizeof(struct addrinfo), ai)
-                && sendLenAndData(cli, ai->ai_addrlen, ai->ai_addr)
-                && sendLenAndData(cli,
-                                  ai->ai_canonname ? strlen(ai->ai_canonname) + 1 : 0,
-                                  ai->ai_canonname);
-            ai = ai->ai_next;
+    // Split the name lists up front so a malformed command is rejected
+    // before any lookup has started answering.
+    char *names[MAX_NAMES];
+    int numNames = 0;
+    for (int i = 7; i < argc; i++) {
+        char *next = argv[i];
+        char *name;
+        while ((name = strsep(&next, ",")) != NULL) {
+            if (*name == '\0') {
+                continue;
+            }
+            if (numNames == MAX_NAMES) {
+                LOGW("Too many names in getaddrinfo_batch");
+                sendLenAndData(cli, 0, NULL);
+                return -1;
+            }
+            names[numNames++] = name;
         }
-        success = success && sendLenAndData(cli, 0, "");
     }
-    if (result) {
-        freeaddrinfo(result);
+
+    char iface[IFNAMSIZ];
+    DnsCache::Instance()->getDefaultInterface(iface, sizeof(iface));
+
+    DnsCacheKey key;
+    key.service = parseNullable(argv[1]);
+    key.flags = atoi(argv[2]);
+    key.family = atoi(argv[3]);
+    key.socktype = atoi(argv[4]);
+    key.protocol = atoi(argv[5]);
+    key.iface = iface;
+    uint32_t firstIndex = strtoul(argv[6], NULL, 10);
+
+    if (DBG) {
+        LOGD("GetAddrInfoBatchCmd for %d names from index %u", numNames, firstIndex);
     }
-    if (!success) {
-        LOGW("Error writing DNS result to client");
+
+    for (int i = 0; i < numNames; i++) {
+        key.name = names[i];
+        startLookup(mPool, mInflight, &key, cli->getUid(),
+                    new IndexedReply(cli, firstIndex + i, LEGACY_VERSION));
+    }
+    return 0;
+}
+
+DnsProxyListener::GetAddrInfoTaggedCmd::GetAddrInfoTaggedCmd(DnsWorkerPool *pool,
+                                                             DnsInflightTable *inflight) :
+    NetdCommand("getaddrinfo_tagged"),
+    mPool(pool),
+    mInflight(inflight) {
+}
+
+int DnsProxyListener::GetAddrInfoTaggedCmd::runCommand(SocketClient *cli,
+                                                  int argc, char **argv) {
+    if (DBG) {
+        for (int i = 0; i < argc; i++) {
+            LOGD("argv[%i]=%s", i, argv[i]);
+        }
+    }
+    char iface[IFNAMSIZ];
+    if (argc < 8 || argc > 10 ||
+        !parseInterface(argc == 10 ? argv[9] : NULL, iface, sizeof(iface))) {
+        // Fail the request, tagged if there is a tag at all, so that the
+        // client doesn't wait for it forever.
+        LOGW("Invalid arguments to getaddrinfo_tagged");
+        if (argc >= 2) {
+            uint32_t tag = strtoul(argv[1], NULL, 10);
+            DnsAnswer *answer = serializeAddrInfo(EAI_FAIL, NULL);
+            sendAnswer(cli, answer, LEGACY_VERSION, &tag);
+            if (answer) {
+                answer->release();
+            }
+        }
+        return -1;
+    }
+
+    uint32_t tag = strtoul(argv[1], NULL, 10);
+    int version = parseVersion(argc >= 9 ? argv[8] : NULL);
+
+    DnsCacheKey key;
+    key.name = parseNullable(argv[2]);
+    key.service = parseNullable(argv[3]);
+    key.flags = atoi(argv[4]);
+    key.family = atoi(argv[5]);
+    key.socktype = atoi(argv[6]);
+    key.protocol = atoi(argv[7]);
+    key.iface = iface;
+
+    if (DBG) {
+        LOGD("GetAddrInfoTaggedCmd %u for %s / %s", tag,
+             key.name ? key.name : "[nullhost]",
+             key.service ? key.service : "[nullservice]");
+    }
+
+    startLookup(mPool, mInflight, &key, cli->getUid(), new IndexedReply(cli, tag, version));
+    return 0;
+}
+
+DnsProxyListener::GetAddrInfoShmCmd::GetAddrInfoShmCmd() :
+    NetdCommand("getaddrinfo_shm") {
+}
+
+int DnsProxyListener::GetAddrInfoShmCmd::runCommand(SocketClient *cli,
+                                               int argc, char **argv) {
+    if (argc != 1) {
+        LOGW("Invalid number of arguments to getaddrinfo_shm: %i", argc);
+        sendLenAndData(cli, 0, NULL);
+        return -1;
     }
 
+    DnsSharedCache *shared = DnsSharedCache::Instance();
+    int fd = shared->getFd(cli->getUid());
+    if (!sendLenAndFd(cli, (fd >= 0) ? shared->getSize() : 0, fd)) {
+        LOGW("Error writing shared DNS cache to client");
+    }
     return 0;
 }
 
 /*******************************************************
  *                  GetHostByAddr                       *
  *******************************************************/
-DnsProxyListener::GetHostByAddrCmd::GetHostByAddrCmd() :
-        NetdCommand("gethostbyaddr") {
+// Serializes a gethostbyaddr() result the way the client reads it: the
+// length of the host name including its NUL, then the name, or just a
+// zero length if the lookup failed.
+static DnsAnswer *serializeHostName(const char *name) {
+    int nameLen = name ? strlen(name) + 1 : 0;
+    DnsAnswer *answer = DnsAnswer::create(4 + nameLen);
+    if (!answer) {
+        return NULL;
+    }
+    uint8_t *p = answer->getData();
+    putLenAndData(&p, nameLen, name);
+    return answer;
+}
+
+DnsProxyListener::GetHostByAddrHandler::GetHostByAddrHandler(SocketClient *c,
+                                                             const DnsAddress *addr,
+                                                             const char *iface,
+                                                             int timeoutMs,
+                                                             volatile int32_t *active)
+        : mClient(c),
+          mAddr(*addr),
+          mTimeoutMs(timeoutMs),
+          mActive(active) {
+    mClient->incRef();
+    strncpy(mIface, iface, sizeof(mIface) - 1);
+    mIface[sizeof(mIface) - 1] = '\0';
+    android_atomic_inc(mActive);
+}
+
+DnsProxyListener::GetHostByAddrHandler::~GetHostByAddrHandler() {
+    android_atomic_dec(mActive);
+    mClient->decRef();
+}
+
+/*
+ * A libc gethostbyaddr() can't be interrupted, so it runs on a thread of
+ * its own that the worker waits for only until the request's deadline.
+ * Whichever of the two finishes with the lookup last frees it. The
+ * lookup holds its slot in the reverse lookup cap until libc returns, so
+ * abandoned lookups still count against it.
+ */
+struct LibcReverseLookup {
+    pthread_mutex_t   lock;
+    pthread_cond_t    cond;
+    bool              done;
+    bool              abandoned;
+    DnsAddress        addr;
+    char              name[DnsResponse::MAX_NAME];
+    int               err;
+    volatile int32_t *active;
+};
+
+static void *libcReverseLookupThread(void *obj) {
+    LibcReverseLookup *l = reinterpret_cast<LibcReverseLookup *>(obj);
+    int addrLen = (l->addr.family == AF_INET) ? sizeof(l->addr.addr.v4) :
+                                                sizeof(l->addr.addr.v6);
+    // NOTE gethostbyaddr should take a void* but bionic thinks it should be char*
+    // bionic keeps the result in per-thread storage.
+    struct hostent *hp = gethostbyaddr((char *) &l->addr.addr, addrLen, l->addr.family);
+
+    pthread_mutex_lock(&l->lock);
+    if (hp && hp->h_name) {
+        strncpy(l->name, hp->h_name, sizeof(l->name) - 1);
+        l->name[sizeof(l->name) - 1] = '\0';
+        l->err = 0;
+    } else {
+        l->err = h_errno;
+    }
+    l->done = true;
+    bool abandoned = l->abandoned;
+    // Once unlocked, l may already be gone unless it was abandoned.
+    volatile int32_t *active = l->active;
+    pthread_cond_signal(&l->cond);
+    pthread_mutex_unlock(&l->lock);
+
+    android_atomic_dec(active);
+    if (abandoned) {
+        pthread_cond_destroy(&l->cond);
+        pthread_mutex_destroy(&l->lock);
+        delete l;
+    }
+    return NULL;
+}
+
+// Returns h_errno style; TRY_AGAIN if libc didn't answer within timeoutMs.
+static int libcGetHostByAddr(const DnsAddress *addr, char *name, size_t namelen,
+                             int timeoutMs, volatile int32_t *active) {
+    if (timeoutMs <= 0) {
+        return TRY_AGAIN;
+    }
+
+    LibcReverseLookup *l = new LibcReverseLookup;
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->cond, NULL);
+    l->done = false;
+    l->abandoned = false;
+    l->addr = *addr;
+    l->err = TRY_AGAIN;
+    l->active = active;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    android_atomic_inc(active);
+    int rc = pthread_create(&thread, &attr, libcReverseLookupThread, l);
+    pthread_attr_destroy(&attr);
+    if (rc) {
+        LOGE("pthread_create failed (%s)", strerror(rc));
+        android_atomic_dec(active);
+        pthread_cond_destroy(&l->cond);
+        pthread_mutex_destroy(&l->lock);
+        delete l;
+        return TRY_AGAIN;
+    }
+
+    struct timeval tv;
+    struct timespec deadline;
+    gettimeofday(&tv, NULL);
+    uint64_t ns = (uint64_t) tv.tv_usec * 1000 + (uint64_t) timeoutMs * 1000000;
+    deadline.tv_sec = tv.tv_sec + ns / 1000000000;
+    deadline.tv_nsec = ns % 1000000000;
+
+    pthread_mutex_lock(&l->lock);
+    while (!l->done) {
+        if (pthread_cond_timedwait(&l->cond, &l->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    bool done = l->done;
+    int err = l->err;
+    if (done && !err) {
+        strncpy(name, l->name, namelen - 1);
+        name[namelen - 1] = '\0';
+    }
+    l->abandoned = !done;
+    pthread_mutex_unlock(&l->lock);
+
+    if (done) {
+        pthread_cond_destroy(&l->cond);
+        pthread_mutex_destroy(&l->lock);
+        delete l;
+        return err;
+    }
+    LOGW("libc gethostbyaddr missed its %d ms deadline", timeoutMs);
+    return TRY_AGAIN;
+}
+
+void DnsProxyListener::GetHostByAddrHandler::run() {
+    char name[DnsResponse::MAX_NAME];
+    int ttl = -1;
+    int err;
+    uint64_t start = DnsCache::nowMs();
+
+    DnsStubResolver *stub = DnsStubResolver::Instance();
+    if (stub->canResolveAddr(mIface, &mAddr)) {
+        err = stub->getHostByAddr(mIface, &mAddr, name, sizeof(name), &ttl, mTimeoutMs);
+    } else if (!isDefaultInterface(mIface) && !stub->resolvesLocally(&mAddr)) {
+        // As for getaddrinfo, libc would ask the default network.
+        err = TRY_AGAIN;
+    } else {
+        // The same deadline as the stub path; what is left of it.
+        int remainingMs = mTimeoutMs - (int) (DnsCache::nowMs() - start);
+        err = libcGetHostByAddr(&mAddr, name, sizeof(name), remainingMs, mActive);
+    }
+
+    if (DBG) {
+        LOGD("GetHostByAddrHandler: %s (%d)", err ? "failed" : name, err);
+    }
+
+    // Map onto getaddrinfo() outcomes to share the caching policy.
+    int rv = 0;
+    if (err == HOST_NOT_FOUND || err == NO_DATA) {
+        rv = EAI_NONAME;
+    } else if (err) {
+        rv = EAI_AGAIN;
+    }
+    recordUpstream(mIface, rv, start);
+
+    DnsAnswer *answer = serializeHostName(err ? NULL : name);
+    if (!answer) {
+        LOGE("Unable to allocate DNS answer");
+        sendLenAndData(mClient, 0, NULL);
+        return;
+    }
+    DnsPtrCache::Instance()->insert(&mAddr, mIface, answer, cacheTtlFor(rv, ttl));
+    if (!sendAnswer(mClient, answer, LEGACY_VERSION, NULL)) {
+        LOGW("GetHostByAddrHandler: Error writing DNS result to client");
+    }
+    answer->release();
+}
+
+DnsProxyListener::GetHostByAddrCmd::GetHostByAddrCmd(DnsWorkerPool *pool) :
+        NetdCommand("gethostbyaddr"),
+        mPool(pool),
+        mActive(0) {
+    char value[PROPERTY_VALUE_MAX];
+
+    mMaxActive = pool->getNumThreads() / 2;
+    if (mMaxActive < 1) {
+        mMaxActive = 1;
+    }
+    mTimeoutMs = DEFAULT_PTR_TIMEOUT_MS;
+    if (property_get("net.dnsproxy.ptr_timeout_ms", value, NULL) > 0 && atoi(value) > 0) {
+        mTimeoutMs = atoi(value);
+    }
 }
 
 int DnsProxyListener::GetHostByAddrCmd::runCommand(SocketClient *cli,
@@ -140,7 +1094,7 @@ int DnsProxyListener::GetHostByAddrCmd::runCommand(SocketClient *cli,
             LOGD("argv[%i]=%s", i, argv[i]);
         }
     }
-    if (argc != 4) {
+    if (argc != 4 && argc != 5) {
         LOGW("Invalid number of arguments to gethostbyaddr: %i", argc);
         sendLenAndData(cli, 0, NULL);
         return -1;
@@ -150,35 +1104,52 @@ int DnsProxyListener::GetHostByAddrCmd::runCommand(SocketClient *cli,
     int addrLen = atoi(argv[2]);
     int addrFamily = atoi(argv[3]);
 
-    void* addr = malloc(sizeof(struct in6_addr));
+    DnsAddress addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.family = addrFamily;
     errno = 0;
-    int result = inet_pton(addrFamily, addrStr, addr);
+    int result = inet_pton(addrFamily, addrStr, &addr.addr);
     if (result <= 0) {
         LOGW("inet_pton(\"%s\") failed %s", addrStr, strerror(errno));
-        free(addr);
         sendLenAndData(cli, 0, NULL);
         return -1;
     }
-
-    struct hostent* hp;
-
-    // NOTE gethostbyaddr should take a void* but bionic thinks it should be char*
-    hp = gethostbyaddr((char*)addr, addrLen, addrFamily);
-
-    if (DBG) {
-        LOGD("GetHostByAddrCmd::runCommand gethostbyaddr errno: %s hp->h_name = %s, name_len = %d\n",
-                hp ? "success" : strerror(errno),
-                (hp && hp->h_name) ? hp->h_name: "null",
-                (hp && hp->h_name) ? strlen(hp->h_name)+ 1 : 0);
+    if (addrLen != (addrFamily == AF_INET ? (int) sizeof(addr.addr.v4) :
+                                            (int) sizeof(addr.addr.v6))) {
+        LOGW("Invalid address length %d for gethostbyaddr", addrLen);
+        sendLenAndData(cli, 0, NULL);
+        return -1;
     }
 
-    bool success = sendLenAndData(cli, (hp && hp->h_name) ? strlen(hp->h_name)+ 1 : 0,
-            (hp && hp->h_name) ? hp->h_name : "");
+    char iface[IFNAMSIZ];
+    if (!parseInterface(argc == 5 ? argv[4] : NULL, iface, sizeof(iface))) {
+        LOGW("Invalid interface for gethostbyaddr");
+        sendLenAndData(cli, 0, NULL);
+        return -1;
+    }
 
+    DnsAnswer *cached = DnsPtrCache::Instance()->lookup(&addr, iface);
+    DnsStats::Instance()->count(iface, cached ? DnsStats::CACHE_HIT : DnsStats::CACHE_MISS);
+    if (cached) {
+        if (!sendAnswer(cli, cached, LEGACY_VERSION, NULL)) {
+            LOGW("GetHostByAddrCmd: Error writing DNS result to client");
+        }
+        cached->release();
+        return 0;
+    }
 
-    if (!success) {
-        LOGW("GetHostByAddrCmd: Error writing DNS result to client\n");
+    if (mActive >= mMaxActive) {
+        LOGW("Too many reverse lookups in progress, rejecting gethostbyaddr");
+        sendLenAndData(cli, 0, NULL);
+        return 0;
     }
 
+    GetHostByAddrHandler *handler = new GetHostByAddrHandler(cli, &addr, iface,
+                                                             mTimeoutMs, &mActive);
+    if (mPool->enqueue(handler, cli->getUid())) {
+        LOGW("Unable to queue gethostbyaddr (%s)", strerror(errno));
+        sendLenAndData(cli, 0, NULL);
+        delete handler;
+    }
     return 0;
 }
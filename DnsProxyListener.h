@@ -17,32 +17,245 @@
 #ifndef _DNSPROXYLISTENER_H__
 #define _DNSPROXYLISTENER_H__
 
+#include <netdb.h>
 #include <pthread.h>
 #include <sysutils/FrameworkListener.h>
+#include <utils/List.h>
 
 #include "NetdCommand.h"
+#include "DnsCache.h"
+#include "DnsInflightTable.h"
+#include "DnsPacket.h"
+#include "DnsWorkerPool.h"
 
+/*
+ * Clients may keep their connection open and send any number of commands
+ * on it, each terminated by a NUL as usual. Commands are reassembled
+ * across reads, so they may be written in any chunks; see
+ * getaddrinfo_tagged for matching pipelined requests with their answers.
+ */
 class DnsProxyListener : public FrameworkListener {
+    static const int MAX_COMMAND_LEN = 1024;
+    static const int MAX_ARGS = 32;
+
+    /* The start of a command from a client whose end hasn't arrived yet. */
+    struct PartialCommand {
+        SocketClient *client;
+        int           len;
+        char          buf[MAX_COMMAND_LEN];
+    };
+
+    typedef android::List<NetdCommand *> DnsCommandCollection;
+    typedef android::List<PartialCommand *> PartialCommandCollection;
+
+    DnsWorkerPool            *mPool;
+    DnsInflightTable         *mInflight;
+    DnsCommandCollection     *mCommands;
+    PartialCommandCollection *mPartials;  // listener thread only
+
 public:
+    /*
+     * getaddrinfo <host> <service> <flags> <family> <socktype> <protocol>
+     *             [<version> [<iface>]]
+     * gethostbyaddr <addr> <len> <family> [<iface>]
+     *
+     * Requests are resolved on the default interface unless they name
+     * another one ("^" for the default), against that interface's servers
+     * and cache.
+     *
+     * getaddrinfo answer encodings. A client asks for the newest one it
+     * understands in the optional version argument of getaddrinfo and gets
+     * the newest one both sides know; without it, the legacy one.
+     *
+     * The compact encoding is all big-endian. A 12 byte header holds
+     * COMPACT_MAGIC | version, the getaddrinfo() return code and the
+     * length of what follows. For a successful lookup that is the number
+     * of addresses (16 bits), the length of the canonical name (16 bits,
+     * 0 if there is none) and the name itself without a terminating NUL,
+     * then one record per address: family, socktype and protocol (8 bits
+     * each), a zero pad byte, the port and the 4 byte IPv4 address, or
+     * the port, 16 byte IPv6 address and 32 bit scope id. ai_flags are
+     * those the client asked for.
+     */
+    static const int LEGACY_VERSION = 0;
+    static const int COMPACT_VERSION = 1;
+    static const uint32_t COMPACT_MAGIC = 0x44500000;
+    static const int COMPACT_HEADER_SIZE = 12;
+
     DnsProxyListener();
     virtual ~DnsProxyListener() {}
 
+protected:
+    virtual bool onDataAvailable(SocketClient *c);
+
 private:
+    void registerDnsCmd(NetdCommand *cmd);
+    void dispatchCommand(SocketClient *c, char *data);
+
+    /* Removes and returns the pending partial command of c, if any. */
+    PartialCommand *takePartial(SocketClient *c);
+
+    /*
+     * Answers key from the cache, or attaches target to an identical
+     * lookup in flight, or else queues a new lookup on pool on behalf of
+     * uid. Takes ownership of target. Stale and soon to expire cache hits
+     * are answered and refreshed.
+     */
+    static void startLookup(DnsWorkerPool *pool, DnsInflightTable *inflight,
+                            const DnsCacheKey *key, uid_t uid, DnsReplyTarget *target);
+
+    /* Sends the answer to a getaddrinfo client in the encoding it asked for. */
+    class ClientReply : public DnsReplyTarget {
+        SocketClient *mClient;  // ref held
+        int mVersion;
+
+    public:
+        ClientReply(SocketClient *c, int version);
+        virtual ~ClientReply();
+        virtual void deliver(DnsAnswer *answer);
+    };
+
+    /*
+     * Sends the answer for one name of a batch or one tagged request,
+     * preceded by its index or tag as 4 bytes big-endian, in a single
+     * write so frames on the same socket never interleave.
+     */
+    class IndexedReply : public DnsReplyTarget {
+        SocketClient *mClient;  // ref held
+        uint32_t mIndex;
+        int mVersion;
+
+    public:
+        IndexedReply(SocketClient *c, uint32_t index, int version);
+        virtual ~IndexedReply();
+        virtual void deliver(DnsAnswer *answer);
+    };
+
     class GetAddrInfoCmd : public NetdCommand {
+        DnsWorkerPool    *mPool;
+        DnsInflightTable *mInflight;
+
     public:
-        GetAddrInfoCmd();
+        GetAddrInfoCmd(DnsWorkerPool *pool, DnsInflightTable *inflight);
         virtual ~GetAddrInfoCmd() {}
         int runCommand(SocketClient *c, int argc, char** argv);
     };
 
+    /*
+     * getaddrinfo_batch <service> <flags> <family> <socktype> <protocol>
+     *                   <first_index> <name>[,<name>...] [<name>...]
+     *
+     * Resolves every name with the same service and hints. Each result is
+     * sent as soon as it is known, as a big-endian index (first_index for
+     * the first name, counting up) followed by the usual getaddrinfo
+     * answer, so results arrive in completion order rather than request
+     * order. Lists that don't fit one command line are split over several
+     * commands on the same socket, each with its own first_index. Batches
+     * use the legacy encoding.
+     */
+    class GetAddrInfoBatchCmd : public NetdCommand {
+        DnsWorkerPool    *mPool;
+        DnsInflightTable *mInflight;
+
+    public:
+        static const int MAX_NAMES = 64;
+
+        GetAddrInfoBatchCmd(DnsWorkerPool *pool, DnsInflightTable *inflight);
+        virtual ~GetAddrInfoBatchCmd() {}
+        int runCommand(SocketClient *c, int argc, char** argv);
+    };
+
+    /*
+     * getaddrinfo_tagged <tag> <host> <service> <flags> <family> <socktype>
+     *                    <protocol> [<version> [<iface>]]
+     *
+     * getaddrinfo for clients that pipeline requests over one connection.
+     * The answer is sent as the 32 bit tag, big-endian, followed by the
+     * answer in the encoding negotiated as for getaddrinfo. Answers come
+     * back in completion order, not request order; tags are the client's
+     * to choose and need not be unique.
+     */
+    class GetAddrInfoTaggedCmd : public NetdCommand {
+        DnsWorkerPool    *mPool;
+        DnsInflightTable *mInflight;
+
+    public:
+        GetAddrInfoTaggedCmd(DnsWorkerPool *pool, DnsInflightTable *inflight);
+        virtual ~GetAddrInfoTaggedCmd() {}
+        int runCommand(SocketClient *c, int argc, char** argv);
+    };
+
+    /*
+     * getaddrinfo_shm
+     *
+     * Replies with the size of the caller's shared cache table (see
+     * DnsSharedCache.h) as 4 bytes big-endian, with a read-only fd for it
+     * attached, or just a zero size if there is none.
+     */
+    class GetAddrInfoShmCmd : public NetdCommand {
+    public:
+        GetAddrInfoShmCmd();
+        virtual ~GetAddrInfoShmCmd() {}
+        int runCommand(SocketClient *c, int argc, char** argv);
+    };
+
+    /*
+     * Runs one getaddrinfo() on a worker thread, answers the requester and
+     * every request that coalesced onto it, and caches the serialized
+     * answer under the request's key.
+     */
+    class GetAddrInfoHandler : public DnsJob {
+        DnsInflightTable *mInflight;
+        DnsReplyTarget *mTarget;  // owned, NULL for a background refresh
+        DnsCacheKey mKey;         // deep copy
+        uid_t mUid;               // whose shared cache table gets the answer
+        struct addrinfo mHints;
+        bool mHaveHints;
+
+    public:
+        GetAddrInfoHandler(DnsInflightTable *inflight, DnsReplyTarget *target,
+                           const DnsCacheKey *key, uid_t uid);
+        virtual ~GetAddrInfoHandler();
+        virtual void run();
+
+        /* Delivers answer to the requester and to all coalesced waiters. */
+        void respond(DnsAnswer *answer);
+    };
+
     /* ------ gethostbyaddr ------*/
     class GetHostByAddrCmd : public NetdCommand {
+        DnsWorkerPool *mPool;
+        // Reverse lookups queued or running. Capped so that slow ones
+        // can't tie up every worker.
+        volatile int32_t mActive;
+        int mMaxActive;
+        int mTimeoutMs;
+
     public:
-        GetHostByAddrCmd();
+        GetHostByAddrCmd(DnsWorkerPool *pool);
         virtual ~GetHostByAddrCmd() {}
         int runCommand(SocketClient *c, int argc, char** argv);
     };
 
+    /*
+     * Runs one reverse lookup on a worker thread, through the stub
+     * resolver or libc, bounded by a deadline either way, and caches the
+     * answer, including failures.
+     */
+    class GetHostByAddrHandler : public DnsJob {
+        SocketClient *mClient;  // ref held
+        DnsAddress mAddr;
+        char mIface[IFNAMSIZ];
+        int mTimeoutMs;
+        volatile int32_t *mActive;
+
+    public:
+        GetHostByAddrHandler(SocketClient *c, const DnsAddress *addr, const char *iface,
+                             int timeoutMs, volatile int32_t *active);
+        virtual ~GetHostByAddrHandler();
+        virtual void run();
+    };
+
 };
 
 #endif
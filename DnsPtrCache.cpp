@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "DnsPtrCache"
+#define DBG 0
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include "DnsPtrCache.h"
+
+static const int DEFAULT_PTR_CACHE_SIZE = 256;
+
+struct DnsPtrCacheEntry {
+    DnsPtrCacheEntry *next;
+    DnsAddress        addr;
+    char              iface[IFNAMSIZ];
+    uint64_t          expiresMs;
+    DnsAnswer        *answer;
+};
+
+DnsPtrCache *DnsPtrCache::sInstance = NULL;
+
+DnsPtrCache *DnsPtrCache::Instance() {
+    if (!sInstance)
+        sInstance = new DnsPtrCache();
+    return sInstance;
+}
+
+DnsPtrCache::DnsPtrCache() {
+    char value[PROPERTY_VALUE_MAX];
+
+    mMaxEntries = DEFAULT_PTR_CACHE_SIZE;
+    if (property_get("net.dnsproxy.ptr_cache_size", value, NULL) > 0) {
+        mMaxEntries = atoi(value);
+        if (mMaxEntries < 0) {
+            mMaxEntries = 0;
+        }
+    }
+    pthread_mutex_init(&mLock, NULL);
+    memset(mBuckets, 0, sizeof(mBuckets));
+    mCount = 0;
+}
+
+static bool addressesEqual(const DnsAddress *a, const DnsAddress *b) {
+    if (a->family != b->family) {
+        return false;
+    }
+    if (a->family == AF_INET) {
+        return a->addr.v4.s_addr == b->addr.v4.s_addr;
+    }
+    return !memcmp(&a->addr.v6, &b->addr.v6, sizeof(a->addr.v6));
+}
+
+uint32_t DnsPtrCache::hashAddress(const DnsAddress *addr) {
+    const uint8_t *p = (const uint8_t *) &addr->addr;
+    int len = (addr->family == AF_INET) ? sizeof(addr->addr.v4) : sizeof(addr->addr.v6);
+    uint32_t h = 2166136261u;
+
+    // FNV-1a
+    while (len--) {
+        h ^= *p++;
+        h *= 16777619;
+    }
+    return h;
+}
+
+void DnsPtrCache::removeLocked(DnsPtrCacheEntry **pp) {
+    DnsPtrCacheEntry *e = *pp;
+
+    *pp = e->next;
+    e->answer->release();
+    free(e);
+    mCount--;
+}
+
+// Makes room for one entry: drops whatever has expired, or else the
+// entry closest to expiring.
+void DnsPtrCache::evictLocked(uint64_t now) {
+    DnsPtrCacheEntry **victim = NULL;
+
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        DnsPtrCacheEntry **pp = &mBuckets[i];
+        while (*pp) {
+            if ((*pp)->expiresMs <= now) {
+                removeLocked(pp);
+                victim = NULL;
+                continue;
+            }
+            if (!victim || (*pp)->expiresMs < (*victim)->expiresMs) {
+                victim = pp;
+            }
+            pp = &(*pp)->next;
+        }
+    }
+    if (mCount >= mMaxEntries && victim) {
+        removeLocked(victim);
+    }
+}
+
+DnsAnswer *DnsPtrCache::lookup(const DnsAddress *addr, const char *iface) {
+    DnsPtrCacheEntry **pp = &mBuckets[hashAddress(addr) % NUM_BUCKETS];
+    DnsAnswer *answer = NULL;
+
+    pthread_mutex_lock(&mLock);
+    for (; *pp; pp = &(*pp)->next) {
+        DnsPtrCacheEntry *e = *pp;
+        if (addressesEqual(&e->addr, addr) && !strcmp(e->iface, iface)) {
+            if (e->expiresMs <= DnsCache::nowMs()) {
+                removeLocked(pp);
+            } else {
+                answer = e->answer;
+                answer->acquire();
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mLock);
+    return answer;
+}
+
+void DnsPtrCache::insert(const DnsAddress *addr, const char *iface,
+                         DnsAnswer *answer, int ttl) {
+    if (ttl <= 0 || mMaxEntries == 0) {
+        return;
+    }
+
+    DnsPtrCacheEntry *n = (DnsPtrCacheEntry *) calloc(1, sizeof(DnsPtrCacheEntry));
+    if (!n) {
+        return;
+    }
+    uint64_t now = DnsCache::nowMs();
+    n->addr = *addr;
+    strncpy(n->iface, iface, sizeof(n->iface) - 1);
+    n->expiresMs = now + (uint64_t) ttl * 1000;
+    n->answer = answer;
+    answer->acquire();
+
+    DnsPtrCacheEntry **bucket = &mBuckets[hashAddress(addr) % NUM_BUCKETS];
+
+    pthread_mutex_lock(&mLock);
+    for (DnsPtrCacheEntry **pp = bucket; *pp; pp = &(*pp)->next) {
+        if (addressesEqual(&(*pp)->addr, addr) && !strcmp((*pp)->iface, n->iface)) {
+            removeLocked(pp);
+            break;
+        }
+    }
+    if (mCount >= mMaxEntries) {
+        evictLocked(now);
+    }
+    n->next = *bucket;
+    *bucket = n;
+    mCount++;
+    pthread_mutex_unlock(&mLock);
+}
+
+void DnsPtrCache::flush() {
+    pthread_mutex_lock(&mLock);
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        while (mBuckets[i]) {
+            removeLocked(&mBuckets[i]);
+        }
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+void DnsPtrCache::flushInterface(const char *iface) {
+    pthread_mutex_lock(&mLock);
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        DnsPtrCacheEntry **pp = &mBuckets[i];
+        while (*pp) {
+            if (!strcmp((*pp)->iface, iface)) {
+                removeLocked(pp);
+            } else {
+                pp = &(*pp)->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mLock);
+}
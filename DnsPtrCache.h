@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DNS_PTR_CACHE_H
+#define _DNS_PTR_CACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <linux/if.h>
+
+#include "DnsCache.h"
+#include "DnsPacket.h"
+
+struct DnsPtrCacheEntry;
+
+/*
+ * Answers to gethostbyaddr requests, keyed by address and interface.
+ * Failed lookups are cached too, since unroutable addresses are the
+ * slow ones. Much smaller and simpler than DnsCache: reverse lookups
+ * are rare next to forward ones.
+ */
+class DnsPtrCache {
+    static const int NUM_BUCKETS = 64;
+
+    static DnsPtrCache *sInstance;
+
+    pthread_mutex_t   mLock;
+    DnsPtrCacheEntry *mBuckets[NUM_BUCKETS];
+    int               mCount;
+    int               mMaxEntries;
+
+public:
+    virtual ~DnsPtrCache() {}
+
+    static DnsPtrCache *Instance();
+
+    /* As DnsCache::lookup(), without stale answers. */
+    DnsAnswer *lookup(const DnsAddress *addr, const char *iface);
+
+    /* Caches answer for ttl seconds. The cache takes its own reference. */
+    void insert(const DnsAddress *addr, const char *iface, DnsAnswer *answer, int ttl);
+
+    void flush();
+    void flushInterface(const char *iface);
+
+private:
+    DnsPtrCache();
+
+    static uint32_t hashAddress(const DnsAddress *addr);
+    void removeLocked(DnsPtrCacheEntry **pp);
+    void evictLocked(uint64_t now);
+};
+
+#endif
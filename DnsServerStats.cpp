@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <netinet/in.h>
+
+#define LOG_TAG "DnsServerStats"
+#define DBG 0
+
+#include <cutils/log.h>
+
+#include "DnsServerStats.h"
+#include "DnsCache.h"
+
+// Assumed RTT of a server we have not heard from yet.
+static const int DEFAULT_SRTT_MS = 200;
+static const int MAX_FAILURES = 8;
+// The failure score halves for every period without a new failure.
+static const int FAILURE_DECAY_MS = 60 * 1000;
+
+static bool sameAddress(const struct sockaddr_storage *a, const struct sockaddr *b) {
+    if (a->ss_family != b->sa_family) {
+        return false;
+    }
+    if (b->sa_family == AF_INET) {
+        const struct sockaddr_in *x = (const struct sockaddr_in *) a;
+        const struct sockaddr_in *y = (const struct sockaddr_in *) b;
+        return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+    }
+    if (b->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *x = (const struct sockaddr_in6 *) a;
+        const struct sockaddr_in6 *y = (const struct sockaddr_in6 *) b;
+        return x->sin6_port == y->sin6_port &&
+            !memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr));
+    }
+    return false;
+}
+
+DnsServerStats::DnsServerStats() {
+    pthread_mutex_init(&mLock, NULL);
+    memset(mServers, 0, sizeof(mServers));
+}
+
+DnsServerStats::Server *DnsServerStats::findLocked(const struct sockaddr *addr, bool create) {
+    Server *victim = NULL;
+
+    for (int i = 0; i < MAX_SERVERS; i++) {
+        Server *s = &mServers[i];
+        if (s->valid && sameAddress(&s->addr, addr)) {
+            return s;
+        }
+        // Reuse a free slot, or else the least recently used one.
+        if (!s->valid) {
+            if (!victim || victim->valid) {
+                victim = s;
+            }
+        } else if (!victim || (victim->valid && s->lastUsedMs < victim->lastUsedMs)) {
+            victim = s;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    memset(victim, 0, sizeof(*victim));
+    memcpy(&victim->addr, addr, (addr->sa_family == AF_INET6) ?
+           sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+    victim->valid = true;
+    return victim;
+}
+
+void DnsServerStats::reportRtt(const struct sockaddr *addr, int rttMs) {
+    pthread_mutex_lock(&mLock);
+    Server *s = findLocked(addr, true);
+    if (s->srttMs == 0) {
+        s->srttMs = rttMs ? rttMs : 1;
+    } else {
+        s->srttMs = (7 * s->srttMs + rttMs) / 8;
+        if (s->srttMs == 0) {
+            s->srttMs = 1;
+        }
+    }
+    s->failures /= 2;
+    s->lastUsedMs = DnsCache::nowMs();
+    pthread_mutex_unlock(&mLock);
+}
+
+void DnsServerStats::reportFailure(const struct sockaddr *addr) {
+    pthread_mutex_lock(&mLock);
+    Server *s = findLocked(addr, true);
+    if (s->failures < MAX_FAILURES) {
+        s->failures++;
+    }
+    s->lastFailureMs = s->lastUsedMs = DnsCache::nowMs();
+    if (DBG) {
+        LOGD("Server failure, %d recent failures", s->failures);
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+int DnsServerStats::scoreLocked(const struct sockaddr *addr, uint64_t now) {
+    Server *s = findLocked(addr, false);
+
+    if (!s) {
+        return DEFAULT_SRTT_MS;
+    }
+    int srtt = s->srttMs ? s->srttMs : DEFAULT_SRTT_MS;
+    uint64_t periods = (now - s->lastFailureMs) / FAILURE_DECAY_MS;
+    int failures = (periods >= MAX_FAILURES) ? 0 : (s->failures >> periods);
+    // Each recent failure counts as much as doubling the RTT.
+    return srtt << failures;
+}
+
+void DnsServerStats::rank(const struct sockaddr_storage *addrs, int count, int *order) {
+    int scores[MAX_SERVERS];
+    uint64_t now = DnsCache::nowMs();
+
+    if (count > MAX_SERVERS) {
+        count = MAX_SERVERS;
+    }
+    pthread_mutex_lock(&mLock);
+    for (int i = 0; i < count; i++) {
+        order[i] = i;
+        scores[i] = scoreLocked((const struct sockaddr *) &addrs[i], now);
+    }
+    pthread_mutex_unlock(&mLock);
+
+    // Insertion sort keeps servers with equal scores in configured order.
+    for (int i = 1; i < count; i++) {
+        int idx = order[i];
+        int j = i - 1;
+        while (j >= 0 && scores[order[j]] > scores[idx]) {
+            order[j + 1] = order[j];
+            j--;
+        }
+        order[j + 1] = idx;
+    }
+}
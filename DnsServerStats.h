@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DNS_SERVER_STATS_H
+#define _DNS_SERVER_STATS_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * Per-nameserver health, used to decide which servers a query is sent
+ * to first. Each server has a smoothed RTT and a failure score; the
+ * score grows with every timeout or server failure, halves with every
+ * good answer and also decays while the server is left alone, so a
+ * server that was down gets another chance eventually.
+ */
+class DnsServerStats {
+    static const int MAX_SERVERS = 16;
+
+    struct Server {
+        struct sockaddr_storage addr;
+        bool                    valid;
+        int                     srttMs;     // 0 until the first sample
+        int                     failures;
+        uint64_t                lastFailureMs;
+        uint64_t                lastUsedMs;
+    };
+
+    pthread_mutex_t mLock;
+    Server          mServers[MAX_SERVERS];
+
+public:
+    DnsServerStats();
+    virtual ~DnsServerStats() {}
+
+    void reportRtt(const struct sockaddr *addr, int rttMs);
+    void reportFailure(const struct sockaddr *addr);
+
+    /*
+     * Fills order with the indexes of addrs, best server first. Servers
+     * that score the same keep their configured order.
+     */
+    void rank(const struct sockaddr_storage *addrs, int count, int *order);
+
+private:
+    Server *findLocked(const struct sockaddr *addr, bool create);
+    int scoreLocked(const struct sockaddr *addr, uint64_t now);
+};
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define LOG_TAG "DnsSharedCache"
+#define DBG 0
+
+#include <cutils/atomic.h>
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include "DnsSharedCache.h"
+
+static const int DEFAULT_NUM_SLOTS = 64;
+static const int MAX_NUM_SLOTS = 1024;
+
+// /dev is a tmpfs that only root can create files in.
+static const char TABLE_TEMPLATE[] = "/dev/dnsproxyd-cache.XXXXXX";
+
+DnsSharedCache *DnsSharedCache::sInstance = NULL;
+
+DnsSharedCache *DnsSharedCache::Instance() {
+    if (!sInstance)
+        sInstance = new DnsSharedCache();
+    return sInstance;
+}
+
+DnsSharedCache::DnsSharedCache() {
+    char value[PROPERTY_VALUE_MAX];
+
+    pthread_mutex_init(&mLock, NULL);
+    mNumTables = 0;
+
+    mNumSlots = DEFAULT_NUM_SLOTS;
+    if (property_get("net.dnsproxy.shm_slots", value, NULL) > 0) {
+        mNumSlots = atoi(value);
+    }
+    if (mNumSlots > MAX_NUM_SLOTS) {
+        mNumSlots = MAX_NUM_SLOTS;
+    }
+    if (mNumSlots < 0) {
+        mNumSlots = 0;
+    }
+    mSize = sizeof(DnsSharedCacheHeader) + mNumSlots * sizeof(DnsSharedCacheSlot);
+}
+
+// Call with mLock held.
+DnsSharedCache::Table *DnsSharedCache::findTable(uid_t uid) {
+    for (int i = 0; i < mNumTables; i++) {
+        if (mTables[i].uid == uid) {
+            return &mTables[i];
+        }
+    }
+    return NULL;
+}
+
+// Call with mLock held.
+DnsSharedCache::Table *DnsSharedCache::createTable(uid_t uid) {
+    char path[sizeof(TABLE_TEMPLATE)];
+
+    if (mNumTables == MAX_TABLES) {
+        errno = ENOSPC;
+        return NULL;
+    }
+
+    // Open the file twice, read-write for us and read-only for clients,
+    // then unlink it so that nobody can open it again.
+    strcpy(path, TABLE_TEMPLATE);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return NULL;
+    }
+    int readOnlyFd = open(path, O_RDONLY);
+    int savedErrno = errno;
+    unlink(path);
+    if (readOnlyFd < 0) {
+        close(fd);
+        errno = savedErrno;
+        return NULL;
+    }
+
+    // A new file reads back as zeroes: every slot is empty.
+    void *base = MAP_FAILED;
+    if (!ftruncate(fd, mSize)) {
+        base = mmap(NULL, mSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    savedErrno = errno;
+    // The mapping keeps the file alive.
+    close(fd);
+    if (base == MAP_FAILED) {
+        close(readOnlyFd);
+        errno = savedErrno;
+        return NULL;
+    }
+
+    Table *t = &mTables[mNumTables++];
+    t->uid = uid;
+    t->readOnlyFd = readOnlyFd;
+    t->header = (DnsSharedCacheHeader *) base;
+    t->slots = (DnsSharedCacheSlot *) (t->header + 1);
+    t->header->magic = MAGIC;
+    t->header->version = VERSION;
+    t->header->numSlots = mNumSlots;
+    t->header->slotSize = sizeof(DnsSharedCacheSlot);
+    return t;
+}
+
+int DnsSharedCache::getFd(uid_t uid) {
+    if (mNumSlots == 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&mLock);
+    Table *t = findTable(uid);
+    if (!t) {
+        t = createTable(uid);
+        if (!t) {
+            LOGE("Unable to create shared DNS cache for uid %d (%s)", uid, strerror(errno));
+        }
+    }
+    int fd = t ? t->readOnlyFd : -1;
+    pthread_mutex_unlock(&mLock);
+    return fd;
+}
+
+uint32_t DnsSharedCache::hashKey(const char *name, const char *service, int flags,
+                                 int family, int socktype, int protocol) {
+    int32_t ints[4] = { flags, family, socktype, protocol };
+    const uint8_t *p;
+    uint32_t h = 2166136261u;
+
+    // FNV-1a over name and service including their NULs, then the hints.
+    for (p = (const uint8_t *) name; ; p++) {
+        h = (h ^ *p) * 16777619;
+        if (!*p) {
+            break;
+        }
+    }
+    for (p = (const uint8_t *) service; ; p++) {
+        h = (h ^ *p) * 16777619;
+        if (!*p) {
+            break;
+        }
+    }
+    p = (const uint8_t *) ints;
+    for (size_t i = 0; i < sizeof(ints); i++) {
+        h = (h ^ p[i]) * 16777619;
+    }
+    return h;
+}
+
+bool DnsSharedCache::slotMatches(const DnsSharedCacheSlot *s, uint32_t hash,
+                                 const char *name, const char *service,
+                                 const DnsCacheKey *key) {
+    return s->hash == hash &&
+        s->flags == key->flags &&
+        s->family == key->family &&
+        s->socktype == key->socktype &&
+        s->protocol == key->protocol &&
+        !strcmp(s->name, name) &&
+        !strcmp(s->service, service);
+}
+
+void DnsSharedCache::publish(uid_t uid, const DnsCacheKey *key, DnsAnswer *answer,
+                             int ttl) {
+    const char *name = key->name ? key->name : "^";
+    const char *service = key->service ? key->service : "^";
+
+    if (mNumSlots == 0 || ttl <= 0 || strlen(name) >= DnsSharedCacheSlot::MAX_NAME ||
+        strlen(service) >= DnsSharedCacheSlot::MAX_SERVICE ||
+        answer->getCompactLength() > DnsSharedCacheSlot::MAX_ANSWER) {
+        return;
+    }
+
+    uint32_t hash = hashKey(name, service, key->flags, key->family, key->socktype,
+                            key->protocol);
+    uint64_t now = DnsCache::nowMs();
+
+    pthread_mutex_lock(&mLock);
+    Table *t = findTable(uid);
+    if (!t) {
+        pthread_mutex_unlock(&mLock);
+        return;
+    }
+
+    // Replace the same key if it is there, else take a free or expired
+    // slot, else the one expiring soonest.
+    DnsSharedCacheSlot *s = NULL;
+    for (int i = 0; i < MAX_PROBES; i++) {
+        DnsSharedCacheSlot *candidate = &t->slots[(hash + i) % mNumSlots];
+        if (slotMatches(candidate, hash, name, service, key)) {
+            s = candidate;
+            break;
+        }
+        if (!s || (s->expiresMs > now && candidate->expiresMs < s->expiresMs)) {
+            s = candidate;
+        }
+    }
+
+    int32_t seq = s->seq;
+    android_atomic_release_store(seq + 1, &s->seq);
+    android_memory_barrier();
+    s->hash = hash;
+    s->expiresMs = now + (uint64_t) ttl * 1000;
+    s->flags = key->flags;
+    s->family = key->family;
+    s->socktype = key->socktype;
+    s->protocol = key->protocol;
+    strcpy(s->name, name);
+    strcpy(s->service, service);
+    s->answerLen = answer->getCompactLength();
+    memcpy(s->answer, answer->getCompactData(), s->answerLen);
+    android_atomic_release_store(seq + 2, &s->seq);
+    pthread_mutex_unlock(&mLock);
+}
+
+void DnsSharedCache::clear() {
+    pthread_mutex_lock(&mLock);
+    for (int t = 0; t < mNumTables; t++) {
+        for (int i = 0; i < mNumSlots; i++) {
+            DnsSharedCacheSlot *s = &mTables[t].slots[i];
+            if (!s->expiresMs) {
+                continue;
+            }
+            int32_t seq = s->seq;
+            android_atomic_release_store(seq + 1, &s->seq);
+            android_memory_barrier();
+            s->hash = 0;
+            s->expiresMs = 0;
+            android_atomic_release_store(seq + 2, &s->seq);
+        }
+    }
+    pthread_mutex_unlock(&mLock);
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DNS_SHARED_CACHE_H
+#define _DNS_SHARED_CACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "DnsCache.h"
+
+/*
+ * getaddrinfo answers for the default interface, published in shared
+ * memory so that hot names can be resolved without a round trip to
+ * dnsproxyd. Every UID that asks gets a table of its own, holding only
+ * the answers to its own lookups: apps never see each other's names.
+ * The "getaddrinfo_shm" command hands out the caller's table; clients
+ * fall back to the socket for anything not found.
+ *
+ * A table lives in an unlinked, root-only file on tmpfs. Clients only
+ * ever get a descriptor opened O_RDONLY, and a shared mapping of that can
+ * not be made writable with mprotect(), unlike an ashmem region, whose
+ * prot mask doesn't stop that.
+ *
+ * A table is a DnsSharedCacheHeader followed by numSlots slots of
+ * slotSize bytes, all in host byte order. A key lives in one of the
+ * MAX_PROBES slots starting at hash % numSlots, wrapping around, where
+ * hash is hashKey() of the strings the client would send in its
+ * getaddrinfo command ("^" for NULL).
+ *
+ * Each slot is protected by a sequence lock. To read one, load seq and
+ * retry if it is odd, copy the slot, then load seq again after a memory
+ * barrier; the copy is good if seq is unchanged. It is a hit if hash and
+ * every key field match and expiresMs, on the CLOCK_MONOTONIC
+ * millisecond clock, is still in the future. The answer is in the
+ * compact encoding (see DnsProxyListener.h).
+ */
+struct DnsSharedCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numSlots;
+    uint32_t slotSize;
+};
+
+struct DnsSharedCacheSlot {
+    static const int MAX_NAME = 128;
+    static const int MAX_SERVICE = 32;
+    static const int MAX_ANSWER = 828;  // slots are 1KB
+
+    volatile int32_t seq;
+    uint32_t         hash;
+    uint64_t         expiresMs;
+    int32_t          flags;
+    int32_t          family;
+    int32_t          socktype;
+    int32_t          protocol;
+    char             name[MAX_NAME];        // NUL terminated
+    char             service[MAX_SERVICE];  // NUL terminated
+    uint32_t         answerLen;
+    uint8_t          answer[MAX_ANSWER];
+};
+
+class DnsSharedCache {
+public:
+    static const uint32_t MAGIC = 0x444e5348;
+    static const uint32_t VERSION = 1;
+    static const int MAX_PROBES = 4;
+
+private:
+    // Tables are only created for UIDs that ask for one; once there are
+    // this many, later UIDs are left to the socket.
+    static const int MAX_TABLES = 32;
+
+    struct Table {
+        uid_t                 uid;
+        int                   readOnlyFd;  // the one clients get
+        DnsSharedCacheHeader *header;      // our writable mapping
+        DnsSharedCacheSlot   *slots;
+    };
+
+    static DnsSharedCache *sInstance;
+
+    pthread_mutex_t mLock;  // serializes writers and table creation
+    int             mNumSlots;
+    size_t          mSize;
+    Table           mTables[MAX_TABLES];
+    int             mNumTables;
+
+public:
+    virtual ~DnsSharedCache() {}
+
+    static DnsSharedCache *Instance();
+
+    /*
+     * Returns a read-only descriptor for uid's table, creating the table
+     * if needed, or -1 if the shared cache is disabled
+     * ("net.dnsproxy.shm_slots" 0) or out of tables. The descriptor stays
+     * owned by the cache.
+     */
+    int getFd(uid_t uid);
+    size_t getSize() const { return mSize; }
+
+    /*
+     * Publishes the compact encoding of answer under key for ttl seconds
+     * in uid's table, if uid has one. Only answers for the default
+     * interface belong here; answers too big for a slot are left to the
+     * socket.
+     */
+    void publish(uid_t uid, const DnsCacheKey *key, DnsAnswer *answer, int ttl);
+
+    /* Withdraws every answer, e.g. when the default network changes. */
+    void clear();
+
+    static uint32_t hashKey(const char *name, const char *service, int flags,
+                            int family, int socktype, int protocol);
+
+private:
+    DnsSharedCache();
+
+    Table *findTable(uid_t uid);
+    Table *createTable(uid_t uid);
+    static bool slotMatches(const DnsSharedCacheSlot *s, uint32_t hash, const char *name,
+                            const char *service, const DnsCacheKey *key);
+};
+
+#endif
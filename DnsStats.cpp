@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LOG_TAG "DnsStats"
+#define DBG 0
+
+#include <cutils/atomic.h>
+#include <cutils/log.h>
+
+#include "DnsStats.h"
+
+static const char OTHER_IFACE[] = "other";
+
+DnsStats *DnsStats::sInstance = NULL;
+
+DnsStats *DnsStats::Instance() {
+    if (!sInstance)
+        sInstance = new DnsStats();
+    return sInstance;
+}
+
+DnsStats::DnsStats() {
+    memset(mSlots, 0, sizeof(mSlots));
+    Slot *other = &mSlots[MAX_INTERFACES];
+    strncpy(other->iface, OTHER_IFACE, sizeof(other->iface) - 1);
+    other->state = SLOT_READY;
+}
+
+DnsStats::Slot *DnsStats::findSlot(const char *iface) {
+    if (!iface || !*iface) {
+        return &mSlots[MAX_INTERFACES];
+    }
+    for (int i = 0; i < MAX_INTERFACES; i++) {
+        Slot *s = &mSlots[i];
+        int32_t state = android_atomic_acquire_load(&s->state);
+
+        if (state == SLOT_FREE &&
+            android_atomic_acquire_cas(SLOT_FREE, SLOT_CLAIMED, &s->state) == 0) {
+            strncpy(s->iface, iface, sizeof(s->iface) - 1);
+            android_atomic_release_store(SLOT_READY, &s->state);
+            return s;
+        }
+        // Somebody else is claiming it; wait for the name to compare.
+        while ((state = android_atomic_acquire_load(&s->state)) == SLOT_CLAIMED) {
+            sched_yield();
+        }
+        if (!strcmp(s->iface, iface)) {
+            return s;
+        }
+    }
+    return &mSlots[MAX_INTERFACES];
+}
+
+void DnsStats::count(const char *iface, Counter counter) {
+    android_atomic_inc(&findSlot(iface)->counters[counter]);
+}
+
+void DnsStats::recordLatency(const char *iface, int ms) {
+    int bucket = 0;
+
+    while (ms > 0 && bucket < NUM_BUCKETS - 1) {
+        ms >>= 1;
+        bucket++;
+    }
+    android_atomic_inc(&findSlot(iface)->buckets[bucket]);
+}
+
+int DnsStats::format(int i, char *buf, size_t len) {
+    if (i < 0 || i > MAX_INTERFACES) {
+        return -1;
+    }
+    Slot *s = &mSlots[i];
+    if (android_atomic_acquire_load(&s->state) != SLOT_READY) {
+        return -1;
+    }
+
+    int n = snprintf(buf, len, "%s %d %d %d %d %d ", s->iface,
+                     s->counters[CACHE_HIT], s->counters[CACHE_MISS],
+                     s->counters[STALE_HIT], s->counters[COALESCED],
+                     s->counters[UPSTREAM_FAILURE]);
+    int last = 0;
+    for (int b = 0; b < NUM_BUCKETS; b++) {
+        if (s->buckets[b]) {
+            last = b;
+        }
+    }
+    for (int b = 0; b <= last && n >= 0 && (size_t) n < len; b++) {
+        n += snprintf(buf + n, len - n, b ? ",%d" : "%d", s->buckets[b]);
+    }
+    return 0;
+}
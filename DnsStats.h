@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DNS_STATS_H
+#define _DNS_STATS_H
+
+#include <stdint.h>
+#include <linux/if.h>
+
+/*
+ * dnsproxyd counters and upstream latency histograms, per interface.
+ * Recording never takes a lock: every value is a 32 bit atomic and an
+ * interface claims its slot with a compare-and-swap the first time it
+ * is seen. Readers may see a slightly inconsistent snapshot.
+ */
+class DnsStats {
+public:
+    enum Counter {
+        CACHE_HIT = 0,
+        CACHE_MISS,
+        STALE_HIT,      // served after expiry or from a snapshot
+        COALESCED,      // joined a lookup already in flight
+        UPSTREAM_FAILURE,
+        NUM_COUNTERS
+    };
+
+    // Bucket 0 counts lookups under 1ms, bucket i those of [2^(i-1), 2^i)
+    // ms and the last one everything slower.
+    static const int NUM_BUCKETS = 17;
+    static const int MAX_INTERFACES = 8;
+
+private:
+    enum { SLOT_FREE = 0, SLOT_CLAIMED, SLOT_READY };
+
+    struct Slot {
+        volatile int32_t state;
+        char             iface[IFNAMSIZ];
+        volatile int32_t counters[NUM_COUNTERS];
+        volatile int32_t buckets[NUM_BUCKETS];
+    };
+
+    static DnsStats *sInstance;
+
+    Slot mSlots[MAX_INTERFACES + 1];  // the last one for any other interface
+
+public:
+    virtual ~DnsStats() {}
+
+    static DnsStats *Instance();
+
+    void count(const char *iface, Counter counter);
+    void recordLatency(const char *iface, int ms);
+
+    /*
+     * Writes the statistics of slot i as one line:
+     *   <iface> <hit> <miss> <stale> <coalesced> <failed> <b0>,<b1>,...
+     * with trailing empty buckets left out. Returns -1 if slot i is
+     * unused.
+     */
+    int format(int i, char *buf, size_t len);
+
+private:
+    DnsStats();
+
+    Slot *findSlot(const char *iface);
+};
+
+#endif
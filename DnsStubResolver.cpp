@@ -0,0 +1,1012 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define LOG_TAG "DnsStubResolver"
+#define DBG 0
+
+#include <cutils/atomic.h>
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include "DnsStubResolver.h"
+#include "DnsCache.h"
+#include "DnsServerStats.h"
+
+static const char HOSTS_PATH[] = "/system/etc/hosts";
+
+static const int DNS_PORT = 53;
+// Time to wait for each server before trying the next one.
+static const int SERVER_TIMEOUT_MS = 2000;
+// Passes over the server list before giving up.
+static const int RETRY_ROUNDS = 2;
+// How long to wait for the other address family once one has answered.
+static const int DUAL_STACK_GRACE_MS = 300;
+
+DnsStubResolver *DnsStubResolver::sInstance = NULL;
+
+DnsStubResolver *DnsStubResolver::Instance() {
+    if (!sInstance)
+        sInstance = new DnsStubResolver();
+    return sInstance;
+}
+
+DnsStubResolver::DnsStubResolver() {
+    char value[PROPERTY_VALUE_MAX];
+
+    pthread_mutex_init(&mLock, NULL);
+    memset(mServers, 0, sizeof(mServers));
+    mNumInterfaces = 0;
+    mHostsFileNames = new HostNameCollection();
+    mHostsFileAddrs = new HostAddressCollection();
+
+    property_get("net.dnsproxy.native", value, "1");
+    mEnabled = strcmp(value, "0") != 0;
+
+    property_get("net.dnsproxy.race_servers", value, "2");
+    mRaceWidth = atoi(value);
+    if (mRaceWidth < 1 || mRaceWidth > MAX_RACE_WIDTH) {
+        mRaceWidth = MAX_RACE_WIDTH;
+    }
+    mNextGen = 1;
+    mServerStats = new DnsServerStats();
+
+    loadHostsFile();
+}
+
+void DnsStubResolver::loadHostsFile() {
+    FILE *fp = fopen(HOSTS_PATH, "r");
+    char line[512];
+
+    if (!fp) {
+        return;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        char *next = line;
+        char *tok;
+        bool first = true;
+
+        char *hash = strchr(line, '#');
+        if (hash) {
+            *hash = '\0';
+        }
+        while ((tok = strsep(&next, " \t\r\n"))) {
+            if (!*tok) {
+                continue;
+            }
+            if (first) {
+                // The address column
+                first = false;
+                DnsAddress *addr = (DnsAddress *) calloc(1, sizeof(DnsAddress));
+                if (inet_pton(AF_INET, tok, &addr->addr.v4) == 1) {
+                    addr->family = AF_INET;
+                } else if (inet_pton(AF_INET6, tok, &addr->addr.v6) == 1) {
+                    addr->family = AF_INET6;
+                } else {
+                    free(addr);
+                    continue;
+                }
+                mHostsFileAddrs->push_back(addr);
+                continue;
+            }
+            mHostsFileNames->push_back(strdup(tok));
+        }
+    }
+    fclose(fp);
+}
+
+bool DnsStubResolver::inHostsFile(const char *host) {
+    HostNameCollection::iterator it;
+
+    for (it = mHostsFileNames->begin(); it != mHostsFileNames->end(); ++it) {
+        if (!strcasecmp(*it, host)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool addressesEqual(const DnsAddress *a, const DnsAddress *b) {
+    if (a->family != b->family) {
+        return false;
+    }
+    if (a->family == AF_INET) {
+        return a->addr.v4.s_addr == b->addr.v4.s_addr;
+    }
+    return !memcmp(&a->addr.v6, &b->addr.v6, sizeof(a->addr.v6));
+}
+
+bool DnsStubResolver::inHostsFile(const DnsAddress *addr) {
+    HostAddressCollection::iterator it;
+
+    for (it = mHostsFileAddrs->begin(); it != mHostsFileAddrs->end(); ++it) {
+        if (addressesEqual(*it, addr)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parses "addr" or "addr#port" into a socket address.
+static int parseServer(const char *server, struct sockaddr_storage *ss, socklen_t *len) {
+    char addr[INET6_ADDRSTRLEN];
+    int port = DNS_PORT;
+
+    const char *hash = strchr(server, '#');
+    size_t n = hash ? (size_t) (hash - server) : strlen(server);
+    if (n >= sizeof(addr)) {
+        return -1;
+    }
+    memcpy(addr, server, n);
+    addr[n] = '\0';
+    if (hash) {
+        port = atoi(hash + 1);
+        if (port <= 0 || port > 65535) {
+            return -1;
+        }
+    }
+
+    memset(ss, 0, sizeof(*ss));
+    struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ss;
+    if (inet_pton(AF_INET, addr, &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        *len = sizeof(*sin);
+    } else if (inet_pton(AF_INET6, addr, &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        *len = sizeof(*sin6);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// Index of the server in set with the same address, or -1.
+static int findServer(const DnsStubResolver::ServerSet *set,
+                      const struct sockaddr_storage *addr, socklen_t len) {
+    for (int i = 0; i < set->count; i++) {
+        if (set->addrLens[i] == len && !memcmp(&set->addrs[i], addr, len)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Call with mLock held.
+DnsStubResolver::InterfaceServers *DnsStubResolver::findInterface(const char *iface) {
+    for (int i = 0; i < mNumInterfaces; i++) {
+        if (!strcmp(mServers[i].iface, iface)) {
+            return &mServers[i];
+        }
+    }
+    return NULL;
+}
+
+// Call with mLock held. An empty iface frees the slot.
+void DnsStubResolver::writeSlot(InterfaceServers *entry, const char *iface,
+                                const ServerSet *servers) {
+    int32_t seq = entry->seq;
+    android_atomic_release_store(seq + 1, &entry->seq);
+    android_memory_barrier();
+    memset(entry->iface, 0, sizeof(entry->iface));
+    strncpy(entry->iface, iface, sizeof(entry->iface) - 1);
+    entry->servers = *servers;
+    android_atomic_release_store(seq + 2, &entry->seq);
+}
+
+int DnsStubResolver::setInterfaceServers(const char *iface, char **servers, int numservers,
+                                         uint32_t *removed, int *numRemoved) {
+    ServerSet set;
+    ServerSet *s = &set;
+
+    *numRemoved = 0;
+    memset(s, 0, sizeof(*s));
+    for (int i = 0; i < numservers && s->count < MAX_SERVERS; i++) {
+        if (parseServer(servers[i], &s->addrs[s->count], &s->addrLens[s->count])) {
+            LOGW("Ignoring invalid DNS server '%s'", servers[i]);
+            continue;
+        }
+        if (findServer(s, &s->addrs[s->count], s->addrLens[s->count]) >= 0) {
+            continue;
+        }
+        s->count++;
+    }
+
+    pthread_mutex_lock(&mLock);
+    InterfaceServers *entry = findInterface(iface);
+    if (!entry) {
+        if (s->count == 0) {
+            // Nothing configured and nothing to clear.
+            pthread_mutex_unlock(&mLock);
+            return 0;
+        }
+        for (int i = 0; i < mNumInterfaces; i++) {
+            if (!mServers[i].iface[0]) {
+                entry = &mServers[i];
+                break;
+            }
+        }
+        if (!entry) {
+            if (mNumInterfaces == MAX_INTERFACES) {
+                pthread_mutex_unlock(&mLock);
+                errno = ENOSPC;
+                return -1;
+            }
+            entry = &mServers[mNumInterfaces];
+            android_atomic_release_store(mNumInterfaces + 1, &mNumInterfaces);
+        }
+    }
+    const ServerSet *old = entry->iface[0] ? &entry->servers : NULL;
+
+    // Servers that stay keep their generation, so answers from them stay
+    // cached.
+    bool changed = !old || (old->count != s->count);
+    for (int i = 0; i < s->count; i++) {
+        int j = old ? findServer(old, &s->addrs[i], s->addrLens[i]) : -1;
+        if (j >= 0) {
+            s->gens[i] = old->gens[j];
+            changed |= (i != j);
+        } else {
+            s->gens[i] = mNextGen++;
+            changed = true;
+        }
+    }
+    for (int j = 0; old && j < old->count; j++) {
+        if (findServer(s, &old->addrs[j], old->addrLens[j]) < 0) {
+            removed[(*numRemoved)++] = old->gens[j];
+        }
+    }
+
+    writeSlot(entry, s->count ? iface : "", s);
+    pthread_mutex_unlock(&mLock);
+    return changed ? 1 : 0;
+}
+
+int DnsStubResolver::getInterfaceServers(const char *iface, ServerSet *servers) {
+    int n = android_atomic_acquire_load(&mNumInterfaces);
+
+    for (int i = 0; i < n; i++) {
+        InterfaceServers *entry = &mServers[i];
+        bool match;
+        for (;;) {
+            int32_t seq = android_atomic_acquire_load(&entry->seq);
+            if (seq & 1) {
+                continue;
+            }
+            // Bounded: the name may be rewritten while we look.
+            match = !strncmp(entry->iface, iface, sizeof(entry->iface));
+            if (match) {
+                *servers = entry->servers;
+            }
+            android_memory_barrier();
+            if (android_atomic_acquire_load(&entry->seq) == seq) {
+                break;
+            }
+        }
+        if (match) {
+            return (servers->count > 0) ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+// Returns the port for a NULL or numeric service, -1 for anything else.
+static int parsePort(const char *service) {
+    if (!service) {
+        return 0;
+    }
+    char *end;
+    long port = strtol(service, &end, 10);
+    if (*service == '\0' || *end != '\0' || port < 0 || port > 65535) {
+        return -1;
+    }
+    return port;
+}
+
+bool DnsStubResolver::resolvesLocally(const char *host) {
+    struct in6_addr tmp;
+
+    return !host || !*host ||
+        inet_pton(AF_INET, host, &tmp) == 1 || inet_pton(AF_INET6, host, &tmp) == 1 ||
+        strchr(host, '%') || inHostsFile(host);
+}
+
+bool DnsStubResolver::resolvesLocally(const DnsAddress *addr) {
+    return inHostsFile(addr);
+}
+
+bool DnsStubResolver::canResolve(const char *iface, const char *host, const char *service,
+                                 const struct addrinfo *hints) {
+    ServerSet servers;
+
+    if (!mEnabled || resolvesLocally(host) || strlen(host) >= DnsResponse::MAX_NAME) {
+        return false;
+    }
+    if (parsePort(service) < 0) {
+        return false;
+    }
+    if (hints) {
+        if (hints->ai_flags & ~(AI_CANONNAME | AI_ADDRCONFIG | AI_PASSIVE)) {
+            return false;
+        }
+        if (hints->ai_family != AF_UNSPEC && hints->ai_family != AF_INET &&
+            hints->ai_family != AF_INET6) {
+            return false;
+        }
+        switch (hints->ai_socktype) {
+        case 0:
+            if (hints->ai_protocol != 0) {
+                return false;
+            }
+            break;
+        case SOCK_STREAM:
+            if (hints->ai_protocol != 0 && hints->ai_protocol != IPPROTO_TCP) {
+                return false;
+            }
+            break;
+        case SOCK_DGRAM:
+            if (hints->ai_protocol != 0 && hints->ai_protocol != IPPROTO_UDP) {
+                return false;
+            }
+            break;
+        default:
+            return false;
+        }
+    }
+    return iface && getInterfaceServers(iface, &servers) == 0;
+}
+
+void DnsStubResolver::freeAddrInfo(struct addrinfo *ai) {
+    while (ai) {
+        struct addrinfo *next = ai->ai_next;
+        free(ai->ai_canonname);
+        free(ai);
+        ai = next;
+    }
+}
+
+// Allocates an addrinfo and its sockaddr as one block, as bionic does.
+static struct addrinfo *newAddrInfo(const DnsAddress *a, int port, int socktype,
+                                    int protocol) {
+    struct addrinfo *ai = (struct addrinfo *) calloc(1, sizeof(struct addrinfo) +
+                                                     sizeof(struct sockaddr_in6));
+    if (!ai) {
+        return NULL;
+    }
+    ai->ai_family = a->family;
+    ai->ai_socktype = socktype;
+    ai->ai_protocol = protocol;
+    ai->ai_addr = (struct sockaddr *) (ai + 1);
+    if (a->family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *) ai->ai_addr;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        sin->sin_addr = a->addr.v4;
+        ai->ai_addrlen = sizeof(*sin);
+    } else {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ai->ai_addr;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        sin6->sin6_addr = a->addr.v6;
+        ai->ai_addrlen = sizeof(*sin6);
+    }
+    return ai;
+}
+
+int DnsStubResolver::getAddrInfo(const char *iface, const char *host, const char *service,
+                                 const struct addrinfo *hints, struct addrinfo **res,
+                                 int *ttl, uint32_t *sources) {
+    struct addrinfo defaults;
+    DnsResponse responses[2];
+    int qtypes[2];
+    int numQueries = 0;
+
+    if (!hints) {
+        memset(&defaults, 0, sizeof(defaults));
+        hints = &defaults;
+    }
+    *res = NULL;
+    *ttl = -1;
+    memset(sources, 0, MAX_PARALLEL_QUERIES * sizeof(*sources));
+
+    // Same order as bionic: AAAA before A.
+    bool addrconfig = (hints->ai_flags & AI_ADDRCONFIG) != 0;
+    if ((hints->ai_family == AF_UNSPEC || hints->ai_family == AF_INET6) &&
+        (!addrconfig || haveRoute(iface, AF_INET6))) {
+        qtypes[numQueries++] = DnsPacket::TYPE_AAAA;
+    }
+    if ((hints->ai_family == AF_UNSPEC || hints->ai_family == AF_INET) &&
+        (!addrconfig || haveRoute(iface, AF_INET))) {
+        qtypes[numQueries++] = DnsPacket::TYPE_A;
+    }
+    if (numQueries == 0) {
+        return EAI_NODATA;
+    }
+
+    // AAAA and A go out together; once one is answered the other gets
+    // only a short grace period before we answer with what we have.
+    int results[2];
+    if (queryMany(iface, host, qtypes, numQueries, responses, results,
+                  DUAL_STACK_GRACE_MS, 0)) {
+        return EAI_AGAIN;
+    }
+
+    int succeeded = 0;
+    bool nxdomain = false;
+    for (int i = 0; i < numQueries; i++) {
+        if (results[i] == 0) {
+            succeeded++;
+            sources[i] = responses[i].serverGen;
+            if (responses[i].rcode == DnsPacket::RCODE_NXDOMAIN) {
+                nxdomain = true;
+            }
+        } else {
+            responses[i].numAddrs = 0;
+            responses[i].ttl = -1;
+        }
+    }
+
+    int numAddrs = 0;
+    int minTtl = -1;
+    const char *canonName = NULL;
+    for (int i = 0; i < numQueries; i++) {
+        if (responses[i].numAddrs > 0) {
+            numAddrs += responses[i].numAddrs;
+            if (!canonName) {
+                canonName = responses[i].canonName;
+            }
+        }
+        if (responses[i].ttl >= 0 && (minTtl < 0 || responses[i].ttl < minTtl)) {
+            minTtl = responses[i].ttl;
+        }
+    }
+
+    if (numAddrs == 0) {
+        if (nxdomain) {
+            *ttl = minTtl;
+            return EAI_NONAME;
+        }
+        if (succeeded < numQueries) {
+            return EAI_AGAIN;
+        }
+        *ttl = minTtl;
+        return EAI_NODATA;
+    }
+
+    int socktypes[2];
+    int protocols[2];
+    int numSocktypes = 0;
+    if (hints->ai_socktype == 0 || hints->ai_socktype == SOCK_DGRAM) {
+        socktypes[numSocktypes] = SOCK_DGRAM;
+        protocols[numSocktypes++] = IPPROTO_UDP;
+    }
+    if (hints->ai_socktype == 0 || hints->ai_socktype == SOCK_STREAM) {
+        socktypes[numSocktypes] = SOCK_STREAM;
+        protocols[numSocktypes++] = IPPROTO_TCP;
+    }
+
+    int port = parsePort(service);
+    struct addrinfo **tail = res;
+    for (int s = 0; s < numSocktypes; s++) {
+        for (int i = 0; i < numQueries; i++) {
+            for (int j = 0; j < responses[i].numAddrs; j++) {
+                struct addrinfo *ai = newAddrInfo(&responses[i].addrs[j], port,
+                                                  socktypes[s], protocols[s]);
+                if (!ai) {
+                    freeAddrInfo(*res);
+                    *res = NULL;
+                    return EAI_MEMORY;
+                }
+                *tail = ai;
+                tail = &ai->ai_next;
+            }
+        }
+    }
+    if (hints->ai_flags & AI_CANONNAME) {
+        (*res)->ai_canonname = strdup(canonName);
+    }
+    // Don't cache an answer that is missing a family because of a timeout.
+    *ttl = (succeeded == numQueries) ? minTtl : 0;
+    return 0;
+}
+
+bool DnsStubResolver::canResolveAddr(const char *iface, const DnsAddress *addr) {
+    ServerSet servers;
+
+    if (!mEnabled || (addr->family != AF_INET && addr->family != AF_INET6)) {
+        return false;
+    }
+    if (inHostsFile(addr)) {
+        return false;
+    }
+    return iface && getInterfaceServers(iface, &servers) == 0;
+}
+
+int DnsStubResolver::getHostByAddr(const char *iface, const DnsAddress *addr,
+                                   char *name, int namelen, int *ttl, int timeoutMs) {
+    char qname[DnsResponse::MAX_NAME];
+    DnsResponse resp;
+
+    *ttl = -1;
+    if (DnsPacket::reverseName(addr, qname, sizeof(qname))) {
+        return HOST_NOT_FOUND;
+    }
+    if (query(iface, qname, DnsPacket::TYPE_PTR, &resp, timeoutMs)) {
+        return TRY_AGAIN;
+    }
+    *ttl = resp.ttl;
+    if (resp.rcode == DnsPacket::RCODE_NXDOMAIN) {
+        return HOST_NOT_FOUND;
+    }
+    if (!resp.ptrName[0]) {
+        return NO_DATA;
+    }
+    strncpy(name, resp.ptrName, namelen - 1);
+    name[namelen - 1] = '\0';
+    return 0;
+}
+
+int DnsStubResolver::query(const char *iface, const char *name, int qtype,
+                           DnsResponse *resp, int timeoutMs) {
+    int result;
+
+    if (queryMany(iface, name, &qtype, 1, resp, &result, 0, timeoutMs)) {
+        return -1;
+    }
+    if (result) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * One question being resolved by queryMany(). An attempt sends it to the
+ * next mRaceWidth servers in ranked order at once, each over a fresh
+ * socket so every server sees its own source port and query id; the
+ * first good answer wins. The attempt fails over to the next servers
+ * once every racer has timed out or failed.
+ */
+struct PendingQuery {
+    int          qtype;
+    uint8_t      buf[DnsPacket::MAX_UDP_SIZE];
+    int          len;
+    DnsResponse *resp;
+    int          fds[DnsStubResolver::MAX_RACE_WIDTH];     // -1 if not racing
+    uint16_t     ids[DnsStubResolver::MAX_RACE_WIDTH];
+    int          servers[DnsStubResolver::MAX_RACE_WIDTH];  // index in ServerSet
+    uint64_t     sentMs[DnsStubResolver::MAX_RACE_WIDTH];
+    int          next;       // position in the ranked order to try next
+    uint64_t     deadline;   // of the outstanding attempt
+    int          result;     // 1 while pending, then 0 or -1
+};
+
+void DnsStubResolver::closeRacer(PendingQuery *q, int slot) {
+    if (q->fds[slot] >= 0) {
+        close(q->fds[slot]);
+        q->fds[slot] = -1;
+    }
+}
+
+bool DnsStubResolver::startAttempt(const char *iface, const ServerSet *servers,
+                                   const int *order, PendingQuery *q) {
+    int width = (mRaceWidth < servers->count) ? mRaceWidth : servers->count;
+    int started = 0;
+
+    while (started < width && q->next < servers->count * RETRY_ROUNDS) {
+        int i = order[q->next++ % servers->count];
+        const struct sockaddr *addr = (const struct sockaddr *) &servers->addrs[i];
+        uint16_t id = arc4random() & 0xffff;
+
+        q->buf[0] = id >> 8;
+        q->buf[1] = id & 0xff;
+        int fd = openSocket(iface, addr->sa_family, SOCK_DGRAM);
+        if (fd < 0) {
+            continue;
+        }
+        // Connecting filters out datagrams from anyone but the server.
+        if (connect(fd, addr, servers->addrLens[i]) < 0 ||
+            send(fd, q->buf, q->len, 0) != q->len) {
+            if (DBG) {
+                LOGD("Unable to send DNS query (%s)", strerror(errno));
+            }
+            mServerStats->reportFailure(addr);
+            close(fd);
+            continue;
+        }
+        q->fds[started] = fd;
+        q->ids[started] = id;
+        q->servers[started] = i;
+        q->sentMs[started] = DnsCache::nowMs();
+        started++;
+    }
+    if (started == 0) {
+        q->result = -1;
+        return false;
+    }
+    q->deadline = DnsCache::nowMs() + SERVER_TIMEOUT_MS;
+    return true;
+}
+
+// Handles a datagram on one racer's socket. Returns true once q is settled.
+// A non-zero limit is when queryMany() gives up on q, which bounds the
+// retry over TCP too.
+bool DnsStubResolver::handleReply(const char *iface, const ServerSet *servers,
+                                  const int *order, const char *name,
+                                  PendingQuery *q, int slot, uint64_t limit) {
+    uint8_t buf[DnsPacket::MAX_UDP_SIZE];
+    int server = q->servers[slot];
+    const struct sockaddr *addr = (const struct sockaddr *) &servers->addrs[server];
+
+    int n = recv(q->fds[slot], buf, sizeof(buf), 0);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return false;
+    }
+    if (n >= 0 && DnsPacket::parseResponse(buf, n, q->ids[slot], name, q->qtype,
+                                           q->resp)) {
+        // Not an answer to our question; keep waiting.
+        return false;
+    }
+    closeRacer(q, slot);
+
+    // n < 0 is e.g. ECONNREFUSED from an ICMP error: this server is no use.
+    if (n >= 0) {
+        int rttMs = DnsCache::nowMs() - q->sentMs[slot];
+        if (q->resp->truncated) {
+            q->buf[0] = q->ids[slot] >> 8;
+            q->buf[1] = q->ids[slot] & 0xff;
+            uint64_t deadline = DnsCache::nowMs() + SERVER_TIMEOUT_MS;
+            bool capped = limit && limit < deadline;
+            if (capped) {
+                deadline = limit;
+            }
+            if (queryServerTcp(iface, addr, servers->addrLens[server], q->buf, q->len,
+                               name, q->qtype, q->resp, deadline) < 0) {
+                if (capped && DnsCache::nowMs() >= deadline) {
+                    // Out of time for the whole request, which is not
+                    // this server's fault.
+                    for (int i = 0; i < MAX_RACE_WIDTH; i++) {
+                        closeRacer(q, i);
+                    }
+                    q->result = -1;
+                    return true;
+                }
+                q->resp->rcode = DnsPacket::RCODE_SERVFAIL;
+            }
+        }
+        if (q->resp->rcode == DnsPacket::RCODE_NOERROR ||
+            q->resp->rcode == DnsPacket::RCODE_NXDOMAIN) {
+            q->resp->serverGen = servers->gens[server];
+            mServerStats->reportRtt(addr, rttMs);
+            // The losers of the race are not penalized; they may just be
+            // a little slower.
+            for (int i = 0; i < MAX_RACE_WIDTH; i++) {
+                closeRacer(q, i);
+            }
+            q->result = 0;
+            return true;
+        }
+        if (DBG) {
+            LOGD("Server %d returned rcode %d for %s", server, q->resp->rcode, name);
+        }
+    }
+    mServerStats->reportFailure(addr);
+
+    for (int i = 0; i < MAX_RACE_WIDTH; i++) {
+        if (q->fds[i] >= 0) {
+            // Another racer is still out; wait for it.
+            return false;
+        }
+    }
+    return !startAttempt(iface, servers, order, q);
+}
+
+int DnsStubResolver::queryMany(const char *iface, const char *name, const int *qtypes,
+                               int numQueries, DnsResponse *resps, int *results,
+                               int graceMs, int timeoutMs) {
+    static const int MAX_FDS = MAX_PARALLEL_QUERIES * MAX_RACE_WIDTH;
+    PendingQuery queries[MAX_PARALLEL_QUERIES];
+    struct pollfd pfds[MAX_FDS];
+    int mapQuery[MAX_FDS];
+    int mapSlot[MAX_FDS];
+    int order[MAX_SERVERS];
+    ServerSet servers;
+
+    if (numQueries > MAX_PARALLEL_QUERIES) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (getInterfaceServers(iface, &servers)) {
+        errno = ENOENT;
+        return -1;
+    }
+    mServerStats->rank(servers.addrs, servers.count, order);
+
+    int pending = 0;
+    for (int i = 0; i < numQueries; i++) {
+        PendingQuery *q = &queries[i];
+        q->qtype = qtypes[i];
+        q->resp = &resps[i];
+        for (int j = 0; j < MAX_RACE_WIDTH; j++) {
+            q->fds[j] = -1;
+        }
+        q->next = 0;
+        q->result = 1;
+        q->len = DnsPacket::buildQuery(q->buf, sizeof(q->buf), 0, name, qtypes[i]);
+        if (q->len < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    // Send every question before waiting on any of them.
+    for (int i = 0; i < numQueries; i++) {
+        if (startAttempt(iface, &servers, order, &queries[i])) {
+            pending++;
+        }
+    }
+
+    uint64_t graceDeadline = 0;
+    uint64_t hardDeadline = timeoutMs ? DnsCache::nowMs() + timeoutMs : 0;
+    while (pending > 0) {
+        uint64_t now = DnsCache::nowMs();
+        uint64_t deadline = graceDeadline;
+        if (hardDeadline && (!deadline || hardDeadline < deadline)) {
+            deadline = hardDeadline;
+        }
+        int nfds = 0;
+
+        for (int i = 0; i < numQueries; i++) {
+            PendingQuery *q = &queries[i];
+            if (q->result != 1) {
+                continue;
+            }
+            if (q->deadline <= now) {
+                // Every racer timed out: move on to the next servers.
+                for (int j = 0; j < MAX_RACE_WIDTH; j++) {
+                    if (q->fds[j] >= 0) {
+                        mServerStats->reportFailure(
+                                (const struct sockaddr *) &servers.addrs[q->servers[j]]);
+                        closeRacer(q, j);
+                    }
+                }
+                if (!startAttempt(iface, &servers, order, q)) {
+                    pending--;
+                    continue;
+                }
+            }
+            if (!deadline || q->deadline < deadline) {
+                deadline = q->deadline;
+            }
+            for (int j = 0; j < MAX_RACE_WIDTH; j++) {
+                if (q->fds[j] < 0) {
+                    continue;
+                }
+                pfds[nfds].fd = q->fds[j];
+                pfds[nfds].events = POLLIN;
+                pfds[nfds].revents = 0;
+                mapQuery[nfds] = i;
+                mapSlot[nfds++] = j;
+            }
+        }
+        if (pending == 0 || (graceDeadline && now >= graceDeadline) ||
+            (hardDeadline && now >= hardDeadline)) {
+            break;
+        }
+
+        int rc = poll(pfds, nfds, (int) (deadline - now));
+        if (rc < 0 && errno != EINTR) {
+            LOGE("poll failed (%s)", strerror(errno));
+            break;
+        }
+        for (int j = 0; rc > 0 && j < nfds; j++) {
+            PendingQuery *q = &queries[mapQuery[j]];
+            if (!pfds[j].revents || q->result != 1 || q->fds[mapSlot[j]] < 0) {
+                continue;
+            }
+            // The grace period may have started since the poll.
+            uint64_t limit = graceDeadline;
+            if (hardDeadline && (!limit || hardDeadline < limit)) {
+                limit = hardDeadline;
+            }
+            if (handleReply(iface, &servers, order, name, q, mapSlot[j], limit)) {
+                pending--;
+                if (q->result == 0 && !graceDeadline && graceMs > 0) {
+                    // Don't hold a good answer hostage to a slow one.
+                    graceDeadline = DnsCache::nowMs() + graceMs;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < numQueries; i++) {
+        PendingQuery *q = &queries[i];
+        for (int j = 0; j < MAX_RACE_WIDTH; j++) {
+            closeRacer(q, j);
+        }
+        results[i] = (q->result == 0) ? 0 : -1;
+    }
+    return 0;
+}
+
+int DnsStubResolver::openSocket(const char *iface, int family, int type) {
+    int fd = socket(family, type, 0);
+    if (fd < 0) {
+        LOGE("Unable to create DNS socket (%s)", strerror(errno));
+        return -1;
+    }
+    if (iface && *iface &&
+        setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, iface, strlen(iface) + 1) < 0) {
+        // Unbound, the query would leak out of whatever interface has
+        // the default route.
+        LOGW("Unable to bind DNS socket to %s (%s)", iface, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// Waits for events on fd until the monotonic deadline. Returns 0 when
+// ready, -1 with errno ETIMEDOUT or the poll error otherwise.
+static int waitFor(int fd, short events, uint64_t deadline) {
+    while (1) {
+        uint64_t now = DnsCache::nowMs();
+        if (now >= deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = events;
+        pfd.revents = 0;
+        int rc = poll(&pfd, 1, (int) (deadline - now));
+        if (rc > 0) {
+            return 0;
+        }
+        if (rc < 0 && errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+static int writeFully(int fd, const uint8_t *data, int len, uint64_t deadline) {
+    while (len > 0) {
+        if (waitFor(fd, POLLOUT, deadline)) {
+            return -1;
+        }
+        int n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int readFully(int fd, uint8_t *data, int len, uint64_t deadline) {
+    while (len > 0) {
+        if (waitFor(fd, POLLIN, deadline)) {
+            return -1;
+        }
+        int n = read(fd, data, len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int DnsStubResolver::queryServerTcp(const char *iface, const struct sockaddr *addr,
+                                    socklen_t addrLen, const uint8_t *query, int queryLen,
+                                    const char *name, int qtype, DnsResponse *resp,
+                                    uint64_t deadline) {
+    uint8_t lenbuf[2];
+    int rc = -1;
+
+    int fd = openSocket(iface, addr->sa_family, SOCK_STREAM);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, addr, addrLen) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+
+    lenbuf[0] = queryLen >> 8;
+    lenbuf[1] = queryLen & 0xff;
+    if (writeFully(fd, lenbuf, 2, deadline) == 0 &&
+        writeFully(fd, query, queryLen, deadline) == 0 &&
+        readFully(fd, lenbuf, 2, deadline) == 0) {
+        int len = (lenbuf[0] << 8) | lenbuf[1];
+        uint8_t *buf = (uint8_t *) malloc(len ? len : 1);
+        if (buf && readFully(fd, buf, len, deadline) == 0 &&
+            DnsPacket::parseResponse(buf, len, DnsPacket::getId(query), name, qtype,
+                                     resp) == 0 &&
+            !resp->truncated) {
+            rc = 0;
+        }
+        free(buf);
+    }
+    close(fd);
+    return rc;
+}
+
+/*
+ * Whether there is a route to the global unicast space for family out of
+ * iface (or any interface if none is given), which is how bionic
+ * implements AI_ADDRCONFIG. No packets are sent.
+ */
+bool DnsStubResolver::haveRoute(const char *iface, int family) {
+    struct sockaddr_storage ss;
+    socklen_t len;
+
+    memset(&ss, 0, sizeof(ss));
+    if (family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *) &ss;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(DNS_PORT);
+        sin->sin_addr.s_addr = htonl(0x08080808);
+        len = sizeof(*sin);
+    } else {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &ss;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(DNS_PORT);
+        sin6->sin6_addr.s6_addr[0] = 0x20;
+        len = sizeof(*sin6);
+    }
+
+    int fd = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0) {
+        return false;
+    }
+    if (iface && *iface &&
+        setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, iface, strlen(iface) + 1) < 0) {
+        close(fd);
+        return false;
+    }
+    bool ok = connect(fd, (struct sockaddr *) &ss, len) == 0;
+    close(fd);
+    return ok;
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DNS_STUB_RESOLVER_H
+#define _DNS_STUB_RESOLVER_H
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/if.h>
+
+#include <utils/List.h>
+
+#include "DnsPacket.h"
+#include "DnsServerStats.h"
+
+struct PendingQuery;
+
+/*
+ * A stub resolver that talks to the nameservers configured per interface
+ * through ResolverController, instead of going through bionic. It builds
+ * and parses the DNS messages itself, so dnsproxyd controls retries,
+ * timeouts and how concurrent queries use sockets.
+ *
+ * Servers are numeric addresses, optionally followed by "#port"
+ * (e.g. "127.0.0.1#5353") to point the resolver at a local test server.
+ */
+class DnsStubResolver {
+public:
+    static const int MAX_SERVERS = 4;
+    static const int MAX_PARALLEL_QUERIES = 2;
+    // Servers a query is sent to at once ("net.dnsproxy.race_servers").
+    static const int MAX_RACE_WIDTH = 2;
+
+    /*
+     * Each server gets a generation number when it is configured for an
+     * interface and keeps it for as long as it stays configured, so cached
+     * answers can tell whether the server they came from is still in use.
+     */
+    struct ServerSet {
+        int                     count;
+        struct sockaddr_storage addrs[MAX_SERVERS];
+        socklen_t               addrLens[MAX_SERVERS];
+        uint32_t                gens[MAX_SERVERS];
+    };
+
+    static const int MAX_INTERFACES = 8;
+
+private:
+    /*
+     * Every query reads the servers of its interface, so readers take no
+     * lock: each slot, name and servers alike, is guarded by a sequence
+     * lock. mLock only serializes writers. A slot whose interface lost
+     * its servers is freed (empty name) for the next new interface.
+     */
+    struct InterfaceServers {
+        volatile int32_t seq;
+        char             iface[IFNAMSIZ];
+        ServerSet        servers;
+    };
+
+    typedef android::List<char *> HostNameCollection;
+    typedef android::List<DnsAddress *> HostAddressCollection;
+
+    static DnsStubResolver *sInstance;
+
+    pthread_mutex_t             mLock;
+    InterfaceServers            mServers[MAX_INTERFACES];
+    volatile int32_t            mNumInterfaces;
+    HostNameCollection         *mHostsFileNames;
+    HostAddressCollection      *mHostsFileAddrs;
+    bool                        mEnabled;
+    int                         mRaceWidth;
+    uint32_t                    mNextGen;
+    DnsServerStats             *mServerStats;
+
+public:
+    virtual ~DnsStubResolver() {}
+
+    static DnsStubResolver *Instance();
+
+    /*
+     * Replaces the servers of iface; no servers frees its slot. The
+     * generations of the servers that were dropped are stored in removed
+     * (MAX_SERVERS entries) and their number in *numRemoved. Returns 1 if
+     * the set of servers changed, 0 if not, or -1 with ENOSPC if
+     * MAX_INTERFACES other interfaces have servers already.
+     */
+    int setInterfaceServers(const char *iface, char **servers, int numservers,
+                            uint32_t *removed, int *numRemoved);
+
+    /* Copies the servers configured for iface. Returns -1 if there are none. */
+    int getInterfaceServers(const char *iface, ServerSet *servers);
+
+    /*
+     * Whether libc answers host without asking any server: NULL and
+     * numeric hosts, and names listed in the hosts file. Such answers
+     * are the same on every interface.
+     */
+    bool resolvesLocally(const char *host);
+    bool resolvesLocally(const DnsAddress *addr);
+
+    /*
+     * Whether getAddrInfo() handles this request exactly as libc would.
+     * Numeric hosts, names listed in the hosts file, service names and
+     * unusual hints are left to getaddrinfo().
+     */
+    bool canResolve(const char *iface, const char *host, const char *service,
+                    const struct addrinfo *hints);
+
+    /*
+     * getaddrinfo() replacement. On success *ttl is how long the answer
+     * may be cached; for NXDOMAIN/NODATA it is the negative TTL, or -1
+     * if the server did not provide one. sources (MAX_PARALLEL_QUERIES
+     * entries) receives the generations of the servers that answered, 0
+     * for unused entries. Free results with freeAddrInfo().
+     */
+    int getAddrInfo(const char *iface, const char *host, const char *service,
+                    const struct addrinfo *hints, struct addrinfo **res, int *ttl,
+                    uint32_t *sources);
+
+    static void freeAddrInfo(struct addrinfo *ai);
+
+    /*
+     * Whether getHostByAddr() can look up addr. Addresses listed in the
+     * hosts file are left to gethostbyaddr().
+     */
+    bool canResolveAddr(const char *iface, const DnsAddress *addr);
+
+    /*
+     * Reverse lookup of addr, giving up after timeoutMs. Returns 0 with
+     * the host name in name, or HOST_NOT_FOUND, NO_DATA or TRY_AGAIN as
+     * gethostbyaddr() sets h_errno. *ttl is as for getAddrInfo().
+     */
+    int getHostByAddr(const char *iface, const DnsAddress *addr, char *name, int namelen,
+                      int *ttl, int timeoutMs);
+
+    /*
+     * Resolves one question against the servers of iface. It is sent to
+     * the best ranked servers at once, moving on to the next ones on
+     * timeout or server failure, and truncated answers are retried over
+     * TCP. A non-zero timeoutMs bounds the whole query. Returns 0 with
+     * resp filled in (rcode NOERROR or NXDOMAIN), or -1 with errno set if
+     * no server gave a usable answer.
+     */
+    int query(const char *iface, const char *name, int qtype, DnsResponse *resp,
+              int timeoutMs = 0);
+
+private:
+    DnsStubResolver();
+
+    void loadHostsFile();
+    bool inHostsFile(const char *host);
+    bool inHostsFile(const DnsAddress *addr);
+
+    /*
+     * Resolves several questions about name at once, e.g. A and AAAA,
+     * over separate sockets. Each gets the same server racing and
+     * failover as query(); results[i] is 0 if resps[i] holds an answer. With a
+     * non-zero graceMs, questions still unanswered graceMs after the first
+     * answer arrived are abandoned, and with a non-zero timeoutMs all of
+     * them are abandoned after that long. Returns -1 only if nothing was
+     * sent.
+     */
+    int queryMany(const char *iface, const char *name, const int *qtypes,
+                  int numQueries, DnsResponse *resps, int *results, int graceMs,
+                  int timeoutMs);
+
+    bool startAttempt(const char *iface, const ServerSet *servers, const int *order,
+                      PendingQuery *q);
+    bool handleReply(const char *iface, const ServerSet *servers, const int *order,
+                     const char *name, PendingQuery *q, int slot, uint64_t limit);
+    static void closeRacer(PendingQuery *q, int slot);
+    int queryServerTcp(const char *iface, const struct sockaddr *addr, socklen_t addrLen,
+                       const uint8_t *query, int queryLen, const char *name, int qtype,
+                       DnsResponse *resp, uint64_t deadline);
+
+    InterfaceServers *findInterface(const char *iface);
+    static void writeSlot(InterfaceServers *entry, const char *iface, const ServerSet *servers);
+
+    static int openSocket(const char *iface, int family, int type);
+    static bool haveRoute(const char *iface, int family);
+};
+
+#endif
@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LOG_TAG "DnsWorkerPool"
+#define DBG 0
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include "DnsWorkerPool.h"
+
+static const int WORKERS_PER_CPU = 4;
+static const int MAX_WORKERS = 64;
+// Share of the backlog one UID may fill by default.
+static const int UID_QUEUE_DIVISOR = 4;
+
+// Reads a positive integer property, or returns def.
+static int getIntProperty(const char *name, int def) {
+    char value[PROPERTY_VALUE_MAX];
+
+    if (property_get(name, value, NULL) > 0) {
+        int n = atoi(value);
+        if (n > 0) {
+            return n;
+        }
+        LOGW("Ignoring invalid %s value '%s'", name, value);
+    }
+    return def;
+}
+
+DnsWorkerPool::DnsWorkerPool(int numThreads, int maxQueued) {
+    pthread_mutex_init(&mLock, NULL);
+    pthread_cond_init(&mCond, NULL);
+    mQueues = new UidQueueCollection();
+    mRunnable = new UidQueueCollection();
+    mNumQueued = 0;
+    mNumThreads = numThreads;
+    mMaxQueued = maxQueued;
+
+    int perUid = maxQueued / UID_QUEUE_DIVISOR;
+    mMaxQueuedPerUid = getIntProperty("net.dnsproxy.uid_max_queued",
+                                      perUid > 0 ? perUid : 1);
+    int running = numThreads / 2;
+    mMaxRunningPerUid = getIntProperty("net.dnsproxy.uid_max_running",
+                                       running > 0 ? running : 1);
+    // Jobs served from one UID before moving on to the next.
+    mQuantum = getIntProperty("net.dnsproxy.uid_quantum", 1);
+}
+
+DnsWorkerPool::~DnsWorkerPool() {
+    // Workers never exit, so the pool is expected to live as long as netd.
+    UidQueueCollection::iterator it;
+
+    for (it = mQueues->begin(); it != mQueues->end(); ++it) {
+        DnsJobCollection::iterator jt;
+        for (jt = (*it)->jobs.begin(); jt != (*it)->jobs.end(); ++jt) {
+            delete *jt;
+        }
+        delete *it;
+    }
+    delete mQueues;
+    delete mRunnable;
+}
+
+int DnsWorkerPool::defaultNumThreads() {
+    char value[PROPERTY_VALUE_MAX];
+
+    if (property_get("net.dnsproxy.workers", value, NULL) > 0) {
+        int n = atoi(value);
+        if (n > 0 && n <= MAX_WORKERS) {
+            return n;
+        }
+        LOGW("Ignoring invalid net.dnsproxy.workers value '%s'", value);
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    int n = (int) cpus * WORKERS_PER_CPU;
+    return (n > MAX_WORKERS) ? MAX_WORKERS : n;
+}
+
+int DnsWorkerPool::start() {
+    pthread_attr_t attr;
+    int started = 0;
+    int rc = 0;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (int i = 0; i < mNumThreads; i++) {
+        pthread_t thread;
+        rc = pthread_create(&thread, &attr, DnsWorkerPool::threadStart, this);
+        if (rc) {
+            LOGE("pthread_create failed (%s)", strerror(rc));
+            break;
+        }
+        started++;
+    }
+    pthread_attr_destroy(&attr);
+
+    if (started == 0) {
+        // enqueue() turns work away rather than queue it for nobody.
+        pthread_mutex_lock(&mLock);
+        mNumThreads = 0;
+        pthread_mutex_unlock(&mLock);
+        errno = rc;
+        return -1;
+    }
+    if (started != mNumThreads) {
+        LOGW("Only started %d of %d DNS workers", started, mNumThreads);
+        mNumThreads = started;
+    }
+    if (DBG) {
+        LOGD("Started %d DNS workers", mNumThreads);
+    }
+    return 0;
+}
+
+DnsWorkerPool::UidQueue *DnsWorkerPool::findQueueLocked(uid_t uid, bool create) {
+    UidQueueCollection::iterator it;
+
+    for (it = mQueues->begin(); it != mQueues->end(); ++it) {
+        if ((*it)->uid == uid) {
+            return *it;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    UidQueue *q = new UidQueue;
+    q->uid = uid;
+    q->deficit = 0;
+    q->running = 0;
+    q->runnable = false;
+    mQueues->push_back(q);
+    return q;
+}
+
+void DnsWorkerPool::removeQueueLocked(UidQueueCollection *list, UidQueue *q) {
+    UidQueueCollection::iterator it;
+
+    for (it = list->begin(); it != list->end(); ++it) {
+        if (*it == q) {
+            list->erase(it);
+            return;
+        }
+    }
+}
+
+int DnsWorkerPool::enqueue(DnsJob *job, uid_t uid) {
+    pthread_mutex_lock(&mLock);
+    if (mNumThreads == 0) {
+        pthread_mutex_unlock(&mLock);
+        errno = ESRCH;
+        return -1;
+    }
+    UidQueue *q = findQueueLocked(uid, true);
+    if (mNumQueued >= mMaxQueued || (int) q->jobs.size() >= mMaxQueuedPerUid) {
+        if (q->jobs.empty() && q->running == 0) {
+            removeQueueLocked(mQueues, q);
+            delete q;
+        }
+        pthread_mutex_unlock(&mLock);
+        if (DBG) {
+            LOGD("Rejecting DNS job for uid %d", uid);
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    q->jobs.push_back(job);
+    mNumQueued++;
+    if (!q->runnable && q->running < mMaxRunningPerUid) {
+        q->runnable = true;
+        mRunnable->push_back(q);
+        pthread_cond_signal(&mCond);
+    }
+    pthread_mutex_unlock(&mLock);
+    return 0;
+}
+
+/*
+ * Deficit round robin with every job costing one: the queue at the head
+ * of mRunnable runs up to mQuantum jobs, then goes to the back. Queues
+ * leave mRunnable while empty or at their running cap.
+ */
+DnsJob *DnsWorkerPool::dequeueLocked(UidQueue **from) {
+    while (1) {
+        UidQueue *q = *mRunnable->begin();
+        if (q->deficit <= 0) {
+            q->deficit += mQuantum;
+            mRunnable->erase(mRunnable->begin());
+            mRunnable->push_back(q);
+            continue;
+        }
+
+        DnsJobCollection::iterator it = q->jobs.begin();
+        DnsJob *job = *it;
+        q->jobs.erase(it);
+        mNumQueued--;
+        q->deficit--;
+        q->running++;
+        if (q->jobs.empty() || q->running >= mMaxRunningPerUid) {
+            // An idle queue does not bank credit for later.
+            if (q->jobs.empty()) {
+                q->deficit = 0;
+            }
+            q->runnable = false;
+            mRunnable->erase(mRunnable->begin());
+        }
+        *from = q;
+        return job;
+    }
+}
+
+void DnsWorkerPool::finishedLocked(UidQueue *q) {
+    q->running--;
+    if (!q->jobs.empty()) {
+        if (!q->runnable) {
+            q->runnable = true;
+            mRunnable->push_back(q);
+            pthread_cond_signal(&mCond);
+        }
+    } else if (q->running == 0) {
+        removeQueueLocked(mQueues, q);
+        delete q;
+    }
+}
+
+void *DnsWorkerPool::threadStart(void *obj) {
+    DnsWorkerPool *me = reinterpret_cast<DnsWorkerPool *>(obj);
+
+    me->runWorker();
+    pthread_exit(NULL);
+    return NULL;
+}
+
+void DnsWorkerPool::runWorker() {
+    while (1) {
+        UidQueue *q;
+
+        pthread_mutex_lock(&mLock);
+        while (mRunnable->empty()) {
+            pthread_cond_wait(&mCond, &mLock);
+        }
+        DnsJob *job = dequeueLocked(&q);
+        pthread_mutex_unlock(&mLock);
+
+        job->run();
+        delete job;
+
+        pthread_mutex_lock(&mLock);
+        finishedLocked(q);
+        pthread_mutex_unlock(&mLock);
+    }
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DNS_WORKER_POOL_H
+#define _DNS_WORKER_POOL_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <utils/List.h>
+
+/*
+ * A unit of work queued on a DnsWorkerPool. The pool deletes the job
+ * once run() returns.
+ */
+class DnsJob {
+public:
+    virtual ~DnsJob() {}
+    virtual void run() = 0;
+};
+
+typedef android::List<DnsJob *> DnsJobCollection;
+
+/*
+ * Runs DnsJobs on a fixed set of threads. Jobs are queued per requesting
+ * UID and the queues are served by deficit round robin, so an app that
+ * floods dnsproxyd only delays its own lookups. Each UID also has a cap
+ * on jobs running at once and on jobs waiting.
+ */
+class DnsWorkerPool {
+    struct UidQueue {
+        uid_t            uid;
+        DnsJobCollection jobs;
+        int              deficit;   // jobs this queue may still run this round
+        int              running;
+        bool             runnable;  // in mRunnable
+    };
+
+    typedef android::List<UidQueue *> UidQueueCollection;
+
+    pthread_mutex_t     mLock;
+    pthread_cond_t      mCond;
+    UidQueueCollection *mQueues;    // every UID with queued or running jobs
+    UidQueueCollection *mRunnable;  // round robin order of queues to serve
+    int                 mNumQueued;
+    int                 mNumThreads;
+    int                 mMaxQueued;
+    int                 mMaxQueuedPerUid;
+    int                 mMaxRunningPerUid;
+    int                 mQuantum;
+
+public:
+    DnsWorkerPool(int numThreads, int maxQueued);
+    virtual ~DnsWorkerPool();
+
+    /*
+     * Starts the workers. Fails, with errno set, only if none could be
+     * started; the pool then rejects all work.
+     */
+    int start();
+
+    /*
+     * Queues a job for execution on behalf of uid. Fails with EAGAIN if
+     * the backlog, overall or of uid, is already at its limit, or with
+     * ESRCH if there are no workers; the caller keeps ownership of the
+     * job then.
+     */
+    int enqueue(DnsJob *job, uid_t uid);
+
+    int getNumThreads() { return mNumThreads; }
+
+    /*
+     * Number of workers to run: a few per online cpu, since workers
+     * spend nearly all of their time blocked on the network.
+     * "net.dnsproxy.workers" overrides the computed value.
+     */
+    static int defaultNumThreads();
+
+private:
+    static void *threadStart(void *obj);
+    void runWorker();
+
+    UidQueue *findQueueLocked(uid_t uid, bool create);
+    DnsJob *dequeueLocked(UidQueue **from);
+    void finishedLocked(UidQueue *q);
+    void removeQueueLocked(UidQueueCollection *list, UidQueue *q);
+};
+
+#endif
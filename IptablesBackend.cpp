@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define LOG_TAG "IptablesBackend"
+#define DBG 0
+
+#include <cutils/log.h>
+
+#include "IptablesBackend.h"
+#include "IptablesExecBackend.h"
+#ifdef IPTABLES_BACKEND_IPTC
+#include "IptablesIptcBackend.h"
+#endif
+#include "IptablesRestoreBackend.h"
+
+IptablesBackend *IptablesBackend::sInstance = NULL;
+
+static char IPTABLES_PATH[] = "/system/bin/iptables";
+
+IptablesBackend *IptablesBackend::Instance() {
+    if (!sInstance) {
+#if defined(IPTABLES_BACKEND_IPTC)
+        sInstance = new IptablesIptcBackend();
+#elif defined(IPTABLES_BACKEND_EXEC)
+        sInstance = new IptablesExecBackend();
+#else
+        sInstance = new IptablesRestoreBackend();
+#endif
+        if (DBG) {
+            LOGD("Using the %s iptables backend", sInstance->getName());
+        }
+    }
+    return sInstance;
+}
+
+int IptablesBackend::listRules(IptablesBatch::Table table, const char *chain,
+                               IptablesBatch::CommandCollection *rules) {
+    const char *name = IptablesBatch::tableName(table);
+    int out[2];
+
+    if (pipe(out)) {
+        return -1;
+    }
+    // As in the restore backend, vfork() spares copying netd for an exec.
+    pid_t pid = vfork();
+    if (pid < 0) {
+        LOGE("vfork failed (%s)", strerror(errno));
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    }
+    if (!pid) {
+        dup2(out[1], STDOUT_FILENO);
+        close(out[0]);
+        close(out[1]);
+        execl(IPTABLES_PATH, IPTABLES_PATH, "-t", name, "-S", chain, (char *) NULL);
+        _exit(127);
+    }
+    close(out[1]);
+
+    // "-N <chain>" or "-P <chain> <policy>" comes first, then one
+    // "-A <chain> <rule>" line per rule.
+    char prefix[64];
+    char buf[256];
+    bool ok = true;
+    snprintf(prefix, sizeof(prefix), "-A %s ", chain);
+    FILE *fp = fdopen(out[0], "r");
+    if (fp) {
+        while (fgets(buf, sizeof(buf), fp)) {
+            buf[strcspn(buf, "\n")] = '\0';
+            if (strncmp(buf, prefix, strlen(prefix))) {
+                continue;
+            }
+            char *rule = strdup(buf + strlen(prefix));
+            if (!rule) {
+                ok = false;
+                continue;
+            }
+            rules->push_back(rule);
+        }
+        fclose(fp);
+    } else {
+        close(out[0]);
+        ok = false;
+    }
+
+    int status;
+    if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) < 0) {
+        LOGE("waitpid failed (%s)", strerror(errno));
+        return -1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        if (DBG) {
+            LOGD("Unable to list %s in the %s table (status 0x%x)", chain, name, status);
+        }
+        errno = ENOENT;
+        return -1;
+    }
+    if (!ok) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _IPTABLES_BACKEND_H
+#define _IPTABLES_BACKEND_H
+
+#include "IptablesBatch.h"
+
+/*
+ * Programs the kernel's tables on behalf of IptablesBatch. Which backend
+ * netd uses is chosen at build time with NETD_IPTABLES_BACKEND in
+ * Android.mk.
+ */
+class IptablesBackend {
+    static IptablesBackend *sInstance;
+
+public:
+    virtual ~IptablesBackend() {}
+
+    /*
+     * Applies commands[t], the commands of table t in order, for every
+     * table. Returns 0 on success. On failure sets *applied to how many
+     * commands are known to have taken effect, counting tables in enum
+     * order, or to -1 if unknown.
+     */
+    virtual int apply(IptablesBatch::CommandCollection *const *commands, int *applied) = 0;
+
+    /*
+     * Appends to rules the rules of chain in table, in order, each as
+     * the malloc()ed rest of the "-A <chain> ..." command that adds it.
+     * Returns 0 on success. The default runs "iptables -S".
+     */
+    virtual int listRules(IptablesBatch::Table table, const char *chain,
+                          IptablesBatch::CommandCollection *rules);
+
+    virtual const char *getName() const = 0;
+
+    static IptablesBackend *Instance();
+};
+
+#endif
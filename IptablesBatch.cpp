@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LOG_TAG "IptablesBatch"
+#define DBG 0
+
+#include <cutils/log.h>
+
+#include "IptablesBackend.h"
+#include "IptablesBatch.h"
+
+IptablesBatch::IptablesBatch() {
+    for (int i = 0; i < NUM_TABLES; i++) {
+        mCommands[i] = new CommandCollection();
+    }
+}
+
+IptablesBatch::~IptablesBatch() {
+    clear();
+    for (int i = 0; i < NUM_TABLES; i++) {
+        delete mCommands[i];
+    }
+}
+
+const char *IptablesBatch::tableName(Table table) {
+    switch (table) {
+    case FILTER:
+        return "filter";
+    case NAT:
+        return "nat";
+    case MANGLE:
+        return "mangle";
+    default:
+        return NULL;
+    }
+}
+
+int IptablesBatch::add(Table table, const char *fmt, ...) {
+    char *cmd;
+    va_list ap;
+
+    va_start(ap, fmt);
+    int rc = vasprintf(&cmd, fmt, ap);
+    va_end(ap);
+    if (rc < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    mCommands[table]->push_back(cmd);
+    return 0;
+}
+
+int IptablesBatch::addChain(Table table, const char *chain) {
+    // iptables-restore's chain declaration; the exec backend translates.
+    return add(table, ":%s - [0:0]", chain);
+}
+
+bool IptablesBatch::isEmpty() const {
+    for (int i = 0; i < NUM_TABLES; i++) {
+        if (!mCommands[i]->empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void IptablesBatch::clear() {
+    for (int i = 0; i < NUM_TABLES; i++) {
+        CommandCollection::iterator it;
+        for (it = mCommands[i]->begin(); it != mCommands[i]->end(); ++it) {
+            free(*it);
+        }
+        mCommands[i]->clear();
+    }
+}
+
+int IptablesBatch::apply(int *applied) {
+    int dummy;
+
+    if (!applied) {
+        applied = &dummy;
+    }
+    *applied = 0;
+    if (isEmpty()) {
+        return 0;
+    }
+    return IptablesBackend::Instance()->apply(mCommands, applied);
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _IPTABLES_BATCH_H
+#define _IPTABLES_BATCH_H
+
+#include <utils/List.h>
+
+/*
+ * A set of iptables commands applied together, by default with a single
+ * "iptables-restore --noflush" instead of one iptables process per
+ * command. The commands of each table are then committed atomically.
+ */
+class IptablesBatch {
+public:
+    enum Table { FILTER, NAT, MANGLE, NUM_TABLES };
+
+    typedef android::List<char *> CommandCollection;
+
+private:
+    CommandCollection *mCommands[NUM_TABLES];
+
+public:
+    IptablesBatch();
+    virtual ~IptablesBatch();
+
+    /*
+     * Appends a command in iptables syntax without the table, e.g.
+     * "-A FORWARD -i wlan0 -o rmnet0 -j ACCEPT". Returns -1 if out of
+     * memory.
+     */
+    int add(Table table, const char *fmt, ...)
+        __attribute__((format(printf, 3, 4)));
+
+    /*
+     * Creates a user chain, or flushes it if it already exists. Counts
+     * as one command.
+     */
+    int addChain(Table table, const char *chain);
+
+    bool isEmpty() const;
+    void clear();
+
+    /*
+     * Applies the batch through the IptablesBackend picked at build time;
+     * the restore and iptc backends commit each table atomically. Returns 0 on success. On
+     * failure, *applied, if given, is set to how many commands are known
+     * to have taken effect, counting filter, then nat, then mangle
+     * commands in the order they were added; -1 if unknown.
+     */
+    int apply(int *applied = NULL);
+
+    static const char *tableName(Table table);
+};
+
+#endif
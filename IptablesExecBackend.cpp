@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LOG_TAG "IptablesExecBackend"
+#define DBG 0
+
+#include <cutils/log.h>
+
+#include "IptablesExecBackend.h"
+
+extern "C" int logwrap(int argc, const char **argv, int background);
+
+static char IPTABLES_PATH[] = "/system/bin/iptables";
+
+int IptablesExecBackend::runIptablesCmd(const char *cmd) {
+    char buffer[255];
+
+    strncpy(buffer, cmd, sizeof(buffer)-1);
+    buffer[sizeof(buffer)-1] = '\0';
+
+    const char *args[20];
+    char *next = buffer;
+    char *tmp;
+
+    args[0] = IPTABLES_PATH;
+    args[1] = "--verbose";
+    int i = 2;
+
+    while ((tmp = strsep(&next, " "))) {
+        args[i++] = tmp;
+        // Room for the MSS clamp rule, the longest we run.
+        if (i == 20) {
+            LOGE("iptables argument overflow");
+            errno = E2BIG;
+            return -1;
+        }
+    }
+    args[i] = NULL;
+
+    return logwrap(i, args, 0);
+}
+
+int IptablesExecBackend::apply(IptablesBatch::CommandCollection *const *commands,
+                               int *applied) {
+    char cmd[255];
+
+    for (int i = 0; i < IptablesBatch::NUM_TABLES; i++) {
+        IptablesBatch::CommandCollection::iterator it;
+        for (it = commands[i]->begin(); it != commands[i]->end(); ++it) {
+            const char *table = IptablesBatch::tableName((IptablesBatch::Table) i);
+            if ((*it)[0] == ':') {
+                // A chain declaration: create the chain, which fails if
+                // it exists, then flush it.
+                char chain[64];
+                sscanf(*it + 1, "%63s", chain);
+                snprintf(cmd, sizeof(cmd), "-t %s -N %s", table, chain);
+                runIptablesCmd(cmd);
+                snprintf(cmd, sizeof(cmd), "-t %s -F %s", table, chain);
+            } else {
+                snprintf(cmd, sizeof(cmd), "-t %s %s", table, *it);
+            }
+            if (runIptablesCmd(cmd)) {
+                return -1;
+            }
+            (*applied)++;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _IPTABLES_EXEC_BACKEND_H
+#define _IPTABLES_EXEC_BACKEND_H
+
+#include "IptablesBackend.h"
+
+/*
+ * Runs /system/bin/iptables once per command. Works everywhere but is
+ * slow and not atomic: a failure leaves the commands before it applied.
+ */
+class IptablesExecBackend : public IptablesBackend {
+public:
+    virtual int apply(IptablesBatch::CommandCollection *const *commands, int *applied);
+    virtual const char *getName() const { return "exec"; }
+
+    /* Runs one iptables command, e.g. "-t nat -F". Returns 0 on success. */
+    static int runIptablesCmd(const char *cmd);
+};
+
+#endif
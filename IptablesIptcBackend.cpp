@@ -0,0 +1,567 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+#define LOG_TAG "IptablesIptcBackend"
+#define DBG 0
+
+#include <cutils/log.h>
+#include <libiptc/libiptc.h>
+
+#include "IptablesIptcBackend.h"
+
+// Match and target data, laid out as the kernel's xt_state_info,
+// xt_tcpmss_info and nf_nat_multi_range_compat.
+struct StateInfo {
+    unsigned int statemask;
+};
+
+struct TcpmssInfo {
+    uint16_t mss;
+};
+
+struct MasqueradeInfo {
+    uint32_t rangesize;
+    uint32_t flags;
+    uint32_t minIp;
+    uint32_t maxIp;
+    uint16_t minProto;
+    uint16_t maxProto;
+};
+
+static const uint16_t TCPMSS_CLAMP_PMTU = 0xffff;
+
+struct NamedBits {
+    const char   *name;
+    unsigned int bits;
+};
+
+// XT_STATE_BIT() of each conntrack state.
+static const NamedBits CT_STATES[] = {
+    { "INVALID",     1 << 0 },
+    { "ESTABLISHED", 1 << 1 },
+    { "RELATED",     1 << 2 },
+    { "NEW",         1 << 3 },
+};
+
+static const NamedBits TCP_FLAGS[] = {
+    { "FIN",  0x01 },
+    { "SYN",  0x02 },
+    { "RST",  0x04 },
+    { "PSH",  0x08 },
+    { "ACK",  0x10 },
+    { "URG",  0x20 },
+    { "ALL",  0x3f },
+    { "NONE", 0x00 },
+};
+
+// One command in IptablesBatch syntax, taken apart.
+struct Command {
+    char         op;            // ':', 'P', 'A', 'I' or 'D'
+    const char   *chain;
+    const char   *target;
+    const char   *inIface;
+    const char   *outIface;
+    uint16_t     proto;
+    unsigned int stateMask;     // 0 for no state match
+    bool         tcpFlags;
+    unsigned int tcpFlagMask;
+    unsigned int tcpFlagCmp;
+    bool         clampMss;
+};
+
+// Parses a comma separated list of names, e.g. "ESTABLISHED,RELATED".
+static bool parseBits(const char *list, const NamedBits *names, int numNames,
+                      unsigned int *bits) {
+    char buf[64];
+    char *next = buf;
+    char *tok;
+
+    strncpy(buf, list, sizeof(buf)-1);
+    buf[sizeof(buf)-1] = '\0';
+    *bits = 0;
+    while ((tok = strsep(&next, ","))) {
+        int i;
+        for (i = 0; i < numNames; i++) {
+            if (!strcmp(tok, names[i].name)) {
+                break;
+            }
+        }
+        if (i == numNames) {
+            return false;
+        }
+        *bits |= names[i].bits;
+    }
+    return true;
+}
+
+/*
+ * Takes apart buf, which is modified, into cmd. Only the options netd
+ * uses are known. Returns false if buf holds anything else.
+ */
+static bool parseCommand(char *buf, Command *cmd) {
+    char *args[20];
+    int argc = 0;
+    char *next = buf;
+    char *tok;
+
+    memset(cmd, 0, sizeof(*cmd));
+    while ((tok = strsep(&next, " "))) {
+        if (!*tok) {
+            continue;
+        }
+        if (argc == 20) {
+            return false;
+        }
+        args[argc++] = tok;
+    }
+    if (argc < 1) {
+        return false;
+    }
+
+    if (args[0][0] == ':') {
+        // ":<chain> <policy> [<packets>:<bytes>]"; user chains have no
+        // policy and we don't keep counters.
+        cmd->op = ':';
+        cmd->chain = args[0] + 1;
+        return true;
+    }
+    if (argc < 2 || args[0][0] != '-' || !args[0][1] || args[0][2] ||
+        !strchr("PAID", args[0][1])) {
+        return false;
+    }
+    cmd->op = args[0][1];
+    cmd->chain = args[1];
+    if (cmd->op == 'P') {
+        cmd->target = argc == 3 ? args[2] : NULL;
+        return cmd->target != NULL;
+    }
+
+    for (int i = 2; i < argc; i++) {
+        const char *opt = args[i];
+        if (!strcmp(opt, "--clamp-mss-to-pmtu")) {
+            cmd->clampMss = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            return false;
+        }
+        const char *val = args[++i];
+        if (!strcmp(opt, "-i") || !strcmp(opt, "-o")) {
+            if (strlen(val) >= IFNAMSIZ) {
+                return false;
+            }
+            if (opt[1] == 'i') {
+                cmd->inIface = val;
+            } else {
+                cmd->outIface = val;
+            }
+        } else if (!strcmp(opt, "-p")) {
+            if (!strcmp(val, "tcp")) {
+                cmd->proto = IPPROTO_TCP;
+            } else if (!strcmp(val, "udp")) {
+                cmd->proto = IPPROTO_UDP;
+            } else {
+                return false;
+            }
+        } else if (!strcmp(opt, "-m")) {
+            // The match itself is added by its options below.
+            if (strcmp(val, "state") && strcmp(val, "tcp")) {
+                return false;
+            }
+        } else if (!strcmp(opt, "--state")) {
+            if (!parseBits(val, CT_STATES, sizeof(CT_STATES) / sizeof(CT_STATES[0]),
+                           &cmd->stateMask) || !cmd->stateMask) {
+                return false;
+            }
+        } else if (!strcmp(opt, "--tcp-flags")) {
+            if (i + 1 == argc ||
+                !parseBits(val, TCP_FLAGS, sizeof(TCP_FLAGS) / sizeof(TCP_FLAGS[0]),
+                           &cmd->tcpFlagMask) ||
+                !parseBits(args[++i], TCP_FLAGS, sizeof(TCP_FLAGS) / sizeof(TCP_FLAGS[0]),
+                           &cmd->tcpFlagCmp)) {
+                return false;
+            }
+            cmd->tcpFlags = true;
+        } else if (!strcmp(opt, "-j")) {
+            cmd->target = val;
+        } else {
+            return false;
+        }
+    }
+
+    if (!cmd->target || (cmd->tcpFlags && cmd->proto != IPPROTO_TCP)) {
+        return false;
+    }
+    // TCPMSS without an MSS to set is an error in iptables too.
+    return cmd->clampMss == !strcmp(cmd->target, "TCPMSS");
+}
+
+static size_t matchSize(size_t dataLen) {
+    return XT_ALIGN(sizeof(struct ipt_entry_match)) + XT_ALIGN(dataLen);
+}
+
+static unsigned char *addMatch(unsigned char *p, const char *name, const void *data,
+                               size_t dataLen) {
+    struct ipt_entry_match *m = (struct ipt_entry_match *) p;
+
+    m->u.match_size = matchSize(dataLen);
+    strncpy(m->u.user.name, name, sizeof(m->u.user.name) - 1);
+    memcpy(m->data, data, dataLen);
+    return p + m->u.match_size;
+}
+
+static void setIface(const char *name, char *iface, unsigned char *mask) {
+    strncpy(iface, name, IFNAMSIZ - 1);
+    // Including the terminator, so that "wlan0" doesn't match "wlan01".
+    memset(mask, 0xff, strlen(name) + 1);
+}
+
+// Builds the rule of an -A, -I or -D command. Returns NULL if out of memory.
+static struct ipt_entry *buildEntry(const Command *cmd) {
+    struct ipt_tcp tcp;
+    StateInfo state;
+    TcpmssInfo tcpmss;
+    MasqueradeInfo masq;
+    int verdict = 0;
+    const void *targetData;
+    size_t targetLen;
+
+    size_t size = XT_ALIGN(sizeof(struct ipt_entry));
+    if (cmd->tcpFlags) {
+        size += matchSize(sizeof(tcp));
+    }
+    if (cmd->stateMask) {
+        size += matchSize(sizeof(state));
+    }
+    size_t targetOffset = size;
+
+    if (!strcmp(cmd->target, "MASQUERADE")) {
+        memset(&masq, 0, sizeof(masq));
+        masq.rangesize = 1;
+        targetData = &masq;
+        targetLen = sizeof(masq);
+    } else if (!strcmp(cmd->target, "TCPMSS")) {
+        tcpmss.mss = TCPMSS_CLAMP_PMTU;
+        targetData = &tcpmss;
+        targetLen = sizeof(tcpmss);
+    } else {
+        // A verdict or a jump to a user chain: libiptc looks the name up
+        // and fills in the verdict when it commits.
+        targetData = &verdict;
+        targetLen = sizeof(verdict);
+    }
+    size += XT_ALIGN(sizeof(struct ipt_entry_target)) + XT_ALIGN(targetLen);
+
+    struct ipt_entry *e = (struct ipt_entry *) calloc(1, size);
+    if (!e) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    e->target_offset = targetOffset;
+    e->next_offset = size;
+    e->ip.proto = cmd->proto;
+    if (cmd->inIface) {
+        setIface(cmd->inIface, e->ip.iniface, e->ip.iniface_mask);
+    }
+    if (cmd->outIface) {
+        setIface(cmd->outIface, e->ip.outiface, e->ip.outiface_mask);
+    }
+
+    unsigned char *p = (unsigned char *) e + XT_ALIGN(sizeof(struct ipt_entry));
+    if (cmd->tcpFlags) {
+        memset(&tcp, 0, sizeof(tcp));
+        tcp.spts[1] = 0xffff;
+        tcp.dpts[1] = 0xffff;
+        tcp.flg_mask = cmd->tcpFlagMask;
+        tcp.flg_cmp = cmd->tcpFlagCmp;
+        p = addMatch(p, "tcp", &tcp, sizeof(tcp));
+    }
+    if (cmd->stateMask) {
+        state.statemask = cmd->stateMask;
+        p = addMatch(p, "state", &state, sizeof(state));
+    }
+
+    struct ipt_entry_target *t = (struct ipt_entry_target *) p;
+    t->u.target_size = size - targetOffset;
+    strncpy(t->u.user.name, cmd->target, sizeof(t->u.user.name) - 1);
+    memcpy(t->data, targetData, targetLen);
+    return e;
+}
+
+static int applyCommand(const char *command, iptc_handle_t *handle) {
+    char buf[255];
+    Command cmd;
+    int ok;
+
+    strncpy(buf, command, sizeof(buf)-1);
+    buf[sizeof(buf)-1] = '\0';
+    if (!parseCommand(buf, &cmd)) {
+        LOGE("Unsupported command \"%s\"", command);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (cmd.op == ':') {
+        // Create the chain, or empty it if it's there already.
+        if (iptc_is_chain(cmd.chain, *handle)) {
+            ok = iptc_flush_entries(cmd.chain, handle);
+        } else {
+            ok = iptc_create_chain(cmd.chain, handle);
+        }
+    } else if (cmd.op == 'P') {
+        ok = iptc_set_policy(cmd.chain, cmd.target, NULL, handle);
+    } else {
+        struct ipt_entry *e = buildEntry(&cmd);
+        if (!e) {
+            return -1;
+        }
+        if (cmd.op == 'A') {
+            ok = iptc_append_entry(cmd.chain, e, handle);
+        } else if (cmd.op == 'I') {
+            ok = iptc_insert_entry(cmd.chain, e, 0, handle);
+        } else {
+            // Every byte of our matches and targets is significant.
+            unsigned char *mask = (unsigned char *) malloc(e->next_offset);
+            if (!mask) {
+                free(e);
+                errno = ENOMEM;
+                return -1;
+            }
+            memset(mask, 0xff, e->next_offset);
+            ok = iptc_delete_entry(cmd.chain, e, mask, handle);
+            free(mask);
+        }
+        free(e);
+    }
+
+    if (!ok) {
+        int savedErrno = errno;
+        LOGE("%s: %s", command, iptc_strerror(savedErrno));
+        errno = savedErrno;
+        return -1;
+    }
+    return 0;
+}
+
+// Applies commands to a copy of table and commits it in one go.
+static int applyTable(IptablesBatch::Table table, IptablesBatch::CommandCollection *commands) {
+    const char *name = IptablesBatch::tableName(table);
+
+    iptc_handle_t handle = iptc_init(name);
+    if (!handle) {
+        int savedErrno = errno;
+        LOGE("Unable to read the %s table (%s)", name, iptc_strerror(savedErrno));
+        errno = savedErrno;
+        return -1;
+    }
+
+    IptablesBatch::CommandCollection::iterator it;
+    for (it = commands->begin(); it != commands->end(); ++it) {
+        if (applyCommand(*it, &handle)) {
+            int savedErrno = errno;
+            iptc_free(&handle);
+            errno = savedErrno;
+            return -1;
+        }
+    }
+
+    int ok = iptc_commit(&handle);
+    int savedErrno = errno;
+    // Older libiptc frees the handle on commit and clears it; newer ones
+    // leave that to us.
+    if (handle) {
+        iptc_free(&handle);
+    }
+    if (!ok) {
+        LOGE("Unable to commit the %s table (%s)", name, iptc_strerror(savedErrno));
+        errno = savedErrno;
+        return -1;
+    }
+    return 0;
+}
+
+int IptablesIptcBackend::apply(IptablesBatch::CommandCollection *const *commands,
+                               int *applied) {
+    for (int i = 0; i < IptablesBatch::NUM_TABLES; i++) {
+        if (commands[i]->empty()) {
+            continue;
+        }
+        // A table that fails to commit is left as it was, so *applied
+        // is exact.
+        if (applyTable((IptablesBatch::Table) i, commands[i])) {
+            return -1;
+        }
+        *applied += commands[i]->size();
+    }
+    return 0;
+}
+
+// Writes the names of bits to buf, comma separated, in the order of names.
+static void formatBits(unsigned int bits, const NamedBits *names, int numNames,
+                       char *buf, size_t len) {
+    size_t n = 0;
+
+    buf[0] = '\0';
+    for (int i = 0; i < numNames && n < len; i++) {
+        // Only the single flags; ALL and NONE are for parsing.
+        if (!names[i].bits || (names[i].bits & (names[i].bits - 1)) ||
+            !(bits & names[i].bits)) {
+            continue;
+        }
+        n += snprintf(buf + n, len - n, "%s%s", n ? "," : "", names[i].name);
+    }
+    if (!n) {
+        snprintf(buf, len, "NONE");
+    }
+}
+
+/*
+ * Writes e back in the syntax parseCommand() takes, without the "-A
+ * <chain>". Returns false for rules using anything netd doesn't, or too
+ * long for len.
+ */
+static bool formatEntry(const struct ipt_entry *e, const char *target, char *buf,
+                        size_t len) {
+    char bits[2][64];
+    size_t n = 0;
+
+    if (e->ip.src.s_addr || e->ip.smsk.s_addr || e->ip.dst.s_addr || e->ip.dmsk.s_addr ||
+        e->ip.flags || e->ip.invflags) {
+        return false;
+    }
+    buf[0] = '\0';
+    if (e->ip.iniface[0]) {
+        n += snprintf(buf + n, len - n, " -i %.*s", IFNAMSIZ, e->ip.iniface);
+    }
+    if (e->ip.outiface[0] && n < len) {
+        n += snprintf(buf + n, len - n, " -o %.*s", IFNAMSIZ, e->ip.outiface);
+    }
+    if ((e->ip.proto == IPPROTO_TCP || e->ip.proto == IPPROTO_UDP) && n < len) {
+        n += snprintf(buf + n, len - n, " -p %s", e->ip.proto == IPPROTO_TCP ? "tcp" : "udp");
+    } else if (e->ip.proto) {
+        return false;
+    }
+
+    const unsigned char *p = (const unsigned char *) e + XT_ALIGN(sizeof(struct ipt_entry));
+    const unsigned char *end = (const unsigned char *) e + e->target_offset;
+    while (p < end && n < len) {
+        const struct ipt_entry_match *m = (const struct ipt_entry_match *) p;
+        if (m->u.match_size < sizeof(*m)) {
+            return false;
+        }
+        if (!strcmp(m->u.user.name, "tcp")) {
+            const struct ipt_tcp *tcp = (const struct ipt_tcp *) m->data;
+            if (tcp->spts[0] || tcp->spts[1] != 0xffff || tcp->dpts[0] ||
+                tcp->dpts[1] != 0xffff || tcp->option || tcp->invflags) {
+                return false;
+            }
+            formatBits(tcp->flg_mask, TCP_FLAGS, sizeof(TCP_FLAGS) / sizeof(TCP_FLAGS[0]),
+                       bits[0], sizeof(bits[0]));
+            formatBits(tcp->flg_cmp, TCP_FLAGS, sizeof(TCP_FLAGS) / sizeof(TCP_FLAGS[0]),
+                       bits[1], sizeof(bits[1]));
+            n += snprintf(buf + n, len - n, " --tcp-flags %s %s", bits[0], bits[1]);
+        } else if (!strcmp(m->u.user.name, "state")) {
+            const StateInfo *state = (const StateInfo *) m->data;
+            unsigned int known = 0;
+            for (size_t i = 0; i < sizeof(CT_STATES) / sizeof(CT_STATES[0]); i++) {
+                known |= CT_STATES[i].bits;
+            }
+            if (!state->statemask || (state->statemask & ~known)) {
+                return false;
+            }
+            formatBits(state->statemask, CT_STATES, sizeof(CT_STATES) / sizeof(CT_STATES[0]),
+                       bits[0], sizeof(bits[0]));
+            n += snprintf(buf + n, len - n, " -m state --state %s", bits[0]);
+        } else {
+            return false;
+        }
+        p += m->u.match_size;
+    }
+
+    const struct ipt_entry_target *t =
+            (const struct ipt_entry_target *) ((const unsigned char *) e + e->target_offset);
+    const char *extra = "";
+    if (!strcmp(target, "TCPMSS")) {
+        if (((const TcpmssInfo *) t->data)->mss != TCPMSS_CLAMP_PMTU) {
+            return false;
+        }
+        extra = " --clamp-mss-to-pmtu";
+    } else if (!strcmp(target, "MASQUERADE")) {
+        const MasqueradeInfo *masq = (const MasqueradeInfo *) t->data;
+        if (masq->rangesize != 1 || masq->flags || masq->minProto || masq->maxProto) {
+            return false;
+        }
+    }
+    if (n < len) {
+        n += snprintf(buf + n, len - n, " -j %s%s", target, extra);
+    }
+    if (n >= len) {
+        return false;
+    }
+    // Drop the leading space.
+    memmove(buf, buf + 1, n);
+    return true;
+}
+
+int IptablesIptcBackend::listRules(IptablesBatch::Table table, const char *chain,
+                                   IptablesBatch::CommandCollection *rules) {
+    const char *name = IptablesBatch::tableName(table);
+
+    iptc_handle_t handle = iptc_init(name);
+    if (!handle) {
+        int savedErrno = errno;
+        LOGE("Unable to read the %s table (%s)", name, iptc_strerror(savedErrno));
+        errno = savedErrno;
+        return -1;
+    }
+    if (!iptc_is_chain(chain, handle)) {
+        iptc_free(&handle);
+        errno = ENOENT;
+        return -1;
+    }
+
+    int rc = 0;
+    char buf[255];
+    const struct ipt_entry *e;
+    for (e = iptc_first_rule(chain, &handle); e; e = iptc_next_rule(e, &handle)) {
+        const char *target = iptc_get_target(e, &handle);
+        if (!target || !formatEntry(e, target, buf, sizeof(buf))) {
+            LOGE("Unsupported rule in %s", chain);
+            errno = EINVAL;
+            rc = -1;
+            break;
+        }
+        char *rule = strdup(buf);
+        if (!rule) {
+            errno = ENOMEM;
+            rc = -1;
+            break;
+        }
+        rules->push_back(rule);
+    }
+    int savedErrno = errno;
+    iptc_free(&handle);
+    errno = savedErrno;
+    return rc;
+}
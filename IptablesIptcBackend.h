@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _IPTABLES_IPTC_BACKEND_H
+#define _IPTABLES_IPTC_BACKEND_H
+
+#include "IptablesBackend.h"
+
+/*
+ * Programs the tables from inside netd with libiptc: each table of a
+ * batch is read, edited in memory and committed back with one
+ * setsockopt(), so no process is ever started. Only the rule syntax netd
+ * itself generates is understood, both ways; anything else fails with
+ * EINVAL.
+ */
+class IptablesIptcBackend : public IptablesBackend {
+public:
+    virtual int apply(IptablesBatch::CommandCollection *const *commands, int *applied);
+    virtual int listRules(IptablesBatch::Table table, const char *chain,
+                          IptablesBatch::CommandCollection *rules);
+    virtual const char *getName() const { return "iptc"; }
+};
+
+#endif
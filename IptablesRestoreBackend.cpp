@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define LOG_TAG "IptablesRestoreBackend"
+#define DBG 0
+
+#include <cutils/log.h>
+
+#include "IptablesRestoreBackend.h"
+
+static char IPTABLES_RESTORE_PATH[] = "/system/bin/iptables-restore";
+
+// Writes all of buf to fd. Returns false on failure.
+static bool writeAll(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+int IptablesRestoreBackend::apply(IptablesBatch::CommandCollection *const *commands,
+                                  int *applied) {
+    if (access(IPTABLES_RESTORE_PATH, X_OK)) {
+        return mFallback.apply(commands, applied);
+    }
+
+    // Build the whole input first so that a failure to allocate doesn't
+    // leave a half written transaction. Remember where each table is
+    // committed to tell from an error which tables made it.
+    int commitLine[IptablesBatch::NUM_TABLES];
+    int numCommands[IptablesBatch::NUM_TABLES];
+    int lines = 0;
+    size_t len = 0;
+    for (int i = 0; i < IptablesBatch::NUM_TABLES; i++) {
+        numCommands[i] = 0;
+        commitLine[i] = 0;
+        if (commands[i]->empty()) {
+            continue;
+        }
+        const char *table = IptablesBatch::tableName((IptablesBatch::Table) i);
+        len += strlen(table) + 2 + strlen("COMMIT\n");
+        IptablesBatch::CommandCollection::iterator it;
+        for (it = commands[i]->begin(); it != commands[i]->end(); ++it) {
+            len += strlen(*it) + 1;
+            numCommands[i]++;
+        }
+        lines += numCommands[i] + 2;
+        commitLine[i] = lines;
+    }
+    char *input = (char *) malloc(len + 1);
+    if (!input) {
+        errno = ENOMEM;
+        return -1;
+    }
+    char *p = input;
+    for (int i = 0; i < IptablesBatch::NUM_TABLES; i++) {
+        if (commands[i]->empty()) {
+            continue;
+        }
+        p += sprintf(p, "*%s\n", IptablesBatch::tableName((IptablesBatch::Table) i));
+        IptablesBatch::CommandCollection::iterator it;
+        for (it = commands[i]->begin(); it != commands[i]->end(); ++it) {
+            p += sprintf(p, "%s\n", *it);
+        }
+        p += sprintf(p, "COMMIT\n");
+    }
+    if (DBG) {
+        LOGD("iptables-restore input:\n%s", input);
+    }
+
+    // stdin is a socket so that writing to a dead child fails with EPIPE
+    // rather than raising SIGPIPE in netd.
+    int in[2];
+    int out[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, in)) {
+        free(input);
+        return -1;
+    }
+    if (pipe(out)) {
+        close(in[0]);
+        close(in[1]);
+        free(input);
+        return -1;
+    }
+
+    // vfork() rather than fork(): the child only rearranges its fds and
+    // execs, and copying netd's page tables for that is wasted work.
+    pid_t pid = vfork();
+    if (pid < 0) {
+        LOGE("vfork failed (%s)", strerror(errno));
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        free(input);
+        return -1;
+    }
+    if (!pid) {
+        dup2(in[1], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(out[1], STDERR_FILENO);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        execl(IPTABLES_RESTORE_PATH, IPTABLES_RESTORE_PATH, "--noflush", (char *) NULL);
+        _exit(127);
+    }
+
+    close(in[1]);
+    close(out[1]);
+    bool written = writeAll(in[0], input, len);
+    shutdown(in[0], SHUT_WR);
+    free(input);
+
+    // iptables-restore only talks when something is wrong, and then
+    // names the line that failed.
+    char buf[256];
+    int failedLine = 0;
+    FILE *fp = fdopen(out[0], "r");
+    if (fp) {
+        while (fgets(buf, sizeof(buf), fp)) {
+            buf[strcspn(buf, "\n")] = '\0';
+            LOGE("iptables-restore: %s", buf);
+            const char *line = strstr(buf, "line ");
+            if (line && !failedLine) {
+                sscanf(line, "line %d failed", &failedLine);
+            }
+        }
+        fclose(fp);
+    } else {
+        close(out[0]);
+    }
+    close(in[0]);
+
+    int status;
+    if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) < 0) {
+        LOGE("waitpid failed (%s)", strerror(errno));
+        *applied = -1;
+        return -1;
+    }
+    if (!written || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        LOGE("iptables-restore failed (status 0x%x)", status);
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+            // Never ran.
+            *applied = 0;
+        } else if (failedLine > 0) {
+            for (int i = 0; i < IptablesBatch::NUM_TABLES; i++) {
+                if (commitLine[i] && commitLine[i] < failedLine) {
+                    *applied += numCommands[i];
+                }
+            }
+        } else {
+            *applied = -1;
+        }
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
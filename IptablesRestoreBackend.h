@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _IPTABLES_RESTORE_BACKEND_H
+#define _IPTABLES_RESTORE_BACKEND_H
+
+#include "IptablesExecBackend.h"
+
+/*
+ * Feeds a whole batch to a single "iptables-restore --noflush", which
+ * commits each table atomically. The child is started with vfork() so
+ * that netd's address space is never copied. Devices without
+ * iptables-restore fall back to the exec backend.
+ */
+class IptablesRestoreBackend : public IptablesBackend {
+    IptablesExecBackend mFallback;
+
+public:
+    virtual int apply(IptablesBatch::CommandCollection *const *commands, int *applied);
+    virtual const char *getName() const { return "restore"; }
+};
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "IptablesState"
+#define DBG 0
+
+#include <cutils/log.h>
+
+#include "IptablesState.h"
+
+IptablesState::IptablesState() {
+    mRules = new RuleCollection();
+}
+
+IptablesState::~IptablesState() {
+    clear();
+    delete mRules;
+}
+
+IptablesState::Rule *IptablesState::find(IptablesBatch::Table table, const char *chain,
+                                         const char *spec) const {
+    RuleCollection::iterator it;
+    for (it = mRules->begin(); it != mRules->end(); ++it) {
+        if ((*it)->table == table && !strcmp((*it)->chain, chain) &&
+            !strcmp((*it)->spec, spec)) {
+            return *it;
+        }
+    }
+    return NULL;
+}
+
+int IptablesState::addRule(IptablesBatch::Table table, const char *chain, const char *spec) {
+    if (find(table, chain, spec)) {
+        return 0;
+    }
+    Rule *rule = new Rule;
+    rule->table = table;
+    rule->chain = strdup(chain);
+    rule->spec = strdup(spec);
+    if (!rule->chain || !rule->spec) {
+        free(rule->chain);
+        free(rule->spec);
+        delete rule;
+        errno = ENOMEM;
+        return -1;
+    }
+    mRules->push_back(rule);
+    return 0;
+}
+
+int IptablesState::add(IptablesBatch::Table table, const char *chain, const char *fmt, ...) {
+    char spec[255];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(spec, sizeof(spec), fmt, ap);
+    va_end(ap);
+    if (n < 0 || n >= (int) sizeof(spec)) {
+        errno = E2BIG;
+        return -1;
+    }
+    return addRule(table, chain, spec);
+}
+
+bool IptablesState::contains(IptablesBatch::Table table, const char *chain,
+                             const char *spec) const {
+    return find(table, chain, spec) != NULL;
+}
+
+bool IptablesState::isEmpty() const {
+    return mRules->empty();
+}
+
+void IptablesState::clearTable(IptablesBatch::Table table) {
+    RuleCollection::iterator it = mRules->begin();
+    while (it != mRules->end()) {
+        Rule *rule = *it;
+        if (rule->table != table) {
+            ++it;
+            continue;
+        }
+        it = mRules->erase(it);
+        free(rule->chain);
+        free(rule->spec);
+        delete rule;
+    }
+}
+
+void IptablesState::clear() {
+    for (int t = 0; t < IptablesBatch::NUM_TABLES; t++) {
+        clearTable((IptablesBatch::Table) t);
+    }
+}
+
+int IptablesState::copyTable(IptablesBatch::Table table, const IptablesState &other) {
+    clearTable(table);
+    RuleCollection::iterator it;
+    for (it = other.mRules->begin(); it != other.mRules->end(); ++it) {
+        if ((*it)->table == table && addRule(table, (*it)->chain, (*it)->spec)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int IptablesState::diff(IptablesBatch::Table table, const IptablesState &from,
+                        IptablesTransaction *trans) const {
+    RuleCollection::iterator it;
+
+    // Deletes go first so that a chain never holds both the old and the
+    // new rules at once.
+    for (it = from.mRules->begin(); it != from.mRules->end(); ++it) {
+        Rule *rule = *it;
+        if (rule->table == table && !find(table, rule->chain, rule->spec) &&
+            trans->remove(table, rule->chain, "%s", rule->spec)) {
+            return -1;
+        }
+    }
+    for (it = mRules->begin(); it != mRules->end(); ++it) {
+        Rule *rule = *it;
+        if (rule->table == table && !from.find(table, rule->chain, rule->spec) &&
+            trans->append(table, rule->chain, "%s", rule->spec)) {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _IPTABLES_STATE_H
+#define _IPTABLES_STATE_H
+
+#include <utils/List.h>
+
+#include "IptablesBatch.h"
+#include "IptablesTransaction.h"
+
+/*
+ * A set of rules in the chains netd owns, e.g. the rules netd wants
+ * installed or the ones it last installed. Rules within a chain keep the
+ * order they were added in and appear at most once.
+ */
+class IptablesState {
+    struct Rule {
+        IptablesBatch::Table table;
+        char                *chain;
+        char                *spec;
+    };
+
+    typedef android::List<Rule *> RuleCollection;
+
+    RuleCollection *mRules;
+
+public:
+    IptablesState();
+    virtual ~IptablesState();
+
+    /*
+     * Adds "<spec>" to chain, e.g. add(FILTER, "FORWARD", "-i %s -j
+     * ACCEPT", iface). Adding a rule that is already there does nothing.
+     * Returns -1 if out of memory or with E2BIG if the rule is too long.
+     */
+    int add(IptablesBatch::Table table, const char *chain, const char *fmt, ...)
+        __attribute__((format(printf, 4, 5)));
+
+    bool contains(IptablesBatch::Table table, const char *chain, const char *spec) const;
+    bool isEmpty() const;
+    void clear();
+    void clearTable(IptablesBatch::Table table);
+
+    /* Makes the rules of table the same as other's. */
+    int copyTable(IptablesBatch::Table table, const IptablesState &other);
+
+    /*
+     * Adds to trans the deletes, then the appends, that turn the rules of
+     * table in from into the ones in this state.
+     */
+    int diff(IptablesBatch::Table table, const IptablesState &from,
+             IptablesTransaction *trans) const;
+
+private:
+    Rule *find(IptablesBatch::Table table, const char *chain, const char *spec) const;
+    int addRule(IptablesBatch::Table table, const char *chain, const char *spec);
+};
+
+#endif
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "IptablesTransaction"
+#define DBG 0
+
+#include <cutils/log.h>
+
+#include "IptablesTransaction.h"
+
+IptablesTransaction::IptablesTransaction() {
+    mSteps = new StepCollection();
+}
+
+IptablesTransaction::~IptablesTransaction() {
+    StepCollection::iterator it;
+    for (it = mSteps->begin(); it != mSteps->end(); ++it) {
+        free((*it)->command);
+        free((*it)->inverse);
+        delete *it;
+    }
+    delete mSteps;
+}
+
+int IptablesTransaction::add(IptablesBatch::Table table, const char *command,
+                             const char *inverse) {
+    Step *step = new Step;
+    step->table = table;
+    step->command = strdup(command);
+    step->inverse = strdup(inverse);
+    if (!step->command || !step->inverse) {
+        free(step->command);
+        free(step->inverse);
+        delete step;
+        errno = ENOMEM;
+        return -1;
+    }
+    mSteps->push_back(step);
+    return 0;
+}
+
+int IptablesTransaction::addFormatted(IptablesBatch::Table table, const char *chain,
+                                      bool append, const char *fmt, va_list ap) {
+    char rule[255];
+    char command[255];
+    char inverse[255];
+
+    // A truncated rule would be a different rule, so never queue one.
+    int n = vsnprintf(rule, sizeof(rule), fmt, ap);
+    if (n < 0 || n >= (int) sizeof(rule)) {
+        errno = E2BIG;
+        return -1;
+    }
+    n = snprintf(command, sizeof(command), "%s %s %s", append ? "-A" : "-D", chain, rule);
+    if (n < 0 || n >= (int) sizeof(command)) {
+        errno = E2BIG;
+        return -1;
+    }
+    // Same length as command.
+    snprintf(inverse, sizeof(inverse), "%s %s %s", append ? "-D" : "-A", chain, rule);
+    return add(table, command, inverse);
+}
+
+int IptablesTransaction::append(IptablesBatch::Table table, const char *chain,
+                                const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    int rc = addFormatted(table, chain, true, fmt, ap);
+    va_end(ap);
+    return rc;
+}
+
+int IptablesTransaction::remove(IptablesBatch::Table table, const char *chain,
+                                const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    int rc = addFormatted(table, chain, false, fmt, ap);
+    va_end(ap);
+    return rc;
+}
+
+bool IptablesTransaction::isEmpty() const {
+    return mSteps->empty();
+}
+
+// Undoes the first applied steps of order, or all of them one at a time
+// if applied is -1 because nobody knows which took effect.
+void IptablesTransaction::undo(Step **order, int count, int applied) {
+    if (applied < 0) {
+        LOGW("Unknown how much of the transaction took effect, undoing all of it");
+        for (int i = count - 1; i >= 0; i--) {
+            IptablesBatch step;
+            if (!step.add(order[i]->table, "%s", order[i]->inverse)) {
+                step.apply();
+            }
+        }
+        return;
+    }
+
+    IptablesBatch batch;
+    for (int i = applied - 1; i >= 0; i--) {
+        if (batch.add(order[i]->table, "%s", order[i]->inverse)) {
+            LOGE("Unable to roll back transaction (%s)", strerror(errno));
+            return;
+        }
+    }
+    if (batch.apply()) {
+        LOGE("Rolling back transaction failed");
+    }
+}
+
+int IptablesTransaction::commit() {
+    int count = mSteps->size();
+    if (count == 0) {
+        return 0;
+    }
+
+    // The batch applies tables in a fixed order; keep the steps in that
+    // order to know which ones a partial failure covers.
+    Step **order = new Step *[count];
+    IptablesBatch batch;
+    int n = 0;
+    for (int t = 0; t < IptablesBatch::NUM_TABLES; t++) {
+        StepCollection::iterator it;
+        for (it = mSteps->begin(); it != mSteps->end(); ++it) {
+            if ((*it)->table != t) {
+                continue;
+            }
+            if (batch.add((*it)->table, "%s", (*it)->command)) {
+                delete[] order;
+                return -1;
+            }
+            order[n++] = *it;
+        }
+    }
+
+    int applied;
+    if (batch.apply(&applied)) {
+        int savedErrno = errno;
+        LOGE("Transaction failed after %d of %d commands, rolling back", applied, count);
+        undo(order, count, applied);
+        delete[] order;
+        errno = savedErrno;
+        return -1;
+    }
+    delete[] order;
+    return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _IPTABLES_TRANSACTION_H
+#define _IPTABLES_TRANSACTION_H
+
+#include <stdarg.h>
+
+#include <utils/List.h>
+
+#include "IptablesBatch.h"
+
+/*
+ * iptables commands that take effect all together or not at all. Each
+ * command is recorded with the one that undoes it. If applying fails
+ * part way, the commands that did take effect are undone, last first.
+ *
+ * Nothing is journaled, so a netd crash in the middle of a transaction
+ * leaves it half applied. The owner repairs that when it starts: the
+ * NatController constructor reads its chains back from the kernel and
+ * reconciles them with the pairs it finds there.
+ */
+class IptablesTransaction {
+    struct Step {
+        IptablesBatch::Table table;
+        char                *command;
+        char                *inverse;
+    };
+
+    typedef android::List<Step *> StepCollection;
+
+    StepCollection *mSteps;
+
+public:
+    IptablesTransaction();
+    virtual ~IptablesTransaction();
+
+    /* Adds "-A <chain> <rule>", undone by "-D <chain> <rule>". */
+    int append(IptablesBatch::Table table, const char *chain, const char *fmt, ...)
+        __attribute__((format(printf, 4, 5)));
+
+    /*
+     * Adds "-D <chain> <rule>", undone by "-A <chain> <rule>". An undone
+     * delete puts the rule back at the end of the chain.
+     */
+    int remove(IptablesBatch::Table table, const char *chain, const char *fmt, ...)
+        __attribute__((format(printf, 4, 5)));
+
+    /* Adds a command with its undo command. */
+    int add(IptablesBatch::Table table, const char *command, const char *inverse);
+
+    bool isEmpty() const;
+
+    /*
+     * Applies every command. Returns 0 on success. On failure returns -1
+     * with the tables as they were before.
+     */
+    int commit();
+
+private:
+    int addFormatted(IptablesBatch::Table table, const char *chain, bool append,
+                     const char *fmt, va_list ap);
+    static void undo(Step **order, int count, int applied);
+};
+
+#endif
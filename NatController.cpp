@@ -14,7 +14,9 @@
  * limitations under the License.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -26,130 +28,629 @@
 #include <cutils/log.h>
 
 #include "NatController.h"
+#include "Conntrack.h"
+#include "IptablesBackend.h"
+#include "IptablesBatch.h"
+#include "IptablesTransaction.h"
 
-extern "C" int logwrap(int argc, const char **argv, int background);
+extern "C" int ifc_init(void);
+extern "C" int ifc_get_info(const char *name, in_addr_t *addr, in_addr_t *mask, unsigned *flags);
+extern "C" void ifc_close(void);
 
-static char IPTABLES_PATH[] = "/system/bin/iptables";
+// netd's rules live in chains of its own, each reached by one jump from
+// a built-in chain, so that other users of those chains are left alone.
+static const char NAT_FORWARD_CHAIN[] = "natctrl_FORWARD";
+static const char NAT_POSTROUTING_CHAIN[] = "natctrl_nat_POSTROUTING";
+static const char MANGLE_POSTROUTING_CHAIN[] = "natctrl_mangle_POSTROUTING";
+
+static const struct {
+    IptablesBatch::Table table;
+    const char           *parent;
+    const char           *chain;
+} OWNED_CHAINS[] = {
+    { IptablesBatch::FILTER, "FORWARD",     NAT_FORWARD_CHAIN },
+    { IptablesBatch::NAT,    "POSTROUTING", NAT_POSTROUTING_CHAIN },
+    { IptablesBatch::MANGLE, "POSTROUTING", MANGLE_POSTROUTING_CHAIN },
+};
+
+static const int NUM_OWNED_CHAINS = sizeof(OWNED_CHAINS) / sizeof(OWNED_CHAINS[0]);
+
+// The rules netd installs. loadInstalled() knows them by meaning rather
+// than by text, as iptables prints them back differently.
+static const char FORWARD_RULE[] = "-i %s -o %s -j ACCEPT";
+static const char FORWARD_RETURN_RULE[] =
+        "-i %s -o %s -m state --state ESTABLISHED,RELATED -j ACCEPT";
+static const char MASQUERADE_RULE[] = "-o %s -j MASQUERADE";
+static const char CLAMP_RULE[] =
+        "-p tcp --tcp-flags SYN,RST SYN -o %s -j TCPMSS --clamp-mss-to-pmtu";
 
 NatController::NatController() {
-    natCount = 0;
+    mPairs = new NatPairCollection();
+    mUpstreams = new UpstreamCollection();
+    mInstalledKnown = false;
+    // A restarted netd carries on with the NAT it had set up, and
+    // finishes or rolls back a change it crashed in the middle of.
+    if (loadInstalled()) {
+        LOGE("Unable to read back the NAT rules (%s); retrying on the next change",
+             strerror(errno));
+    }
 }
 
 NatController::~NatController() {
+    clearPairs();
+    delete mPairs;
+    delete mUpstreams;
 }
 
-int NatController::runIptablesCmd(const char *cmd) {
-    char buffer[255];
+// Drops every jump to owned chain i, so that setting it up leaves one.
+static int dropJumps(int i) {
+    IptablesBatch jump;
+    if (jump.add(OWNED_CHAINS[i].table, "-D %s -j %s", OWNED_CHAINS[i].parent,
+                 OWNED_CHAINS[i].chain)) {
+        return -1;
+    }
+    while (!jump.apply())
+        ;
+    return 0;
+}
 
-    strncpy(buffer, cmd, sizeof(buffer)-1);
+// Sets up the mangle chain, which only holds the MSS clamp and so is
+// best effort.
+static void setUpClampChain() {
+    for (int i = 0; i < NUM_OWNED_CHAINS; i++) {
+        if (OWNED_CHAINS[i].table != IptablesBatch::MANGLE) {
+            continue;
+        }
+        IptablesBatch mangle;
+        if (dropJumps(i) ||
+            mangle.addChain(OWNED_CHAINS[i].table, OWNED_CHAINS[i].chain) ||
+            mangle.add(OWNED_CHAINS[i].table, "-I %s -j %s", OWNED_CHAINS[i].parent,
+                       OWNED_CHAINS[i].chain) ||
+            mangle.apply()) {
+            LOGE("Unable to set up %s; no MSS clamping", OWNED_CHAINS[i].chain);
+        }
+    }
+}
 
-    const char *args[16];
-    char *next = buffer;
-    char *tmp;
+// Puts the chains netd owns in a known, empty state. Only needed if they
+// aren't all there, or can't be read back.
+int NatController::setDefaults() {
+    IptablesBatch batch;
+    if (batch.add(IptablesBatch::FILTER, "-P INPUT ACCEPT") ||
+        batch.add(IptablesBatch::FILTER, "-P OUTPUT ACCEPT") ||
+        batch.add(IptablesBatch::FILTER, "-P FORWARD DROP")) {
+        return -1;
+    }
+    for (int i = 0; i < NUM_OWNED_CHAINS; i++) {
+        if (OWNED_CHAINS[i].table == IptablesBatch::MANGLE) {
+            continue;
+        }
+        if (dropJumps(i) ||
+            batch.addChain(OWNED_CHAINS[i].table, OWNED_CHAINS[i].chain) ||
+            batch.add(OWNED_CHAINS[i].table, "-I %s -j %s", OWNED_CHAINS[i].parent,
+                      OWNED_CHAINS[i].chain)) {
+            return -1;
+        }
+    }
+    if (batch.apply()) {
+        return -1;
+    }
+    setUpClampChain();
+    mInstalled.clear();
+    mInstalledKnown = true;
+    clearPairs();
+    return 0;
+}
 
-    args[0] = IPTABLES_PATH;
-    args[1] = "--verbose";
-    int i = 2;
+// A rule in an owned chain as iptables prints it, taken apart. Only the
+// options netd uses are known.
+struct OwnedRule {
+    const char *inIface;
+    const char *outIface;
+    const char *target;
+    const char *state;
+    const char *tcpFlagMask;
+    const char *tcpFlagCmp;
+    bool       tcp;
+    bool       clampMss;
+};
 
-    while ((tmp = strsep(&next, " "))) {
-        args[i++] = tmp;
-//        if (i == 16) {	KD 9/25 Make "20" to accomodate MSS clamp
-        if (i == 20) {
-            LOGE("iptables argument overflow");
-            errno = E2BIG;
-            return -1;
+// Takes apart buf, which is modified. Returns false if buf holds
+// anything netd doesn't use.
+static bool parseOwnedRule(char *buf, OwnedRule *r) {
+    char *args[20];
+    int argc = 0;
+    char *next = buf;
+    char *tok;
+
+    memset(r, 0, sizeof(*r));
+    while ((tok = strsep(&next, " "))) {
+        if (!*tok) {
+            continue;
+        }
+        if (argc == 20) {
+            return false;
         }
+        args[argc++] = tok;
     }
-    args[i] = NULL;
 
-    return logwrap(i, args, 0);
+    for (int i = 0; i < argc; i++) {
+        const char *opt = args[i];
+        if (!strcmp(opt, "--clamp-mss-to-pmtu")) {
+            r->clampMss = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            return false;
+        }
+        const char *val = args[++i];
+        if (!strcmp(opt, "-i")) {
+            r->inIface = val;
+        } else if (!strcmp(opt, "-o")) {
+            r->outIface = val;
+        } else if (!strcmp(opt, "-j")) {
+            r->target = val;
+        } else if (!strcmp(opt, "-p")) {
+            if (strcmp(val, "tcp")) {
+                return false;
+            }
+            r->tcp = true;
+        } else if (!strcmp(opt, "-m")) {
+            if (strcmp(val, "state") && strcmp(val, "tcp")) {
+                return false;
+            }
+        } else if (!strcmp(opt, "--state")) {
+            r->state = val;
+        } else if (!strcmp(opt, "--tcp-flags")) {
+            if (i + 1 == argc) {
+                return false;
+            }
+            r->tcpFlagMask = val;
+            r->tcpFlagCmp = args[++i];
+        } else {
+            return false;
+        }
+    }
+    return r->target != NULL;
 }
 
-int NatController::setDefaults() {
+/*
+ * Takes a rule found in owned chain into mInstalled, and the pair it
+ * stands for into mPairs. Returns false if it isn't a rule netd
+ * installs, or is there twice.
+ */
+bool NatController::adoptRule(IptablesBatch::Table table, const char *chain,
+                              const char *rule) {
+    char buf[255];
+    char spec[255];
+    OwnedRule r;
+    int n;
+    bool pair = false;
+
+    strncpy(buf, rule, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    if (!parseOwnedRule(buf, &r)) {
+        return false;
+    }
+    bool plain = !r.tcp && !r.tcpFlagMask && !r.clampMss;
+    if (table == IptablesBatch::FILTER && !strcmp(r.target, "ACCEPT") && plain &&
+        r.inIface && r.outIface) {
+        if (!r.state) {
+            n = snprintf(spec, sizeof(spec), FORWARD_RULE, r.inIface, r.outIface);
+            pair = true;
+        } else if (!strcmp(r.state, "ESTABLISHED,RELATED") ||
+                   !strcmp(r.state, "RELATED,ESTABLISHED")) {
+            n = snprintf(spec, sizeof(spec), FORWARD_RETURN_RULE, r.inIface, r.outIface);
+        } else {
+            return false;
+        }
+    } else if (table == IptablesBatch::NAT && !strcmp(r.target, "MASQUERADE") && plain &&
+               !r.state && !r.inIface && r.outIface) {
+        n = snprintf(spec, sizeof(spec), MASQUERADE_RULE, r.outIface);
+    } else if (table == IptablesBatch::MANGLE && !strcmp(r.target, "TCPMSS") &&
+               r.clampMss && r.tcp && r.tcpFlagMask &&
+               (!strcmp(r.tcpFlagMask, "SYN,RST") || !strcmp(r.tcpFlagMask, "RST,SYN")) &&
+               !strcmp(r.tcpFlagCmp, "SYN") && !r.state && !r.inIface && r.outIface) {
+        n = snprintf(spec, sizeof(spec), CLAMP_RULE, r.outIface);
+    } else {
+        return false;
+    }
+
+    if (n >= (int) sizeof(spec) || mInstalled.contains(table, chain, spec) ||
+        mInstalled.add(table, chain, "%s", spec) ||
+        (pair && addPair(r.inIface, r.outIface))) {
+        return false;
+    }
+    return true;
+}
 
-    if (runIptablesCmd("-P INPUT ACCEPT"))
+/*
+ * Reads back the owned chains: their rules become mInstalled, and the
+ * pairs and upstreams they stand for are rebuilt from the forward rules.
+ * Then the rules are made to match the pairs, which finishes or undoes a
+ * change netd crashed in the middle of. Chains holding anything netd
+ * doesn't install are flushed and filled again. Falls back to
+ * setDefaults() if the chains aren't all there or can't be read.
+ */
+int NatController::loadInstalled() {
+    IptablesBackend *backend = IptablesBackend::Instance();
+    bool foreign = false;
+
+    mInstalled.clear();
+    clearPairs();
+    for (int i = 0; i < NUM_OWNED_CHAINS; i++) {
+        IptablesBatch::Table table = OWNED_CHAINS[i].table;
+        IptablesBatch::CommandCollection rules;
+        IptablesBatch::CommandCollection::iterator it;
+        char jump[64];
+        int jumps = 0;
+
+        snprintf(jump, sizeof(jump), "-j %s", OWNED_CHAINS[i].chain);
+        bool ok = !backend->listRules(table, OWNED_CHAINS[i].parent, &rules);
+        for (it = rules.begin(); it != rules.end(); ++it) {
+            if (!strcmp(*it, jump)) {
+                jumps++;
+            }
+            free(*it);
+        }
+        rules.clear();
+        ok = ok && jumps == 1 && !backend->listRules(table, OWNED_CHAINS[i].chain, &rules);
+
+        for (it = rules.begin(); it != rules.end(); ++it) {
+            if (ok && !adoptRule(table, OWNED_CHAINS[i].chain, *it)) {
+                foreign = true;
+            }
+            free(*it);
+        }
+        if (!ok && table == IptablesBatch::MANGLE) {
+            setUpClampChain();
+        } else if (!ok) {
+            return setDefaults();
+        }
+    }
+    mInstalledKnown = true;
+    if (!mPairs->empty()) {
+        LOGI("Picked up %d NAT pairs from an earlier netd", (int) mPairs->size());
+    }
+
+    if (foreign) {
+        LOGW("Unexpected rules in netd's NAT chains; reinstalling them");
+        if (flushOwnedChains()) {
+            return -1;
+        }
+    }
+    IptablesState desired;
+    if (buildState(&desired, NULL, NULL) || reconcile(desired)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Removes all of netd's NAT rules with one flush per chain.
+int NatController::flushOwnedChains() {
+    IptablesBatch batch;
+    // As in setDefaults(), the MSS clamp chain is flushed on its own so
+    // that a kernel without mangle support doesn't fail the rest.
+    IptablesBatch mangle;
+
+    for (int i = 0; i < NUM_OWNED_CHAINS; i++) {
+        IptablesBatch *b = OWNED_CHAINS[i].table == IptablesBatch::MANGLE ? &mangle : &batch;
+        if (b->addChain(OWNED_CHAINS[i].table, OWNED_CHAINS[i].chain)) {
+            return -1;
+        }
+    }
+    if (batch.apply()) {
+        // Some chains may have been flushed; loadInstalled() reads back
+        // what is left.
+        mInstalledKnown = false;
         return -1;
-    if (runIptablesCmd("-F INPUT"))
+    }
+    mInstalled.clearTable(IptablesBatch::FILTER);
+    mInstalled.clearTable(IptablesBatch::NAT);
+
+    if (mangle.apply()) {
+        LOGE("Unable to flush %s", MANGLE_POSTROUTING_CHAIN);
+    } else {
+        mInstalled.clearTable(IptablesBatch::MANGLE);
+    }
+    return 0;
+}
+
+bool NatController::interfaceExists(const char *iface) {
+    // XXX: STOPSHIP - Implement this
+    return true;
+}
+
+/*
+ * Applies the difference between desired and what is installed. The
+ * filter and nat changes go in or out together; the MSS clamp in mangle
+ * is best effort, and retried on the next change if it failed.
+ */
+int NatController::reconcile(const IptablesState &desired) {
+    if (desired.isEmpty()) {
+        return flushOwnedChains();
+    }
+
+    IptablesTransaction trans;
+
+    if (desired.diff(IptablesBatch::FILTER, mInstalled, &trans) ||
+        desired.diff(IptablesBatch::NAT, mInstalled, &trans) ||
+        trans.commit()) {
         return -1;
-    if (runIptablesCmd("-P OUTPUT ACCEPT"))
+    }
+    if (mInstalled.copyTable(IptablesBatch::FILTER, desired) ||
+        mInstalled.copyTable(IptablesBatch::NAT, desired)) {
+        // The kernel has the rules but we can't remember them: read them
+        // back next time.
+        mInstalledKnown = false;
         return -1;
-    if (runIptablesCmd("-F OUTPUT"))
+    }
+
+    // Kernels or iptables builds without TCPMSS support must not fail NAT
+    // as a whole.
+    IptablesTransaction clamp;
+    if (desired.diff(IptablesBatch::MANGLE, mInstalled, &clamp) || clamp.commit()) {
+        LOGE("MSS Clamp update failed; check kernel and iptables capabilities");
+    } else if (mInstalled.copyTable(IptablesBatch::MANGLE, desired)) {
+        mInstalledKnown = false;
+    }
+    return 0;
+}
+
+NatController::NatPair *NatController::findPair(const char *intIface, const char *extIface) {
+    NatPairCollection::iterator it;
+    for (it = mPairs->begin(); it != mPairs->end(); ++it) {
+        if (!strcmp((*it)->intIface, intIface) && !strcmp((*it)->extIface, extIface)) {
+            return *it;
+        }
+    }
+    return NULL;
+}
+
+NatController::Upstream *NatController::findUpstream(const char *extIface) {
+    UpstreamCollection::iterator it;
+    for (it = mUpstreams->begin(); it != mUpstreams->end(); ++it) {
+        if (!strcmp((*it)->iface, extIface)) {
+            return *it;
+        }
+    }
+    return NULL;
+}
+
+void NatController::clearPairs() {
+    NatPairCollection::iterator it;
+    for (it = mPairs->begin(); it != mPairs->end(); ++it) {
+        free((*it)->intIface);
+        free((*it)->extIface);
+        delete *it;
+    }
+    mPairs->clear();
+
+    UpstreamCollection::iterator uit;
+    for (uit = mUpstreams->begin(); uit != mUpstreams->end(); ++uit) {
+        free((*uit)->iface);
+        delete *uit;
+    }
+    mUpstreams->clear();
+}
+
+int NatController::addPairRules(IptablesState *state, const char *intIface,
+                                const char *extIface) {
+    if (state->add(IptablesBatch::FILTER, NAT_FORWARD_CHAIN, FORWARD_RETURN_RULE,
+                   extIface, intIface) ||
+        state->add(IptablesBatch::FILTER, NAT_FORWARD_CHAIN, FORWARD_RULE,
+                   intIface, extIface)) {
         return -1;
-    if (runIptablesCmd("-P FORWARD DROP"))
+    }
+    return 0;
+}
+
+int NatController::addUpstreamRules(IptablesState *state, const char *extIface) {
+    if (state->add(IptablesBatch::NAT, NAT_POSTROUTING_CHAIN, MASQUERADE_RULE, extIface) ||
+        state->add(IptablesBatch::MANGLE, MANGLE_POSTROUTING_CHAIN, CLAMP_RULE, extIface)) {
         return -1;
-    if (runIptablesCmd("-F FORWARD"))
+    }
+    return 0;
+}
+
+/*
+ * Builds the rules for every enabled pair, minus the removed one and plus
+ * the added one, either of which may be NULL. An upstream keeps its
+ * MASQUERADE and MSS clamp while any pair still uses it.
+ */
+int NatController::buildState(IptablesState *state, const NatPair *added,
+                              const NatPair *removed) {
+    NatPairCollection::iterator it;
+    for (it = mPairs->begin(); it != mPairs->end(); ++it) {
+        if (*it == removed) {
+            continue;
+        }
+        if (addPairRules(state, (*it)->intIface, (*it)->extIface)) {
+            return -1;
+        }
+    }
+    if (added && addPairRules(state, added->intIface, added->extIface)) {
         return -1;
-    if (runIptablesCmd("-t nat -F"))
+    }
+
+    UpstreamCollection::iterator uit;
+    for (uit = mUpstreams->begin(); uit != mUpstreams->end(); ++uit) {
+        int refs = (*uit)->refs;
+        if (removed && !strcmp(removed->extIface, (*uit)->iface)) {
+            refs--;
+        }
+        if (added && !strcmp(added->extIface, (*uit)->iface)) {
+            refs++;
+        }
+        if (refs > 0 && addUpstreamRules(state, (*uit)->iface)) {
+            return -1;
+        }
+    }
+    if (added && !findUpstream(added->extIface) &&
+        addUpstreamRules(state, added->extIface)) {
         return -1;
+    }
     return 0;
 }
 
-bool NatController::interfaceExists(const char *iface) {
-    // XXX: STOPSHIP - Implement this
-    return true;
+int NatController::addPair(const char *intIface, const char *extIface) {
+    Upstream *upstream = findUpstream(extIface);
+    if (!upstream) {
+        upstream = new Upstream;
+        upstream->iface = strdup(extIface);
+        upstream->refs = 0;
+        if (!upstream->iface) {
+            delete upstream;
+            errno = ENOMEM;
+            return -1;
+        }
+        mUpstreams->push_back(upstream);
+    }
+
+    NatPair *pair = new NatPair;
+    pair->intIface = strdup(intIface);
+    pair->extIface = strdup(extIface);
+    if (!pair->intIface || !pair->extIface) {
+        free(pair->intIface);
+        free(pair->extIface);
+        delete pair;
+        errno = ENOMEM;
+        return -1;
+    }
+    mPairs->push_back(pair);
+    upstream->refs++;
+    return 0;
 }
 
-int NatController::doNatCommands(const char *intIface, const char *extIface, bool add) {
-    char cmd[255];
-
-    // handle decrement to 0 case (do reset to defaults) and erroneous dec below 0
-    if (add == false) {
-        if (natCount <= 1) {
-            int ret = setDefaults();
-            if (ret == 0) {
-                natCount=0;
+void NatController::removePair(NatPair *pair) {
+    NatPairCollection::iterator it;
+    for (it = mPairs->begin(); it != mPairs->end(); ++it) {
+        if (*it == pair) {
+            mPairs->erase(it);
+            break;
+        }
+    }
+
+    UpstreamCollection::iterator uit;
+    for (uit = mUpstreams->begin(); uit != mUpstreams->end(); ++uit) {
+        Upstream *upstream = *uit;
+        if (!strcmp(upstream->iface, pair->extIface)) {
+            if (--upstream->refs == 0) {
+                mUpstreams->erase(uit);
+                free(upstream->iface);
+                delete upstream;
             }
-            return ret;
+            break;
         }
     }
 
+    free(pair->intIface);
+    free(pair->extIface);
+    delete pair;
+}
+
+int NatController::doNatCommands(const char *intIface, const char *extIface, bool add) {
     if (!interfaceExists(intIface) || !interfaceExists (extIface)) {
         LOGE("Invalid interface specified");
         errno = ENODEV;
         return -1;
     }
 
-    snprintf(cmd, sizeof(cmd),
-             "-%s FORWARD -i %s -o %s -m state --state ESTABLISHED,RELATED -j ACCEPT",
-             (add ? "A" : "D"),
-             extIface, intIface);
-    if (runIptablesCmd(cmd)) {
+    if (!mInstalledKnown && loadInstalled()) {
         return -1;
     }
 
-    snprintf(cmd, sizeof(cmd), "-%s FORWARD -i %s -o %s -j ACCEPT", (add ? "A" : "D"),
-            intIface, extIface);
-    if (runIptablesCmd(cmd)) {
-        // unwind what's been done, but don't care about success - what more could we do?
-        snprintf(cmd, sizeof(cmd),
-                 "-%s FORWARD -i %s -o %s -m state --state ESTABLISHED,RELATED -j ACCEPT",
-                 (!add ? "A" : "D"),
-                 extIface, intIface);
+    NatPair *pair = findPair(intIface, extIface);
+    if (add && pair) {
+        return 0;
+    }
+    if (!add && !pair) {
+        errno = ENOENT;
         return -1;
     }
 
-    // add this if we are the first added nat
-    if (add && natCount == 0) {
-        snprintf(cmd, sizeof(cmd), "-t nat -A POSTROUTING -o %s -j MASQUERADE", extIface);
-        if (runIptablesCmd(cmd)) {
-            // unwind what's been done, but don't care about success - what more could we do?
-            setDefaults();;
-            return -1;
-        }
-        snprintf(cmd, sizeof(cmd), "-t mangle -A POSTROUTING -p tcp --tcp-flags SYN,RST SYN -o %s -j TCPMSS --clamp-mss-to-pmtu", extIface);
-        if (runIptablesCmd(cmd)) {
-	    //
-            // Ignore return state but log error if it didn't work; either
-	    // kernel iptables are missing required options.
-	    //
-           LOGE("MSS Clamp failed attempting [%s]; check kernel and iptables capabilities", cmd);
-        }
+    NatPair newPair = { (char *) intIface, (char *) extIface };
+    IptablesState desired;
+    if (buildState(&desired, add ? &newPair : NULL, add ? NULL : pair) ||
+        reconcile(desired)) {
+        return -1;
     }
 
     if (add) {
-        natCount++;
+        if (addPair(intIface, extIface)) {
+            // Installed but not remembered; start over next time.
+            mInstalledKnown = false;
+            return -1;
+        }
     } else {
-        natCount--;
+        removePair(pair);
+    }
+    return 0;
+}
+
+int NatController::switchNat(const char *intIface, const char *oldExtIface,
+                             const char *newExtIface) {
+    if (!interfaceExists(intIface) || !interfaceExists(oldExtIface) ||
+        !interfaceExists(newExtIface)) {
+        LOGE("Invalid interface specified");
+        errno = ENODEV;
+        return -1;
+    }
+
+    if (!mInstalledKnown && loadInstalled()) {
+        return -1;
+    }
+
+    NatPair *oldPair = findPair(intIface, oldExtIface);
+    if (!oldPair) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (!strcmp(oldExtIface, newExtIface)) {
+        return 0;
+    }
+
+    // Read the addresses before anything changes. An upstream without an
+    // address has no flows left to flush: the kernel drops masqueraded
+    // connections when their address goes away. A downstream without one
+    // gives no subnet to pick its flows by, so those are left alone rather
+    // than flushing every other downstream's.
+    in_addr_t oldAddr = 0;
+    in_addr_t intAddr = 0;
+    in_addr_t intMask = 0;
+    in_addr_t mask;
+    unsigned flags;
+    ifc_init();
+    if (ifc_get_info(oldExtIface, &oldAddr, &mask, &flags)) {
+        oldAddr = 0;
+    }
+    if (ifc_get_info(intIface, &intAddr, &intMask, &flags)) {
+        intAddr = intMask = 0;
+    }
+    ifc_close();
+
+    // One reconcile moves the pair: the old FORWARD rules go and the new
+    // ones arrive in the same filter commit, so the gap is as short as an
+    // iptables-restore run.
+    bool exists = findPair(intIface, newExtIface) != NULL;
+    NatPair newPair = { (char *) intIface, (char *) newExtIface };
+    IptablesState desired;
+    if (buildState(&desired, exists ? NULL : &newPair, oldPair) || reconcile(desired)) {
+        return -1;
+    }
+    if (!exists && addPair(intIface, newExtIface)) {
+        mInstalledKnown = false;
+        return -1;
+    }
+    removePair(oldPair);
+
+    if (oldAddr && intAddr && intMask) {
+        int n = Conntrack::deleteNatFlows(oldAddr, intAddr & intMask, intMask);
+        if (n < 0) {
+            LOGW("Unable to flush connections via %s (%s)", oldExtIface, strerror(errno));
+        } else {
+            LOGD("Flushed %d connections via %s", n, oldExtIface);
+        }
     }
     return 0;
 }
@@ -21,6 +21,8 @@
 
 #include <utils/List.h>
 
+#include "IptablesState.h"
+
 class NatController {
 
 public:
@@ -30,11 +32,45 @@ public:
     int enableNat(const char *intIface, const char *extIface);
     int disableNat(const char *intIface, const char *extIface);
 
+    /*
+     * Moves intIface's NAT from oldExtIface to newExtIface in one step and
+     * deletes the connections that were masqueraded out of oldExtIface.
+     */
+    int switchNat(const char *intIface, const char *oldExtIface, const char *newExtIface);
+
 private:
-    int natCount;
+    struct NatPair {
+        char *intIface;
+        char *extIface;
+    };
+
+    struct Upstream {
+        char *iface;
+        int  refs;      // Pairs NATed out of iface
+    };
+
+    typedef android::List<NatPair *> NatPairCollection;
+    typedef android::List<Upstream *> UpstreamCollection;
+
+    NatPairCollection  *mPairs;
+    UpstreamCollection *mUpstreams;
+    // The rules netd installed, valid while mInstalledKnown is set.
+    IptablesState mInstalled;
+    bool mInstalledKnown;
 
     int setDefaults();
-    int runIptablesCmd(const char *cmd);
+    int loadInstalled();
+    bool adoptRule(IptablesBatch::Table table, const char *chain, const char *rule);
+    int flushOwnedChains();
+    int reconcile(const IptablesState &desired);
+    int buildState(IptablesState *state, const NatPair *added, const NatPair *removed);
+    static int addPairRules(IptablesState *state, const char *intIface, const char *extIface);
+    static int addUpstreamRules(IptablesState *state, const char *extIface);
+    NatPair *findPair(const char *intIface, const char *extIface);
+    Upstream *findUpstream(const char *extIface);
+    int addPair(const char *intIface, const char *extIface);
+    void removePair(NatPair *pair);
+    void clearPairs();
     bool interfaceExists(const char *iface);
     int doNatCommands(const char *intIface, const char *extIface, bool add);
 };
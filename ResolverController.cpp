@@ -23,6 +23,10 @@
 #include <resolv.h>
 
 #include "ResolverController.h"
+#include "DnsCache.h"
+#include "DnsPtrCache.h"
+#include "DnsSharedCache.h"
+#include "DnsStubResolver.h"
 
 int ResolverController::setDefaultInterface(const char* iface) {
     if (DBG) {
@@ -30,10 +34,16 @@ int ResolverController::setDefaultInterface(const char* iface) {
     }
 
     _resolv_set_default_iface(iface);
+    DnsCache::Instance()->setDefaultInterface(iface);
+    DnsSharedCache::Instance()->clear();
 
     return 0;
 }
 
+void ResolverController::getDefaultInterface(char* iface, size_t len) {
+    DnsCache::Instance()->getDefaultInterface(iface, len);
+}
+
 int ResolverController::setInterfaceDnsServers(const char* iface, char** servers, int numservers) {
     if (DBG) {
         LOGD("setInterfaceDnsServers iface = %s\n", iface);
@@ -41,6 +51,47 @@ int ResolverController::setInterfaceDnsServers(const char* iface, char** servers
 
     _resolv_set_nameservers_for_iface(iface, servers, numservers);
 
+    // Only answers from servers that went away may no longer be valid;
+    // reconfiguring the same servers keeps the cache warm.
+    DnsStubResolver *stub = DnsStubResolver::Instance();
+    uint32_t removed[DnsStubResolver::MAX_SERVERS];
+    int numRemoved;
+    int rc = stub->setInterfaceServers(iface, servers, numservers, removed, &numRemoved);
+    if (rc < 0) {
+        LOGE("Too many interfaces, no native resolver for %s", iface);
+        return -1;
+    }
+    if (rc > 0) {
+        DnsStubResolver::ServerSet set;
+        if (stub->getInterfaceServers(iface, &set)) {
+            // No valid servers left: the interface is as good as gone.
+            DnsCache::Instance()->releaseInterface(iface);
+        } else {
+            DnsCache::Instance()->invalidate(iface, removed, numRemoved);
+        }
+        DnsPtrCache::Instance()->flushInterface(iface);
+        // The shared cache doesn't know where its answers came from.
+        DnsSharedCache::Instance()->clear();
+    }
+
+    return 0;
+}
+
+int ResolverController::clearInterfaceDnsServers(const char* iface) {
+    if (DBG) {
+        LOGD("clearInterfaceDnsServers iface = %s\n", iface);
+    }
+
+    _resolv_flush_cache_for_iface(iface);
+
+    // Gives back the interface's resolver slot and cache partition.
+    uint32_t removed[DnsStubResolver::MAX_SERVERS];
+    int numRemoved;
+    DnsStubResolver::Instance()->setInterfaceServers(iface, NULL, 0, removed, &numRemoved);
+    DnsCache::Instance()->releaseInterface(iface);
+    DnsPtrCache::Instance()->flushInterface(iface);
+    DnsSharedCache::Instance()->clear();
+
     return 0;
 }
 
@@ -61,6 +112,12 @@ int ResolverController::flushDefaultDnsCache() {
 
     _resolv_flush_cache_for_default_iface();
 
+    char iface[IFNAMSIZ];
+    DnsCache::Instance()->getDefaultInterface(iface, sizeof(iface));
+    DnsCache::Instance()->flushInterface(iface);
+    DnsPtrCache::Instance()->flushInterface(iface);
+    DnsSharedCache::Instance()->clear();
+
     return 0;
 }
 
@@ -70,6 +127,20 @@ int ResolverController::flushInterfaceDnsCache(const char* iface) {
     }
 
     _resolv_flush_cache_for_iface(iface);
+    DnsCache::Instance()->flushInterface(iface);
+    DnsPtrCache::Instance()->flushInterface(iface);
+    DnsSharedCache::Instance()->clear();
+
+    return 0;
+}
+
+int ResolverController::flushDnsCacheName(const char* name) {
+    if (DBG) {
+        LOGD("flushDnsCacheName name = %s\n", name);
+    }
+
+    DnsCache::Instance()->flushName(name);
+    DnsSharedCache::Instance()->clear();
 
     return 0;
 }
@@ -26,10 +26,13 @@ public:
     virtual ~ResolverController() {};
 
     int setDefaultInterface(const char* iface);
+    void getDefaultInterface(char* iface, size_t len);
     int setInterfaceDnsServers(const char* iface, char** servers, int numservers);
+    int clearInterfaceDnsServers(const char* iface);
     int setInterfaceAddress(const char* iface, struct in_addr* addr);
     int flushDefaultDnsCache();
     int flushInterfaceDnsCache(const char* iface);
+    int flushDnsCacheName(const char* name);
 };
 
 #endif /* _RESOLVER_CONTROLLER_H_ */
@@ -26,6 +26,7 @@ public:
     static const int TetherInterfaceListResult = 111;
     static const int TetherDnsFwdTgtListResult = 112;
     static const int TtyListResult             = 113;
+    static const int ResolverStatsResult       = 114;
 
 
     // 200 series - Requested action has been successfully completed
@@ -40,6 +41,7 @@ public:
     static const int InterfaceTxCounterResult  = 217;
     static const int InterfaceRxThrottleResult = 218;
     static const int InterfaceTxThrottleResult = 219;
+    static const int ResolverDefaultIfResult   = 220;
 
     // 400 series - The command was accepted but the requested action
     // did not take place.
@@ -0,0 +1,430 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Load generator for the dnsproxyd socket. Each thread replays the
+ * hostname trace through getaddrinfo requests, one connection per
+ * request like bionic does, and the run ends with throughput and
+ * latency percentiles.
+ *
+ * With -f, a fake nameserver on loopback answers every A and AAAA
+ * question, and netd is pointed at it by making lo the default resolver
+ * interface, so the numbers do not depend on the network. The previous
+ * default interface is put back and lo's servers are cleared when the
+ * run ends or is interrupted. Correctness tests live in tests/; this is
+ * only a benchmark.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <cutils/sockets.h>
+#include <private/android_filesystem_config.h>
+
+#define MAX_NAMES       4096
+#define MAX_NAME_LEN    256
+#define FAKE_DNS_PORT   5353
+#define FAKE_DNS_TTL    60
+#define FAKE_DNS_IFACE  "lo"
+
+static const char *default_names[] = {
+    "www.google.com", "www.youtube.com", "www.facebook.com", "www.wikipedia.org",
+    "mail.google.com", "maps.google.com", "www.android.com", "twitter.com",
+    "www.yahoo.com", "www.amazon.com", "www.bing.com", "www.ebay.com",
+};
+
+static char **names;
+static int num_names;
+static int num_requests = 1000;
+static int num_threads = 8;
+static int unique_names;
+static volatile int next_request;
+static uint64_t *latencies_us;
+static volatile int failures;
+static char restore_default_cmd[64];
+static volatile int resolver_changed;
+
+static void usage(char *progname);
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int load_trace(const char *path) {
+    char line[MAX_NAME_LEN];
+    FILE *fp = fopen(path, "r");
+
+    if (!fp) {
+        fprintf(stderr, "Unable to open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    names = malloc(MAX_NAMES * sizeof(char *));
+    while (num_names < MAX_NAMES && fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, " \t\r\n#")] = '\0';
+        if (line[0])
+            names[num_names++] = strdup(line);
+    }
+    fclose(fp);
+    if (!num_names) {
+        fprintf(stderr, "No names in %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static int read_fully(int sock, void *buf, int len) {
+    char *p = buf;
+
+    while (len > 0) {
+        int rc = read(sock, p, len);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return -1;
+        p += rc;
+        len -= rc;
+    }
+    return 0;
+}
+
+// Reads and discards one length-prefixed blob. Returns its length, or -1.
+static int skip_blob(int sock) {
+    char buf[1024];
+    uint32_t len;
+    int total;
+
+    if (read_fully(sock, &len, sizeof(len)))
+        return -1;
+    total = len = ntohl(len);
+    while (len > 0) {
+        int n = (len > sizeof(buf)) ? sizeof(buf) : len;
+        if (read_fully(sock, buf, n))
+            return -1;
+        len -= n;
+    }
+    return total;
+}
+
+/*
+ * One getaddrinfo request, read back the way bionic does: the return
+ * code, then for each address its addrinfo, sockaddr and canonical name
+ * as length-prefixed blobs, up to a zero length. Returns the getaddrinfo
+ * result, or -1 if the exchange itself failed.
+ */
+static int do_request(const char *name) {
+    char cmd[MAX_NAME_LEN + 64];
+    int rv;
+    int sock;
+
+    sock = socket_local_client("dnsproxyd", ANDROID_SOCKET_NAMESPACE_RESERVED,
+                               SOCK_STREAM);
+    if (sock < 0)
+        return -1;
+
+    // AF_UNSPEC, SOCK_STREAM, like most apps
+    snprintf(cmd, sizeof(cmd), "getaddrinfo %s ^ 0 0 1 0", name);
+    if (write(sock, cmd, strlen(cmd) + 1) < 0 || read_fully(sock, &rv, sizeof(rv))) {
+        close(sock);
+        return -1;
+    }
+    if (rv == 0) {
+        int len;
+        while ((len = skip_blob(sock)) > 0) {
+            if (skip_blob(sock) < 0 || skip_blob(sock) < 0) {
+                len = -1;
+                break;
+            }
+        }
+        if (len < 0)
+            rv = -1;
+    }
+    close(sock);
+    return rv;
+}
+
+static void *client_thread(void *arg) {
+    char name[MAX_NAME_LEN + 16];
+
+    while (1) {
+        int i = __sync_fetch_and_add(&next_request, 1);
+        if (i >= num_requests)
+            break;
+
+        if (unique_names)
+            snprintf(name, sizeof(name), "n%d.%s", i, names[i % num_names]);
+        else
+            snprintf(name, sizeof(name), "%s", names[i % num_names]);
+
+        uint64_t start = now_us();
+        if (do_request(name) != 0)
+            __sync_fetch_and_add(&failures, 1);
+        latencies_us[i] = now_us() - start;
+    }
+    return NULL;
+}
+
+/*
+ * Answers every question with one record: 192.0.2.1 for A, 2001:db8::1
+ * for AAAA, and an empty answer for anything else.
+ */
+static void *fake_dns_thread(void *arg) {
+    int sock = (int) (intptr_t) arg;
+    unsigned char buf[512];
+    static const unsigned char v4[4] = { 192, 0, 2, 1 };
+    static const unsigned char v6[16] = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0,
+                                          0, 0, 0, 0, 0, 0, 0, 1 };
+
+    while (1) {
+        struct sockaddr_storage from;
+        socklen_t fromlen = sizeof(from);
+        int n = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *) &from, &fromlen);
+        int qend = 12;
+
+        if (n < 12)
+            continue;
+        while (qend < n && buf[qend])
+            qend += buf[qend] + 1;
+        qend += 5;
+        if (qend > n)
+            continue;
+
+        int qtype = (buf[qend - 4] << 8) | buf[qend - 3];
+        const unsigned char *rdata = (qtype == 1) ? v4 : (qtype == 28) ? v6 : NULL;
+        int rdlen = (qtype == 1) ? sizeof(v4) : sizeof(v6);
+        int len = qend;
+
+        buf[2] = 0x84 | (buf[2] & 0x01);    // QR, AA, keep RD
+        buf[3] = 0x80;                      // RA, NOERROR
+        buf[6] = buf[7] = 0;                // ANCOUNT
+        buf[8] = buf[9] = buf[10] = buf[11] = 0;
+        if (rdata && len + 12 + rdlen <= (int) sizeof(buf)) {
+            unsigned char *p = buf + len;
+            buf[7] = 1;
+            *p++ = 0xc0;                    // pointer to the question name
+            *p++ = 12;
+            *p++ = qtype >> 8;
+            *p++ = qtype & 0xff;
+            *p++ = 0;
+            *p++ = 1;                       // IN
+            *p++ = 0;
+            *p++ = 0;
+            *p++ = FAKE_DNS_TTL >> 8;
+            *p++ = FAKE_DNS_TTL & 0xff;
+            *p++ = 0;
+            *p++ = rdlen;
+            memcpy(p, rdata, rdlen);
+            len = p + rdlen - buf;
+        }
+        sendto(sock, buf, len, 0, (struct sockaddr *) &from, fromlen);
+    }
+    return NULL;
+}
+
+/*
+ * Sends cmd to netd and returns the response code, or -1. If reply is
+ * given, the text after the code is copied there.
+ */
+static int netd_cmd(const char *cmd, char *reply, size_t len) {
+    char buf[256];
+    int sock = socket_local_client("netd", ANDROID_SOCKET_NAMESPACE_RESERVED, SOCK_STREAM);
+    int rc;
+
+    if (sock < 0)
+        return -1;
+    if (write(sock, cmd, strlen(cmd) + 1) < 0 || (rc = read(sock, buf, sizeof(buf) - 1)) <= 0) {
+        close(sock);
+        return -1;
+    }
+    buf[rc] = '\0';
+    close(sock);
+    if (reply) {
+        char *text = strchr(buf, ' ');
+        snprintf(reply, len, "%s", text ? text + 1 : "");
+    }
+    return atoi(buf);
+}
+
+/*
+ * Undoes start_fake_dns(). Only does socket I/O on prebuilt commands, so
+ * that it can run from a signal handler.
+ */
+static void restore_resolver(void) {
+    if (!resolver_changed)
+        return;
+    resolver_changed = 0;
+    if (restore_default_cmd[0])
+        netd_cmd(restore_default_cmd, NULL, 0);
+    netd_cmd("resolver clearifdns " FAKE_DNS_IFACE, NULL, 0);
+    netd_cmd("resolver flushif " FAKE_DNS_IFACE, NULL, 0);
+}
+
+static void restore_and_die(int sig) {
+    restore_resolver();
+    _exit(128 + sig);
+}
+
+static int start_fake_dns(void) {
+    struct sockaddr_in sin;
+    pthread_t thread;
+    char cmd[128];
+    char iface[32];
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(FAKE_DNS_PORT);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sock < 0 || bind(sock, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+        fprintf(stderr, "Unable to bind fake DNS server (%s)\n", strerror(errno));
+        return -1;
+    }
+    if (pthread_create(&thread, NULL, fake_dns_thread, (void *) (intptr_t) sock)) {
+        fprintf(stderr, "Unable to start fake DNS server\n");
+        return -1;
+    }
+
+    // Remember what to put back before changing anything.
+    if (netd_cmd("resolver getdefaultif", iface, sizeof(iface)) != 220) {
+        fprintf(stderr, "Unable to read the default resolver interface\n");
+        return -1;
+    }
+    if (iface[0])
+        snprintf(restore_default_cmd, sizeof(restore_default_cmd),
+                 "resolver setdefaultif %s", iface);
+    else
+        fprintf(stderr, "No default resolver interface; lo stays the default after the run\n");
+    resolver_changed = 1;
+    atexit(restore_resolver);
+    signal(SIGINT, restore_and_die);
+    signal(SIGTERM, restore_and_die);
+    signal(SIGHUP, restore_and_die);
+
+    snprintf(cmd, sizeof(cmd), "resolver setifdns %s 127.0.0.1#%d", FAKE_DNS_IFACE,
+             FAKE_DNS_PORT);
+    if (netd_cmd(cmd, NULL, 0) != 200)
+        return -1;
+    if (netd_cmd("resolver setdefaultif " FAKE_DNS_IFACE, NULL, 0) != 200)
+        return -1;
+    return (netd_cmd("resolver flushif " FAKE_DNS_IFACE, NULL, 0) == 200) ? 0 : -1;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+static uint64_t percentile(int permille) {
+    int i = (int) ((int64_t) num_requests * permille / 1000);
+
+    if (i >= num_requests)
+        i = num_requests - 1;
+    return latencies_us[i];
+}
+
+int main(int argc, char **argv) {
+    const char *trace = NULL;
+    int fake_dns = 0;
+    pthread_t *threads;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "c:n:t:uf")) != -1) {
+        switch (opt) {
+        case 'c':
+            num_threads = atoi(optarg);
+            break;
+        case 'n':
+            num_requests = atoi(optarg);
+            break;
+        case 't':
+            trace = optarg;
+            break;
+        case 'u':
+            unique_names = 1;
+            break;
+        case 'f':
+            fake_dns = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (num_threads < 1 || num_requests < 1)
+        usage(argv[0]);
+
+    if (trace) {
+        if (load_trace(trace))
+            exit(1);
+    } else {
+        names = (char **) default_names;
+        num_names = sizeof(default_names) / sizeof(default_names[0]);
+    }
+    if (fake_dns && start_fake_dns()) {
+        fprintf(stderr, "Unable to set up the fake DNS server\n");
+        exit(1);
+    }
+
+    latencies_us = calloc(num_requests, sizeof(uint64_t));
+    threads = calloc(num_threads, sizeof(pthread_t));
+    if (!latencies_us || !threads) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    uint64_t start = now_us();
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, client_thread, NULL)) {
+            fprintf(stderr, "Unable to start client thread (%s)\n", strerror(errno));
+            exit(1);
+        }
+    }
+    for (i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+    uint64_t elapsed = now_us() - start;
+
+    qsort(latencies_us, num_requests, sizeof(uint64_t), compare_u64);
+    printf("requests %d threads %d failures %d\n", num_requests, num_threads, failures);
+    printf("throughput %.1f req/s\n", num_requests * 1000000.0 / (elapsed ? elapsed : 1));
+    printf("latency us p50 %llu p99 %llu p999 %llu max %llu\n",
+           (unsigned long long) percentile(500), (unsigned long long) percentile(990),
+           (unsigned long long) percentile(999),
+           (unsigned long long) latencies_us[num_requests - 1]);
+    exit(failures ? 2 : 0);
+}
+
+static void usage(char *progname) {
+    fprintf(stderr, "Usage: %s [-c threads] [-n requests] [-t tracefile] [-u] [-f]\n"
+            "  -u  make every name unique, so every request misses the cache\n"
+            "  -f  answer from a fake nameserver on loopback for the length of the run\n",
+            progname);
+    exit(1);
+}
@@ -33,6 +33,7 @@
 #include "CommandListener.h"
 #include "NetlinkManager.h"
 #include "DnsProxyListener.h"
+#include "DnsCache.h"
 
 static void coldboot(const char *path);
 static void sigchld_handler(int sig);
@@ -64,6 +65,13 @@ int main() {
     // Set local DNS mode, to prevent bionic from proxying
     // back to this service, recursively.
     setenv("ANDROID_DNS_MODE", "local", 1);
+
+    // Warm the DNS cache with what the previous run knew.
+    DnsCache::Instance()->loadSnapshot();
+    if (DnsCache::Instance()->startCheckpointing()) {
+        LOGE("Unable to start DNS cache checkpointing (%s)", strerror(errno));
+    }
+
     dpl = new DnsProxyListener();
     if (dpl->startListener()) {
         LOGE("Unable to start DnsProxyListener (%s)", strerror(errno));
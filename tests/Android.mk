@@ -0,0 +1,29 @@
+LOCAL_PATH:= $(call my-dir)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:=                                      \
+                  DnsPacketTest.cpp                    \
+                  DnsStubResolverTest.cpp              \
+                  ../DnsCache.cpp                      \
+                  ../DnsPacket.cpp                     \
+                  ../DnsServerStats.cpp                \
+                  ../DnsStubResolver.cpp
+
+LOCAL_MODULE:= netd_dns_tests
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_C_INCLUDES := $(KERNEL_HEADERS) \
+                    $(LOCAL_PATH)/.. \
+                    bionic \
+                    bionic/libstdc++/include \
+                    external/gtest/include \
+                    external/stlport/stlport
+
+LOCAL_CFLAGS :=
+
+LOCAL_SHARED_LIBRARIES := libcutils libstlport
+
+LOCAL_STATIC_LIBRARIES := libgtest libgtest_main
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <gtest/gtest.h>
+
+#include "DnsPacket.h"
+
+static const uint16_t ID = 0x1234;
+
+// Builds DNS messages a byte at a time; names are written uncompressed.
+class MessageWriter {
+    uint8_t mBuf[DnsPacket::MAX_UDP_SIZE];
+    int     mLen;
+
+public:
+    MessageWriter() : mLen(0) {}
+
+    const uint8_t *data() const { return mBuf; }
+    int length() const { return mLen; }
+
+    void put8(int v) { mBuf[mLen++] = v; }
+    void put16(int v) { put8(v >> 8); put8(v & 0xff); }
+    void put32(uint32_t v) { put16(v >> 16); put16(v & 0xffff); }
+
+    void header(uint16_t id, int flags, int rcode, int an, int ns) {
+        put16(id);
+        put8(flags);
+        put8(0x80 | rcode);     // RA
+        put16(1);
+        put16(an);
+        put16(ns);
+        put16(0);
+    }
+
+    void name(const char *name) {
+        while (*name) {
+            const char *dot = strchr(name, '.');
+            int len = dot ? dot - name : strlen(name);
+            put8(len);
+            memcpy(mBuf + mLen, name, len);
+            mLen += len;
+            name += dot ? len + 1 : len;
+        }
+        put8(0);
+    }
+
+    void question(const char *qname, int qtype) {
+        name(qname);
+        put16(qtype);
+        put16(DnsPacket::CLASS_IN);
+    }
+
+    // Writes the fixed part of a record; rdlength is patched by endRecord().
+    int record(const char *owner, int type, uint32_t ttl) {
+        name(owner);
+        put16(type);
+        put16(DnsPacket::CLASS_IN);
+        put32(ttl);
+        put16(0);
+        return mLen;
+    }
+
+    void endRecord(int rdata) {
+        int rdlen = mLen - rdata;
+        mBuf[rdata - 2] = rdlen >> 8;
+        mBuf[rdata - 1] = rdlen & 0xff;
+    }
+
+    void a(const char *owner, uint32_t ttl, const char *addr) {
+        int rdata = record(owner, DnsPacket::TYPE_A, ttl);
+        inet_pton(AF_INET, addr, mBuf + mLen);
+        mLen += 4;
+        endRecord(rdata);
+    }
+
+    void cname(const char *owner, uint32_t ttl, const char *target) {
+        int rdata = record(owner, DnsPacket::TYPE_CNAME, ttl);
+        name(target);
+        endRecord(rdata);
+    }
+
+    void soa(const char *owner, uint32_t ttl, uint32_t minimum) {
+        int rdata = record(owner, DnsPacket::TYPE_SOA, ttl);
+        name("ns.example.com");
+        name("hostmaster.example.com");
+        put32(1);       // serial
+        put32(3600);    // refresh
+        put32(600);     // retry
+        put32(86400);   // expire
+        put32(minimum);
+        endRecord(rdata);
+    }
+};
+
+static const int QR = 0x80;
+static const int TC = 0x02;
+static const int RD = 0x01;
+
+static int parse(const MessageWriter &w, const char *name, int qtype, DnsResponse *resp) {
+    return DnsPacket::parseResponse(w.data(), w.length(), ID, name, qtype, resp);
+}
+
+TEST(DnsPacketTest, BuildQueryRejectsBadNames) {
+    uint8_t buf[DnsPacket::MAX_UDP_SIZE];
+    char longLabel[80];
+
+    EXPECT_LT(DnsPacket::buildQuery(buf, sizeof(buf), ID, "", DnsPacket::TYPE_A), 0);
+    EXPECT_LT(DnsPacket::buildQuery(buf, sizeof(buf), ID, "a..b", DnsPacket::TYPE_A), 0);
+    memset(longLabel, 'x', 64);
+    strcpy(longLabel + 64, ".com");
+    EXPECT_LT(DnsPacket::buildQuery(buf, sizeof(buf), ID, longLabel, DnsPacket::TYPE_A), 0);
+    EXPECT_LT(DnsPacket::buildQuery(buf, 20, ID, "www.example.com", DnsPacket::TYPE_A), 0);
+
+    int len = DnsPacket::buildQuery(buf, sizeof(buf), ID, "www.example.com.",
+                                    DnsPacket::TYPE_AAAA);
+    ASSERT_EQ(DnsPacket::HEADER_SIZE + 17 + 4, len);
+    EXPECT_EQ(ID, DnsPacket::getId(buf));
+}
+
+TEST(DnsPacketTest, FollowsCnameChain) {
+    MessageWriter w;
+    w.header(ID, QR | RD, DnsPacket::RCODE_NOERROR, 4, 0);
+    w.question("www.example.com", DnsPacket::TYPE_A);
+    // Out of order, with an address for a name outside the chain.
+    w.a("b.example.org", 200, "192.0.2.1");
+    w.a("other.example.com", 10, "192.0.2.99");
+    w.cname("a.example.net", 100, "b.example.org");
+    w.cname("www.example.com", 300, "a.example.net");
+
+    DnsResponse resp;
+    ASSERT_EQ(0, parse(w, "www.example.com", DnsPacket::TYPE_A, &resp));
+    EXPECT_EQ((int) DnsPacket::RCODE_NOERROR, resp.rcode);
+    EXPECT_FALSE(resp.truncated);
+    EXPECT_STREQ("b.example.org", resp.canonName);
+    ASSERT_EQ(1, resp.numAddrs);
+    EXPECT_EQ(AF_INET, resp.addrs[0].family);
+    EXPECT_EQ(inet_addr("192.0.2.1"), resp.addrs[0].addr.v4.s_addr);
+    // The smallest TTL along the chain, not that of the unrelated record.
+    EXPECT_EQ(100, resp.ttl);
+}
+
+TEST(DnsPacketTest, StopsOnCnameLoop) {
+    MessageWriter w;
+    w.header(ID, QR | RD, DnsPacket::RCODE_NOERROR, 2, 0);
+    w.question("a.example.com", DnsPacket::TYPE_A);
+    w.cname("a.example.com", 60, "b.example.com");
+    w.cname("b.example.com", 60, "a.example.com");
+
+    DnsResponse resp;
+    ASSERT_EQ(0, parse(w, "a.example.com", DnsPacket::TYPE_A, &resp));
+    EXPECT_EQ(0, resp.numAddrs);
+}
+
+TEST(DnsPacketTest, NegativeTtlFromSoa) {
+    DnsResponse resp;
+
+    // NXDOMAIN: the SOA minimum is below the record's TTL.
+    MessageWriter nx;
+    nx.header(ID, QR | RD, DnsPacket::RCODE_NXDOMAIN, 0, 1);
+    nx.question("missing.example.com", DnsPacket::TYPE_A);
+    nx.soa("example.com", 3600, 60);
+    ASSERT_EQ(0, parse(nx, "missing.example.com", DnsPacket::TYPE_A, &resp));
+    EXPECT_EQ((int) DnsPacket::RCODE_NXDOMAIN, resp.rcode);
+    EXPECT_EQ(0, resp.numAddrs);
+    EXPECT_EQ(60, resp.ttl);
+
+    // NODATA behind a CNAME: the SOA's own TTL is the smaller one.
+    MessageWriter nodata;
+    nodata.header(ID, QR | RD, DnsPacket::RCODE_NOERROR, 1, 1);
+    nodata.question("www.example.com", DnsPacket::TYPE_AAAA);
+    nodata.cname("www.example.com", 300, "v4only.example.com");
+    nodata.soa("example.com", 30, 600);
+    ASSERT_EQ(0, parse(nodata, "www.example.com", DnsPacket::TYPE_AAAA, &resp));
+    EXPECT_EQ((int) DnsPacket::RCODE_NOERROR, resp.rcode);
+    EXPECT_EQ(0, resp.numAddrs);
+    EXPECT_EQ(30, resp.ttl);
+
+    // Without a SOA there is nothing to cache the answer for.
+    MessageWriter bare;
+    bare.header(ID, QR | RD, DnsPacket::RCODE_NXDOMAIN, 0, 0);
+    bare.question("missing.example.com", DnsPacket::TYPE_A);
+    ASSERT_EQ(0, parse(bare, "missing.example.com", DnsPacket::TYPE_A, &resp));
+    EXPECT_EQ(-1, resp.ttl);
+}
+
+TEST(DnsPacketTest, ReportsTruncation) {
+    MessageWriter w;
+    w.header(ID, QR | TC | RD, DnsPacket::RCODE_NOERROR, 0, 0);
+    w.question("big.example.com", DnsPacket::TYPE_A);
+
+    DnsResponse resp;
+    ASSERT_EQ(0, parse(w, "big.example.com", DnsPacket::TYPE_A, &resp));
+    EXPECT_TRUE(resp.truncated);
+    EXPECT_EQ(0, resp.numAddrs);
+}
+
+TEST(DnsPacketTest, RejectsCutOffMessages) {
+    MessageWriter w;
+    w.header(ID, QR | RD, DnsPacket::RCODE_NOERROR, 2, 0);
+    w.question("www.example.com", DnsPacket::TYPE_A);
+    w.cname("www.example.com", 300, "a.example.net");
+    w.a("a.example.net", 300, "192.0.2.1");
+
+    DnsResponse resp;
+    ASSERT_EQ(0, parse(w, "www.example.com", DnsPacket::TYPE_A, &resp));
+    for (int len = 0; len < w.length(); len++) {
+        EXPECT_EQ(-1, DnsPacket::parseResponse(w.data(), len, ID, "www.example.com",
+                                               DnsPacket::TYPE_A, &resp)) << "length " << len;
+    }
+}
+
+TEST(DnsPacketTest, RejectsOtherQuestions) {
+    MessageWriter w;
+    w.header(ID, QR | RD, DnsPacket::RCODE_NOERROR, 1, 0);
+    w.question("www.example.com", DnsPacket::TYPE_A);
+    w.a("www.example.com", 300, "192.0.2.1");
+
+    DnsResponse resp;
+    EXPECT_EQ(0, parse(w, "WWW.Example.COM.", DnsPacket::TYPE_A, &resp));
+    EXPECT_EQ(-1, DnsPacket::parseResponse(w.data(), w.length(), ID + 1, "www.example.com",
+                                           DnsPacket::TYPE_A, &resp));
+    EXPECT_EQ(-1, parse(w, "www.example.org", DnsPacket::TYPE_A, &resp));
+    EXPECT_EQ(-1, parse(w, "www.example.com", DnsPacket::TYPE_AAAA, &resp));
+
+    MessageWriter query;
+    query.header(ID, RD, DnsPacket::RCODE_NOERROR, 0, 0);
+    query.question("www.example.com", DnsPacket::TYPE_A);
+    EXPECT_EQ(-1, parse(query, "www.example.com", DnsPacket::TYPE_A, &resp));
+}
+
+TEST(DnsPacketTest, RejectsCompressionLoop) {
+    MessageWriter w;
+    w.header(ID, QR | RD, DnsPacket::RCODE_NOERROR, 1, 0);
+    w.question("www.example.com", DnsPacket::TYPE_A);
+    // An owner name that points at itself.
+    int self = w.length();
+    w.put16(0xc000 | self);
+    w.put16(DnsPacket::TYPE_A);
+    w.put16(DnsPacket::CLASS_IN);
+    w.put32(300);
+    w.put16(4);
+    w.put32(0xc0000201);
+
+    DnsResponse resp;
+    EXPECT_EQ(-1, parse(w, "www.example.com", DnsPacket::TYPE_A, &resp));
+}
+
+TEST(DnsPacketTest, ReverseNames) {
+    DnsAddress addr;
+    char name[DnsResponse::MAX_NAME];
+
+    addr.family = AF_INET;
+    inet_pton(AF_INET, "192.0.2.1", &addr.addr.v4);
+    ASSERT_EQ(0, DnsPacket::reverseName(&addr, name, sizeof(name)));
+    EXPECT_STREQ("1.2.0.192.in-addr.arpa", name);
+
+    addr.family = AF_INET6;
+    inet_pton(AF_INET6, "2001:db8::1", &addr.addr.v6);
+    ASSERT_EQ(0, DnsPacket::reverseName(&addr, name, sizeof(name)));
+    EXPECT_STREQ("1.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.8.b.d.0.1.0.0.2.ip6.arpa",
+                 name);
+}
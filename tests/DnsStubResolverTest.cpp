@@ -0,0 +1,371 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <gtest/gtest.h>
+
+#include "DnsPacket.h"
+#include "DnsStubResolver.h"
+
+// The resolver under test is this process's own, not netd's, so the
+// servers of lo are only changed here.
+static const char IFACE[] = "lo";
+
+static const char ANSWER_V4[] = "192.0.2.1";
+static const char TCP_ANSWER_V4[] = "192.0.2.2";
+
+/*
+ * A nameserver on a free loopback port, answering over UDP and TCP as
+ * its mode says. Every answer is one A record for the question name.
+ */
+class FakeDnsServer {
+public:
+    enum Mode {
+        ANSWER,             // answer right away
+        SILENT,             // never answer
+        SERVFAIL,           // answer SERVFAIL
+        WRONG_ID_FIRST,     // send a reply with the wrong id, then the answer
+        TRUNCATE,           // set TC over UDP, answer over TCP
+        TRUNCATE_STALL,     // set TC over UDP, never answer over TCP
+    };
+
+private:
+    Mode               mMode;
+    int                mUdp;
+    int                mTcp;
+    int                mPort;
+    volatile bool      mStop;
+    volatile int       mQueries;
+    pthread_t          mThread;
+
+public:
+    FakeDnsServer(Mode mode) : mMode(mode), mUdp(-1), mTcp(-1), mPort(0), mStop(false),
+                               mQueries(0) {}
+
+    ~FakeDnsServer() {
+        if (mUdp >= 0) {
+            mStop = true;
+            pthread_join(mThread, NULL);
+            close(mUdp);
+            close(mTcp);
+        }
+    }
+
+    bool start() {
+        struct sockaddr_in sin;
+        socklen_t len = sizeof(sin);
+
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        mUdp = socket(AF_INET, SOCK_DGRAM, 0);
+        if (mUdp < 0 || bind(mUdp, (struct sockaddr *) &sin, sizeof(sin)) ||
+            getsockname(mUdp, (struct sockaddr *) &sin, &len)) {
+            return false;
+        }
+        // TCP on the same port, as for a real server.
+        mTcp = socket(AF_INET, SOCK_STREAM, 0);
+        int on = 1;
+        setsockopt(mTcp, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (mTcp < 0 || bind(mTcp, (struct sockaddr *) &sin, sizeof(sin)) || listen(mTcp, 4)) {
+            return false;
+        }
+        mPort = ntohs(sin.sin_port);
+        return !pthread_create(&mThread, NULL, threadStart, this);
+    }
+
+    // The server as ResolverController passes it, e.g. "127.0.0.1#5353".
+    void address(char *buf, size_t len) const {
+        snprintf(buf, len, "127.0.0.1#%d", mPort);
+    }
+
+    int queries() const { return mQueries; }
+
+private:
+    static void *threadStart(void *obj) {
+        ((FakeDnsServer *) obj)->run();
+        return NULL;
+    }
+
+    /*
+     * Turns the query in buf into a response in place. Returns its
+     * length, or -1 if the query is malformed.
+     */
+    static int respond(uint8_t *buf, int len, int size, int rcode, bool truncated,
+                       const char *addr) {
+        int qend = DnsPacket::HEADER_SIZE;
+        while (qend < len && buf[qend]) {
+            qend += buf[qend] + 1;
+        }
+        qend += 5;
+        if (qend > len) {
+            return -1;
+        }
+        buf[2] = 0x80 | (truncated ? 0x02 : 0) | (buf[2] & 0x01);
+        buf[3] = 0x80 | rcode;
+        memset(buf + 6, 0, 6);
+        if (rcode != DnsPacket::RCODE_NOERROR || truncated || qend + 16 > size) {
+            return qend;
+        }
+        uint8_t *p = buf + qend;
+        buf[7] = 1;
+        *p++ = 0xc0;            // the question name
+        *p++ = DnsPacket::HEADER_SIZE;
+        *p++ = 0;
+        *p++ = DnsPacket::TYPE_A;
+        *p++ = 0;
+        *p++ = DnsPacket::CLASS_IN;
+        *p++ = 0;
+        *p++ = 0;
+        *p++ = 0;
+        *p++ = 60;              // TTL
+        *p++ = 0;
+        *p++ = 4;
+        inet_pton(AF_INET, addr, p);
+        return qend + 16;
+    }
+
+    void serveUdp() {
+        uint8_t buf[DnsPacket::MAX_UDP_SIZE];
+        struct sockaddr_in from;
+        socklen_t fromLen = sizeof(from);
+
+        int n = recvfrom(mUdp, buf, sizeof(buf), 0, (struct sockaddr *) &from, &fromLen);
+        if (n < DnsPacket::HEADER_SIZE) {
+            return;
+        }
+        __sync_fetch_and_add(&mQueries, 1);
+        if (mMode == SILENT) {
+            return;
+        }
+        if (mMode == WRONG_ID_FIRST) {
+            uint8_t bogus[DnsPacket::MAX_UDP_SIZE];
+            memcpy(bogus, buf, n);
+            bogus[0] ^= 0xff;
+            int len = respond(bogus, n, sizeof(bogus), DnsPacket::RCODE_NOERROR, false,
+                              "198.51.100.1");
+            if (len > 0) {
+                sendto(mUdp, bogus, len, 0, (struct sockaddr *) &from, fromLen);
+            }
+        }
+        int len = respond(buf, n, sizeof(buf),
+                          mMode == SERVFAIL ? DnsPacket::RCODE_SERVFAIL :
+                                              DnsPacket::RCODE_NOERROR,
+                          mMode == TRUNCATE || mMode == TRUNCATE_STALL, ANSWER_V4);
+        if (len > 0) {
+            sendto(mUdp, buf, len, 0, (struct sockaddr *) &from, fromLen);
+        }
+    }
+
+    void serveTcp() {
+        uint8_t buf[DnsPacket::MAX_UDP_SIZE + 2];
+        int fd = accept(mTcp, NULL, NULL);
+        if (fd < 0) {
+            return;
+        }
+        // The length and the query may come in separate writes.
+        int n = 0;
+        while (n < 2 || n < ((buf[0] << 8) | buf[1]) + 2) {
+            int rc = read(fd, buf + n, sizeof(buf) - n);
+            if (rc <= 0) {
+                break;
+            }
+            n += rc;
+        }
+        if (n > 2 && n == ((buf[0] << 8) | buf[1]) + 2) {
+            int len = respond(buf + 2, n - 2, sizeof(buf) - 2, DnsPacket::RCODE_NOERROR,
+                              false, TCP_ANSWER_V4);
+            if (len > 0) {
+                buf[0] = len >> 8;
+                buf[1] = len & 0xff;
+                write(fd, buf, len + 2);
+            }
+        }
+        close(fd);
+    }
+
+    void run() {
+        struct pollfd pfds[2];
+
+        while (!mStop) {
+            pfds[0].fd = mUdp;
+            pfds[0].events = POLLIN;
+            pfds[1].fd = mTcp;
+            pfds[1].events = POLLIN;
+            // Stalling leaves connections in the backlog, never accepted.
+            if (poll(pfds, mMode == TRUNCATE_STALL ? 1 : 2, 50) <= 0) {
+                continue;
+            }
+            if (pfds[0].revents & POLLIN) {
+                serveUdp();
+            }
+            if (mMode != TRUNCATE_STALL && (pfds[1].revents & POLLIN)) {
+                serveTcp();
+            }
+        }
+    }
+};
+
+static uint64_t nowMs() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+class DnsStubResolverTest : public ::testing::Test {
+protected:
+    DnsStubResolver *mResolver;
+
+    virtual void SetUp() {
+        mResolver = DnsStubResolver::Instance();
+    }
+
+    virtual void TearDown() {
+        setServers(NULL, NULL);
+    }
+
+    void setServers(const FakeDnsServer *first, const FakeDnsServer *second) {
+        char addrs[2][32];
+        char *servers[2];
+        uint32_t removed[DnsStubResolver::MAX_SERVERS];
+        int numRemoved;
+        int n = 0;
+
+        if (first) {
+            first->address(addrs[n], sizeof(addrs[n]));
+            servers[n] = addrs[n];
+            n++;
+        }
+        if (second) {
+            second->address(addrs[n], sizeof(addrs[n]));
+            servers[n] = addrs[n];
+            n++;
+        }
+        ASSERT_GE(mResolver->setInterfaceServers(IFACE, servers, n, removed, &numRemoved), 0);
+    }
+
+    void expectAnswer(const DnsResponse &resp, const char *addr) {
+        EXPECT_EQ((int) DnsPacket::RCODE_NOERROR, resp.rcode);
+        ASSERT_EQ(1, resp.numAddrs);
+        EXPECT_EQ(AF_INET, resp.addrs[0].family);
+        EXPECT_EQ(inet_addr(addr), resp.addrs[0].addr.v4.s_addr);
+    }
+};
+
+TEST_F(DnsStubResolverTest, AnswersFromLocalServer) {
+    FakeDnsServer server(FakeDnsServer::ANSWER);
+    ASSERT_TRUE(server.start());
+    setServers(&server, NULL);
+
+    DnsResponse resp;
+    ASSERT_EQ(0, mResolver->query(IFACE, "www.example.com", DnsPacket::TYPE_A, &resp));
+    expectAnswer(resp, ANSWER_V4);
+    EXPECT_EQ(60, resp.ttl);
+}
+
+TEST_F(DnsStubResolverTest, NoServersFails) {
+    DnsResponse resp;
+    EXPECT_EQ(-1, mResolver->query(IFACE, "www.example.com", DnsPacket::TYPE_A, &resp));
+}
+
+// Both servers are asked at once, so a dead one costs no time whichever
+// way they are ranked.
+TEST_F(DnsStubResolverTest, RacesPastSilentServer) {
+    FakeDnsServer silent(FakeDnsServer::SILENT);
+    FakeDnsServer good(FakeDnsServer::ANSWER);
+    ASSERT_TRUE(silent.start());
+    ASSERT_TRUE(good.start());
+
+    for (int i = 0; i < 2; i++) {
+        if (i == 0) {
+            setServers(&silent, &good);
+        } else {
+            setServers(&good, &silent);
+        }
+        DnsResponse resp;
+        uint64_t start = nowMs();
+        ASSERT_EQ(0, mResolver->query(IFACE, "race.example.com", DnsPacket::TYPE_A, &resp));
+        EXPECT_LT(nowMs() - start, 1000U);
+        expectAnswer(resp, ANSWER_V4);
+    }
+    EXPECT_GE(good.queries(), 2);
+}
+
+TEST_F(DnsStubResolverTest, FailsOverFromServfail) {
+    FakeDnsServer broken(FakeDnsServer::SERVFAIL);
+    FakeDnsServer good(FakeDnsServer::ANSWER);
+    ASSERT_TRUE(broken.start());
+    ASSERT_TRUE(good.start());
+    setServers(&broken, &good);
+
+    DnsResponse resp;
+    ASSERT_EQ(0, mResolver->query(IFACE, "www.example.com", DnsPacket::TYPE_A, &resp));
+    expectAnswer(resp, ANSWER_V4);
+}
+
+TEST_F(DnsStubResolverTest, IgnoresReplyWithWrongId) {
+    FakeDnsServer server(FakeDnsServer::WRONG_ID_FIRST);
+    ASSERT_TRUE(server.start());
+    setServers(&server, NULL);
+
+    DnsResponse resp;
+    ASSERT_EQ(0, mResolver->query(IFACE, "www.example.com", DnsPacket::TYPE_A, &resp));
+    expectAnswer(resp, ANSWER_V4);
+}
+
+TEST_F(DnsStubResolverTest, RetriesTruncatedAnswerOverTcp) {
+    FakeDnsServer server(FakeDnsServer::TRUNCATE);
+    ASSERT_TRUE(server.start());
+    setServers(&server, NULL);
+
+    DnsResponse resp;
+    ASSERT_EQ(0, mResolver->query(IFACE, "big.example.com", DnsPacket::TYPE_A, &resp));
+    EXPECT_FALSE(resp.truncated);
+    expectAnswer(resp, TCP_ANSWER_V4);
+}
+
+TEST_F(DnsStubResolverTest, TcpRetryHonorsTimeout) {
+    FakeDnsServer server(FakeDnsServer::TRUNCATE_STALL);
+    ASSERT_TRUE(server.start());
+    setServers(&server, NULL);
+
+    DnsResponse resp;
+    uint64_t start = nowMs();
+    EXPECT_EQ(-1, mResolver->query(IFACE, "big.example.com", DnsPacket::TYPE_A, &resp, 300));
+    EXPECT_LT(nowMs() - start, 1000U);
+}
+
+TEST_F(DnsStubResolverTest, TimesOutWhenNobodyAnswers) {
+    FakeDnsServer silent(FakeDnsServer::SILENT);
+    ASSERT_TRUE(silent.start());
+    setServers(&silent, NULL);
+
+    DnsResponse resp;
+    uint64_t start = nowMs();
+    EXPECT_EQ(-1, mResolver->query(IFACE, "www.example.com", DnsPacket::TYPE_A, &resp, 300));
+    EXPECT_LT(nowMs() - start, 1000U);
+}